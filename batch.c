@@ -0,0 +1,319 @@
+#include "batch.h"
+#include "lanes.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of jobs a worker takes from its own queue at a time
+#define BATCH_CHUNK 16
+
+/* Range of jobs [begin, end) still owned by a worker. The owner takes chunks
+ * from the front and thieves take half of what is left from the back. */
+typedef struct WorkQueue {
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+  char padding[64];  // keep queues of different workers on different lines
+} WorkQueue;
+
+typedef struct BatchWorker {
+  const System *program;
+  BatchJob *jobs;
+  WorkQueue *queues;
+  int num_threads;
+  int id;
+} BatchWorker;
+
+static int has_suffix(const char *name, const char *suffix) {
+  size_t len = strlen(name), suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+/*
+Read the initial registers of every job from filename.
+
+A CSV file has one job per line with EAX,EDX,ECX and optionally ESP,EBP;
+empty lines and lines starting with # are skipped. A file ending in .bin holds
+native int32 records of EAX, EDX and ECX. Registers that are not given start
+like they do after initialize_system_with_size for the data segment of program.
+
+It returns 0 on success, or -1 if the file cannot be read or a line is invalid.
+*/
+int read_batch_inputs(const System *program, const char *filename,
+                      BatchJob **jobs, int *num_jobs) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  int binary = has_suffix(filename, ".bin");
+  int count = 0, capacity = 1024;
+  BatchJob *list = malloc(capacity * sizeof(BatchJob));
+  char line[256];
+  if (list == NULL) {
+    perror("Error allocating memory");
+    fclose(file);
+    return -1;
+  }
+  int line_number = 0;
+
+  for (;;) {
+    int values[5];
+    int given;
+
+    if (binary) {
+      if (fread(values, sizeof(int), 3, file) != 3) break;
+      given = 3;
+    } else {
+      if (fgets(line, sizeof(line), file) == NULL) break;
+      line_number++;
+      if (reformat(line) == 0 || line[0] == '#') continue;
+      given = sscanf(line, "%d ,%d ,%d ,%d ,%d", &values[0], &values[1],
+                     &values[2], &values[3], &values[4]);
+      if (given < 3) {
+        fprintf(stderr, "Error: invalid input on line %d of %s\n", line_number,
+                filename);
+        free(list);
+        fclose(file);
+        return -1;
+      }
+    }
+
+    if (count == capacity) {
+      BatchJob *grown = realloc(list, 2 * capacity * sizeof(BatchJob));
+      if (grown == NULL) {
+        perror("Error allocating memory");
+        free(list);
+        fclose(file);
+        return -1;
+      }
+      list = grown;
+      capacity *= 2;
+    }
+    BatchJob *job = &list[count++];
+    job->registers[EAX] = values[0];
+    job->registers[EDX] = values[1];
+    job->registers[ECX] = values[2];
+    job->registers[ESP] =
+        given > 3 ? values[3] : program->memory.data_size - 256;
+    job->registers[EBP] =
+        given > 4 ? values[4] : program->memory.data_size - 256;
+    job->registers[EIP] = 0;
+    job->result = SUCCESS;
+  }
+
+  fclose(file);
+  *jobs = list;
+  *num_jobs = count;
+  return 0;
+}
+
+/*
+Write the final registers and result of every job to filename, in the order of
+the input. A CSV file has a header line and one job per line; a file ending in
+.bin holds native int32 records of EAX, EDX, ECX, ESP, EBP, EIP and the
+ExecResult.
+
+It returns 0 on success, or -1 if the file cannot be written.
+*/
+int write_batch_outputs(const char *filename, const BatchJob *jobs,
+                        int num_jobs) {
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  if (has_suffix(filename, ".bin")) {
+    for (int i = 0; i < num_jobs; i++) {
+      int record[7];
+      memcpy(record, jobs[i].registers, sizeof(jobs[i].registers));
+      record[6] = jobs[i].result;
+      fwrite(record, sizeof(record), 1, file);
+    }
+  } else {
+    fprintf(file, "EAX,EDX,ECX,ESP,EBP,EIP,RESULT\n");
+    for (int i = 0; i < num_jobs; i++) {
+      const Registers *r = jobs[i].registers;
+      fprintf(file, "%d,%d,%d,%d,%d,%d,%s\n", r[EAX], r[EDX], r[ECX], r[ESP],
+              r[EBP], r[EIP], get_result_name(jobs[i].result));
+    }
+  }
+
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    perror("Error writing file");
+    return -1;
+  }
+  return 0;
+}
+
+/* Take the next chunk of jobs from the worker's own queue, or steal half of
+ * the remaining jobs of another worker. Returns 0 once every queue is empty. */
+static int take_jobs(BatchWorker *worker, int *begin, int *end) {
+  WorkQueue *own = &worker->queues[worker->id];
+
+  pthread_mutex_lock(&own->lock);
+  if (own->begin < own->end) {
+    *begin = own->begin;
+    *end = own->begin + BATCH_CHUNK < own->end ? own->begin + BATCH_CHUNK
+                                               : own->end;
+    own->begin = *end;
+    pthread_mutex_unlock(&own->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&own->lock);
+
+  for (int i = 1; i < worker->num_threads; i++) {
+    WorkQueue *victim = &worker->queues[(worker->id + i) % worker->num_threads];
+    pthread_mutex_lock(&victim->lock);
+    int left = victim->end - victim->begin;
+    if (left > 0) {
+      int stolen = left > 1 ? left / 2 : 1;
+      *end = victim->end;
+      *begin = victim->end - stolen;
+      victim->end = *begin;
+      pthread_mutex_unlock(&victim->lock);
+
+      // Keep the stolen jobs in our own queue so others can steal them back
+      pthread_mutex_lock(&own->lock);
+      own->begin = *begin;
+      own->end = *end;
+      *end = *begin + BATCH_CHUNK < *end ? *begin + BATCH_CHUNK : *end;
+      own->begin = *end;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return 0;
+}
+
+/* Worker for the lanes engine: every chunk is run LANE_COUNT jobs at a time
+ * on one lane group */
+static void *batch_lanes_worker(void *arg) {
+  BatchWorker *worker = arg;
+  LaneGroup group;
+  int begin, end;
+
+  if (initialize_lane_group(&group, worker->program) != 0) {
+    return NULL;
+  }
+
+  while (take_jobs(worker, &begin, &end)) {
+    for (int first = begin; first < end; first += LANE_COUNT) {
+      int lanes = end - first < LANE_COUNT ? end - first : LANE_COUNT;
+      reset_lane_group(&group, lanes);
+      for (int l = 0; l < lanes; l++) {
+        for (int r = 0; r < 6; r++) {
+          group.registers[r][l] = worker->jobs[first + l].registers[r];
+        }
+      }
+      execute_lanes(&group);
+      for (int l = 0; l < lanes; l++) {
+        BatchJob *job = &worker->jobs[first + l];
+        for (int r = 0; r < 6; r++) {
+          job->registers[r] = group.registers[r][l];
+        }
+        job->result = group.results[l];
+      }
+    }
+  }
+
+  free_lane_group(&group);
+  return NULL;
+}
+
+static void *batch_worker(void *arg) {
+  BatchWorker *worker = arg;
+  const System *program = worker->program;
+  System sys;
+  int begin, end;
+
+  if (program->engine == ENGINE_LANES) {
+    return batch_lanes_worker(arg);
+  }
+
+  if (initialize_system_with_size(&sys, program->memory.instruction_size,
+                                  program->memory.data_size) != 0) {
+    return NULL;
+  }
+  if (attach_program(&sys, program) != 0) {
+    free_system(&sys);
+    return NULL;
+  }
+  sys.engine = program->engine;
+
+  while (take_jobs(worker, &begin, &end)) {
+    for (int i = begin; i < end; i++) {
+      BatchJob *job = &worker->jobs[i];
+      reset_system(&sys);
+      memcpy(sys.registers, job->registers, sizeof(sys.registers));
+      job->result = execute_instructions(&sys);
+      memcpy(job->registers, sys.registers, sizeof(sys.registers));
+    }
+  }
+
+  free_system(&sys);
+  return NULL;
+}
+
+/*
+Run the program loaded into program once for every job, on num_threads
+threads. The decoded program is shared read-only by all the threads; each
+thread has its own System, which is reset before every job, or with the lanes
+engine its own lane group running LANE_COUNT jobs at once. Jobs are split
+evenly between the threads up front, and a thread that runs out of work steals
+half of the remaining jobs of another one.
+
+It returns 0 on success, or -1 if some jobs could not be run because no thread
+could set up a System.
+*/
+int run_batch(const System *program, BatchJob *jobs, int num_jobs,
+              int num_threads) {
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_jobs && num_jobs > 0) num_threads = num_jobs;
+
+  WorkQueue *queues = calloc(num_threads, sizeof(WorkQueue));
+  BatchWorker *workers = calloc(num_threads, sizeof(BatchWorker));
+  pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+  int status = 0;
+  if (queues == NULL || workers == NULL || threads == NULL) {
+    free(threads);
+    free(workers);
+    free(queues);
+    return -1;
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].begin = (int)((long long)num_jobs * i / num_threads);
+    queues[i].end = (int)((long long)num_jobs * (i + 1) / num_threads);
+    workers[i] = (BatchWorker){program, jobs, queues, num_threads, i};
+  }
+
+  // Worker 0 runs on the calling thread. If a thread cannot be started, the
+  // jobs in its queue are stolen by the others.
+  int started = 1;
+  for (; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, batch_worker,
+                       &workers[started]) != 0) {
+      break;
+    }
+  }
+  batch_worker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    if (queues[i].begin < queues[i].end) status = -1;
+    pthread_mutex_destroy(&queues[i].lock);
+  }
+  free(threads);
+  free(workers);
+  free(queues);
+  return status;
+}
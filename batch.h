@@ -0,0 +1,23 @@
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include "interpreter.h"
+
+/*
+One run of a batch. registers holds the initial EAX, EDX, ECX, ESP and EBP
+before the run and the final registers after it; result is the ExecResult of
+the run.
+*/
+typedef struct BatchJob {
+  Registers registers[6];
+  ExecResult result;
+} BatchJob;
+
+int read_batch_inputs(const System *program, const char *filename,
+                      BatchJob **jobs, int *num_jobs);
+int write_batch_outputs(const char *filename, const BatchJob *jobs,
+                        int num_jobs);
+int run_batch(const System *program, BatchJob *jobs, int num_jobs,
+              int num_threads);
+
+#endif
@@ -0,0 +1,836 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bytecode.h"
+#include "cache.h"
+#include "fusion.h"
+#include "interpreter.h"
+#include "lanes.h"
+#include "sampler.h"
+#include "scheduler.h"
+
+/*
+Benchmark suite for the execution engines.
+
+Every workload is a guest program generated here, so runs are reproducible
+without any input files. Each workload is run on every selected engine with a
+number of warmup runs and timed repetitions; the report gives the guest
+instructions per second, nanoseconds per instruction and milliseconds of the
+median run, and
+the load workloads give the time to load a large program, from its text, from
+bytecode and from a warm program cache. Results can also be
+written as JSON to track regressions between releases. The context switch
+workload gives the cost of switching between guests of a Scheduler.
+
+Every engine must end in the same state as the decoded engine; a mismatch is
+reported and makes the benchmark exit with a failure.
+*/
+
+// Data segment of every benchmark system, large enough for deep recursion
+#define BENCH_DATA_SIZE (1 << 16)
+
+typedef struct Buffer {
+  char *text;
+  size_t size;
+  size_t capacity;
+  int lines;
+} Buffer;
+
+typedef struct Workload {
+  const char *name;
+  void (*generate)(Buffer *out, int scale);
+} Workload;
+
+typedef struct BenchOptions {
+  int reps;
+  int warmup;
+  int scale;
+  const char *engines;
+  const char *filter;
+  const char *json;
+  int fusion;  // 0 to run without superinstructions, with --no-fusion
+  long long slice;  // instruction budget of each slice of the sliced runs
+  int guests;       // guests of the context switch workload
+} BenchOptions;
+
+typedef struct BenchResult {
+  const char *workload;
+  const char *engine;
+  unsigned long long instructions;
+  double best_ns;
+  double median_ns;
+  int matches;
+} BenchResult;
+
+static void emit(Buffer *out, const char *format, ...) {
+  va_list args;
+  for (;;) {
+    va_start(args, format);
+    int len = vsnprintf(out->text + out->size, out->capacity - out->size,
+                        format, args);
+    va_end(args);
+    if (out->size + len < out->capacity) {
+      out->size += len;
+      out->lines++;
+      return;
+    }
+    out->capacity = out->capacity ? 2 * out->capacity + len : 4096;
+    out->text = realloc(out->text, out->capacity);
+    if (out->text == NULL) {
+      perror("Error allocating memory");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*** Guest programs ***/
+
+/* Tight arithmetic loop: ADDL between registers and constants */
+static void generate_addl_loop(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%EAX\n");
+  emit(out, "MOVL $0 %%ECX\n");
+  emit(out, ".LOOP\n");
+  emit(out, "ADDL $3 %%EAX\n");
+  emit(out, "ADDL %%EAX %%EDX\n");
+  emit(out, "ADDL $1 %%ECX\n");
+  emit(out, "CMPL $%d %%ECX\n", 200000 * scale);
+  emit(out, "JL .LOOP\n");
+  emit(out, "END\n");
+}
+
+/* Recursion 500 calls deep, repeated: dominated by CALL and RET */
+static void generate_call_ret(Buffer *out, int scale) {
+  emit(out, "JMP .MAIN\n");
+  emit(out, ".REC\n");
+  emit(out, "CMPL $0 %%EAX\n");
+  emit(out, "JE .BASE\n");
+  emit(out, "ADDL $-1 %%EAX\n");
+  emit(out, "CALL .REC\n");
+  emit(out, "ADDL $1 %%EDX\n");
+  emit(out, ".BASE\n");
+  emit(out, "RET\n");
+  emit(out, ".MAIN\n");
+  emit(out, "MOVL $0 %%ECX\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL $500 %%EAX\n");
+  emit(out, "CALL .REC\n");
+  emit(out, "ADDL $1 %%ECX\n");
+  emit(out, "CMPL $%d %%ECX\n", 200 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+/* PUSHL and POPL of registers, constants and memory */
+static void generate_push_pop(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%ECX\n");
+  emit(out, "MOVL $64 %%EBP\n");
+  emit(out, ".LOOP\n");
+  emit(out, "PUSHL %%EAX\n");
+  emit(out, "PUSHL $5\n");
+  emit(out, "PUSHL %%ECX\n");
+  emit(out, "PUSHL 4(%%EBP)\n");
+  emit(out, "POPL %%EDX\n");
+  emit(out, "POPL 4(%%EBP)\n");
+  emit(out, "POPL %%EAX\n");
+  emit(out, "POPL %%EDX\n");
+  emit(out, "ADDL $1 %%ECX\n");
+  emit(out, "CMPL $%d %%ECX\n", 100000 * scale);
+  emit(out, "JL .LOOP\n");
+  emit(out, "END\n");
+}
+
+/* Walk over a 1000 word array with memory operands in MOVL and ADDL */
+static void generate_mem_movl(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%ECX\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL $0 %%EBP\n");
+  emit(out, ".INNER\n");
+  emit(out, "MOVL %%ECX (%%EBP)\n");
+  emit(out, "MOVL (%%EBP) %%EAX\n");
+  emit(out, "ADDL 4(%%EBP) %%EAX\n");
+  emit(out, "MOVL %%EAX 8(%%EBP)\n");
+  emit(out, "ADDL $4 %%EBP\n");
+  emit(out, "CMPL $4000 %%EBP\n");
+  emit(out, "JL .INNER\n");
+  emit(out, "ADDL $1 %%ECX\n");
+  emit(out, "CMPL $%d %%ECX\n", 100 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+/* Branch loop whose label sits behind padding lines, so the cost of a taken
+ * branch can be compared between a small and a large program */
+static void generate_branch(Buffer *out, int scale, int padding) {
+  emit(out, "MOVL $0 %%ECX\n");
+  emit(out, "JMP .LOOP\n");
+  for (int i = 0; i < padding; i++) {
+    emit(out, "MOVL $%d %%EAX\n", i);
+  }
+  emit(out, ".LOOP\n");
+  emit(out, "ADDL $1 %%ECX\n");
+  emit(out, "CMPL $%d %%ECX\n", 200000 * scale);
+  emit(out, "JL .LOOP\n");
+  emit(out, "END\n");
+}
+
+static void generate_branch_small(Buffer *out, int scale) {
+  generate_branch(out, scale, 0);
+}
+
+static void generate_branch_large(Buffer *out, int scale) {
+  generate_branch(out, scale, 50000);
+}
+
+/* Words of the arrays of the fill and copy workloads, 64 KB each */
+#define ARRAY_WORDS 16384
+
+/* Fill an array with the pass number, one word per iteration of a
+ * MOVL/ADDL/CMPL/JL loop */
+static void generate_fill_loop(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%EDX\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL $0 %%EBP\n");
+  emit(out, ".INNER\n");
+  emit(out, "MOVL %%EDX (%%EBP)\n");
+  emit(out, "ADDL $4 %%EBP\n");
+  emit(out, "CMPL $%d %%EBP\n", ARRAY_WORDS * 4);
+  emit(out, "JL .INNER\n");
+  emit(out, "ADDL $1 %%EDX\n");
+  emit(out, "CMPL $%d %%EDX\n", 20 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+/* The same fills with a single STOSL per pass */
+static void generate_fill_stosl(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%EDX\n");
+  emit(out, "MOVL $0 %%EBP\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL $%d %%ECX\n", ARRAY_WORDS);
+  emit(out, "STOSL %%EDX (%%EBP)\n");
+  emit(out, "ADDL $1 %%EDX\n");
+  emit(out, "CMPL $%d %%EDX\n", 20 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+/* Copy an array to the one after it, one word per iteration of a loop, after
+ * storing the pass number in its first word */
+static void generate_copy_loop(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%EDX\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL $0 %%EBP\n");
+  emit(out, "MOVL %%EDX (%%EBP)\n");
+  emit(out, ".INNER\n");
+  emit(out, "MOVL (%%EBP) %%EAX\n");
+  emit(out, "MOVL %%EAX %d(%%EBP)\n", ARRAY_WORDS * 4);
+  emit(out, "ADDL $4 %%EBP\n");
+  emit(out, "CMPL $%d %%EBP\n", ARRAY_WORDS * 4);
+  emit(out, "JL .INNER\n");
+  emit(out, "ADDL $1 %%EDX\n");
+  emit(out, "CMPL $%d %%EDX\n", 20 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+/* The same copies with a single MOVSL per pass */
+static void generate_copy_movsl(Buffer *out, int scale) {
+  emit(out, "MOVL $0 %%EDX\n");
+  emit(out, "MOVL $0 %%EBP\n");
+  emit(out, ".OUTER\n");
+  emit(out, "MOVL %%EDX (%%EBP)\n");
+  emit(out, "MOVL $%d %%ECX\n", ARRAY_WORDS);
+  emit(out, "MOVSL (%%EBP) %d(%%EBP)\n", ARRAY_WORDS * 4);
+  emit(out, "ADDL $1 %%EDX\n");
+  emit(out, "CMPL $%d %%EDX\n", 20 * scale);
+  emit(out, "JL .OUTER\n");
+  emit(out, "END\n");
+}
+
+static const Workload workloads[] = {
+    {"addl_loop", generate_addl_loop},
+    {"call_ret", generate_call_ret},
+    {"push_pop", generate_push_pop},
+    {"mem_movl", generate_mem_movl},
+    {"branch_small", generate_branch_small},
+    {"branch_large", generate_branch_large},
+    {"fill_loop", generate_fill_loop},
+    {"fill_stosl", generate_fill_stosl},
+    {"copy_loop", generate_copy_loop},
+    {"copy_movsl", generate_copy_movsl},
+};
+
+/* A program with one instruction per line, for the load workloads */
+static void generate_large_program(Buffer *out, int lines) {
+  emit(out, "MOVL $0 %%ECX\n");
+  for (int i = 0; i < lines; i++) {
+    switch (i % 4) {
+      case 0:
+        emit(out, "  ADDL   $%d  %%EAX\n", i);
+        break;
+      case 1:
+        emit(out, "MOVL %%EAX -4(%%EBP)\n");
+        break;
+      case 2:
+        emit(out, ".L%d\n", i);
+        break;
+      default:
+        emit(out, "JL .L%d\n", i - 1);
+        break;
+    }
+  }
+  emit(out, "END\n");
+}
+
+/*** Helpers ***/
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Write text to a new temporary file and return its name */
+static char *write_temp_file(const char *text, size_t size) {
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char *path = malloc(strlen(dir) + 32);
+  sprintf(path, "%s/asmbench-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, text, size) != (ssize_t)size) {
+    perror("Error writing temporary file");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  return path;
+}
+
+static void load_program(System *sys, const Buffer *program) {
+  if (initialize_system_with_size(sys, program->lines + 1, BENCH_DATA_SIZE) !=
+      0) {
+    perror("Error creating system");
+    exit(EXIT_FAILURE);
+  }
+  if (load_instructions_from_buffer(sys, program->text, program->size) != 0) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Number of instructions the program executes, counted with the decoded
+ * engine one step at a time */
+static unsigned long long count_instructions(System *sys) {
+  unsigned long long count = 0;
+  int halted = 0;
+  reset_system(sys);
+  for (;;) {
+    step_instruction(sys, &halted);
+    if (halted) break;
+    count++;
+  }
+  return count;
+}
+
+/* Checksum of the state left by a run, to compare engines */
+static unsigned long long state_checksum(const System *sys, ExecResult result) {
+  unsigned long long hash = 1469598103934665603ull;
+  for (int r = 0; r < 6; r++) {
+    hash = (hash ^ (unsigned)sys->registers[r]) * 1099511628211ull;
+  }
+  hash = (hash ^ (unsigned)sys->comparison_flag) * 1099511628211ull;
+  hash = (hash ^ (unsigned)sys->comparison_source) * 1099511628211ull;
+  hash = (hash ^ result) * 1099511628211ull;
+  for (int i = 0; i < sys->memory.data_size; i++) {
+    hash = (hash ^ (unsigned)sys->memory.data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static int engine_selected(const BenchOptions *options, const char *name) {
+  if (options->engines == NULL) return 1;
+  size_t len = strlen(name);
+  for (const char *p = options->engines; *p;) {
+    const char *end = strchr(p, ',');
+    size_t item = end ? (size_t)(end - p) : strlen(p);
+    if (item == len && strncmp(p, name, len) == 0) return 1;
+    p += item + (end != NULL);
+  }
+  return 0;
+}
+
+/*
+Time one engine on a loaded program. For the lanes engine LANE_COUNT copies of
+the program run at once, and instructions counts lanes x instructions.
+*/
+static BenchResult run_engine(const BenchOptions *options, const char *workload,
+                              System *sys, Engine engine,
+                              unsigned long long instructions,
+                              unsigned long long reference) {
+  BenchResult result = {workload, get_engine_name(engine), instructions, 0, 0,
+                        1};
+  double *times = malloc(options->reps * sizeof(double));
+  LaneGroup group;
+
+  if (engine == ENGINE_LANES) {
+    if (initialize_lane_group(&group, sys) != 0) {
+      perror("Error creating lane group");
+      exit(EXIT_FAILURE);
+    }
+    result.instructions = instructions * LANE_COUNT;
+  }
+  sys->engine = engine;
+
+  for (int rep = -options->warmup; rep < options->reps; rep++) {
+    ExecResult status;
+    double start, elapsed;
+
+    if (engine == ENGINE_LANES) {
+      reset_lane_group(&group, LANE_COUNT);
+      start = now_ns();
+      execute_lanes(&group);
+      elapsed = now_ns() - start;
+      if (group.steps != result.instructions) result.matches = 0;
+    } else {
+      reset_system(sys);
+      start = now_ns();
+      status = execute_instructions(sys);
+      elapsed = now_ns() - start;
+      if (state_checksum(sys, status) != reference) result.matches = 0;
+    }
+    if (rep >= 0) times[rep] = elapsed;
+  }
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  result.best_ns = times[0];
+  result.median_ns = times[options->reps / 2];
+  free(times);
+  if (engine == ENGINE_LANES) free_lane_group(&group);
+  return result;
+}
+
+/*
+Time the program run through execute_with_limits in slices of options->slice
+instructions, resuming after each one as a scheduler would. Compared with the
+decoded engine this gives the cost of the budget checks and of switching in
+and out of the run.
+*/
+static BenchResult run_sliced(const BenchOptions *options,
+                              const char *workload, System *sys,
+                              unsigned long long instructions,
+                              unsigned long long reference) {
+  BenchResult result = {workload, "sliced", instructions, 0, 0, 1};
+  double *times = malloc(options->reps * sizeof(double));
+  RunLimits limits = {options->slice, 0, NULL, 0};
+
+  for (int rep = -options->warmup; rep < options->reps; rep++) {
+    ExecResult status = SUCCESS;
+    RunResult run;
+
+    reset_system(sys);
+    double start = now_ns();
+    do {
+      run = execute_with_limits(sys, &limits);
+      if (status == SUCCESS) status = run.result;
+    } while (run.status == RUN_BUDGET_EXHAUSTED);
+    double elapsed = now_ns() - start;
+    if (state_checksum(sys, status) != reference) result.matches = 0;
+    if (rep >= 0) times[rep] = elapsed;
+  }
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  result.best_ns = times[0];
+  result.median_ns = times[options->reps / 2];
+  free(times);
+  return result;
+}
+
+/*
+Time the program run with a call stack sampler taking a sample every 10007
+instructions, the default of the interpreter. Compared with the sliced runs
+this gives the cost of keeping the shadow call stack.
+*/
+static BenchResult run_sampled(const BenchOptions *options,
+                               const char *workload, System *sys,
+                               unsigned long long instructions,
+                               unsigned long long reference) {
+  BenchResult result = {workload, "sampled", instructions, 0, 0, 1};
+  double *times = malloc(options->reps * sizeof(double));
+
+  for (int rep = -options->warmup; rep < options->reps; rep++) {
+    Sampler sampler;
+    reset_system(sys);
+    if (initialize_sampler(&sampler, sys, 10007, 0) != 0) {
+      perror("Error creating sampler");
+      exit(EXIT_FAILURE);
+    }
+    sys->sampler = &sampler;
+    double start = now_ns();
+    ExecResult status = execute_instructions(sys);
+    double elapsed = now_ns() - start;
+    sys->sampler = NULL;
+    free_sampler(&sampler);
+    if (state_checksum(sys, status) != reference) result.matches = 0;
+    if (rep >= 0) times[rep] = elapsed;
+  }
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  result.best_ns = times[0];
+  result.median_ns = times[options->reps / 2];
+  free(times);
+  return result;
+}
+
+static void print_result(const BenchResult *r) {
+  double ns_per_inst = r->median_ns / r->instructions;
+  printf("%-14s %-9s %14llu %9.2f %12.1f %10.3f%s\n", r->workload, r->engine,
+         r->instructions, ns_per_inst, 1e3 / ns_per_inst, r->median_ns / 1e6,
+         r->matches ? "" : "  MISMATCH");
+}
+
+/*** Load workloads ***/
+
+typedef struct LoadResult {
+  const char *name;
+  int lines;
+  double best_ms;
+  double median_ms;
+} LoadResult;
+
+static LoadResult time_load(const BenchOptions *options, const char *name,
+                            const char *path, int lines, int bytecode,
+                            ProgramCache *cache) {
+  LoadResult result = {name, lines, 0, 0};
+  double *times = malloc(options->reps * sizeof(double));
+
+  for (int rep = -options->warmup; rep < options->reps; rep++) {
+    System sys;
+    if (initialize_system_with_size(&sys, lines + 2, MEMORY_SIZE) != 0) {
+      perror("Error creating system");
+      exit(EXIT_FAILURE);
+    }
+    double start = now_ns();
+    if (cache != NULL) {
+      if (load_cached_program_from_file(cache, &sys, path) != 0) {
+        exit(EXIT_FAILURE);
+      }
+    } else if (bytecode) {
+      if (load_bytecode_from_file(&sys, path) != 0) exit(EXIT_FAILURE);
+    } else if (load_instructions_from_file(&sys, path) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    double elapsed = now_ns() - start;
+    free_system(&sys);
+    if (rep >= 0) times[rep] = elapsed / 1e6;
+  }
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  result.best_ms = times[0];
+  result.median_ms = times[options->reps / 2];
+  free(times);
+  printf("%-14s %9d lines %9.2f ms (best %.2f ms)\n", name, lines,
+         result.median_ms, result.best_ms);
+  return result;
+}
+
+static int run_load_workloads(const BenchOptions *options,
+                              LoadResult *results) {
+  int lines = 50000 * options->scale;
+  Buffer program = {0};
+  generate_large_program(&program, lines);
+
+  char *text_path = write_temp_file(program.text, program.size);
+  char *bytecode_path = write_temp_file("", 0);
+
+  System sys;
+  if (initialize_system_with_size(&sys, program.lines + 1, MEMORY_SIZE) != 0) {
+    perror("Error creating system");
+    exit(EXIT_FAILURE);
+  }
+  if (load_instructions_from_file(&sys, text_path) != 0) exit(EXIT_FAILURE);
+  if (save_bytecode(&sys, bytecode_path) != 0) exit(EXIT_FAILURE);
+  free_system(&sys);
+
+  results[0] =
+      time_load(options, "load_text", text_path, program.lines, 0, NULL);
+  results[1] = time_load(options, "load_bytecode", bytecode_path,
+                         program.lines, 1, NULL);
+
+  // The program is published first, so every timed load attaches it
+  char cache_name[64];
+  snprintf(cache_name, sizeof(cache_name), "asm-bench-%d", (int)getpid());
+  ProgramCache *cache = open_program_cache(cache_name, (size_t)1 << 30);
+  if (cache == NULL) {
+    perror("Error opening program cache");
+    exit(EXIT_FAILURE);
+  }
+  if (initialize_system_with_size(&sys, program.lines + 2, MEMORY_SIZE) != 0 ||
+      load_cached_program_from_file(cache, &sys, text_path) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  free_system(&sys);
+  results[2] = time_load(options, "load_cached", text_path, program.lines, 0,
+                         cache);
+  close_program_cache(cache);
+  remove_program_cache(cache_name);
+
+  unlink(text_path);
+  unlink(bytecode_path);
+  free(text_path);
+  free(bytecode_path);
+  free(program.text);
+  return 3;
+}
+
+/*** Context switch workload ***/
+
+typedef struct SwitchResult {
+  int guests;
+  unsigned long long switches;
+  double best_ns;    // per switch
+  double median_ns;
+} SwitchResult;
+
+/* Iterations of the loop of every guest, each one a slice of its own */
+#define SWITCH_ITERATIONS 1000
+
+/* Run options->guests guests of program to the end with slices of slice
+ * instructions and return the time taken. Every guest must end with ECX at
+ * SWITCH_ITERATIONS * scale. */
+static double time_guests(const BenchOptions *options, const System *program,
+                          long long slice, unsigned long long *switches) {
+  Scheduler sched;
+  if (initialize_scheduler(&sched, program, options->guests, slice) != 0) {
+    perror("Error creating scheduler");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < options->guests; i++) add_guest(&sched, NULL, NULL);
+
+  double start = now_ns();
+  run_scheduler(&sched, NULL, NULL);
+  double elapsed = now_ns() - start;
+
+  for (int i = 0; i < options->guests; i++) {
+    if (sched.guests[i].sys.registers[ECX] !=
+        SWITCH_ITERATIONS * options->scale) {
+      printf("context_switch: guest %d did not finish its loop\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  *switches = sched.switches;
+  free_scheduler(&sched);
+  return elapsed;
+}
+
+/*
+Cost of a switch between guests: the guests run a short loop once with a
+slice per iteration and once with each guest in a single slice, and the
+difference is divided by the number of extra slices. The guests have the
+default data segment size, as a host running many of them would give them.
+*/
+static SwitchResult run_switch_workload(const BenchOptions *options) {
+  SwitchResult result = {options->guests, 0, 0, 0};
+  double *times = malloc(options->reps * sizeof(double));
+  Buffer program = {0};
+  System sys;
+
+  emit(&program, "MOVL $0 %%ECX\n");
+  emit(&program, ".LOOP\n");
+  emit(&program, "ADDL $1 %%ECX\n");
+  emit(&program, "CMPL $%d %%ECX\n", SWITCH_ITERATIONS * options->scale);
+  emit(&program, "JL .LOOP\n");
+  emit(&program, "END\n");
+  if (initialize_system_with_size(&sys, program.lines + 1, MEMORY_SIZE) != 0 ||
+      load_instructions_from_buffer(&sys, program.text, program.size) != 0) {
+    perror("Error creating system");
+    exit(EXIT_FAILURE);
+  }
+  free(program.text);
+  if (!options->fusion) unfuse_instructions(&sys);
+
+  for (int rep = -options->warmup; rep < options->reps; rep++) {
+    unsigned long long sliced_switches, whole_switches;
+    double sliced = time_guests(options, &sys, 1, &sliced_switches);
+    double whole = time_guests(options, &sys, 1LL << 62, &whole_switches);
+    result.switches = sliced_switches - whole_switches;
+    if (rep >= 0) times[rep] = (sliced - whole) / result.switches;
+  }
+
+  qsort(times, options->reps, sizeof(double), compare_doubles);
+  result.best_ns = times[0];
+  result.median_ns = times[options->reps / 2];
+  free(times);
+  free_system(&sys);
+  printf("%-14s %9d guests %8.2f ns/switch (best %.2f ns, %llu switches)\n",
+         "context_switch", result.guests, result.median_ns, result.best_ns,
+         result.switches);
+  return result;
+}
+
+/*** Report ***/
+
+static void write_json(const BenchOptions *options, const BenchResult *results,
+                       int num_results, const LoadResult *loads,
+                       int num_loads, const SwitchResult *switching) {
+  FILE *file = fopen(options->json, "w");
+  if (!file) {
+    perror("Error opening file");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(file, "{\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"scale\": %d,\n",
+          options->reps, options->warmup, options->scale);
+  fprintf(file, "  \"lane_count\": %d,\n  \"fusion\": %s,\n", LANE_COUNT,
+          options->fusion ? "true" : "false");
+  fprintf(file, "  \"slice\": %lld,\n", options->slice);
+  fprintf(file, "  \"benchmarks\": [\n");
+  for (int i = 0; i < num_results; i++) {
+    const BenchResult *r = &results[i];
+    double ns_per_inst = r->median_ns / r->instructions;
+    fprintf(file,
+            "    {\"workload\": \"%s\", \"engine\": \"%s\", "
+            "\"instructions\": %llu, \"median_ns\": %.0f, \"best_ns\": %.0f, "
+            "\"ns_per_instruction\": %.4f, \"instructions_per_second\": %.0f, "
+            "\"matches_reference\": %s}%s\n",
+            r->workload, r->engine, r->instructions, r->median_ns, r->best_ns,
+            ns_per_inst, 1e9 / ns_per_inst, r->matches ? "true" : "false",
+            i + 1 < num_results ? "," : "");
+  }
+  fprintf(file, "  ],\n  \"loads\": [\n");
+  for (int i = 0; i < num_loads; i++) {
+    fprintf(file,
+            "    {\"name\": \"%s\", \"lines\": %d, \"median_ms\": %.3f, "
+            "\"best_ms\": %.3f}%s\n",
+            loads[i].name, loads[i].lines, loads[i].median_ms,
+            loads[i].best_ms, i + 1 < num_loads ? "," : "");
+  }
+  fprintf(file, "  ]");
+  if (switching != NULL) {
+    fprintf(file,
+            ",\n  \"context_switch\": {\"guests\": %d, \"switches\": %llu, "
+            "\"median_ns_per_switch\": %.2f, \"best_ns_per_switch\": %.2f}",
+            switching->guests, switching->switches, switching->median_ns,
+            switching->best_ns);
+  }
+  fprintf(file, "\n}\n");
+  fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options = {5, 1, 1, NULL, NULL, NULL, 1, 10000, 1024};
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      options.reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+      options.warmup = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      options.scale = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--engines") == 0 && i + 1 < argc) {
+      options.engines = argv[++i];
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      options.json = argv[++i];
+    } else if (strcmp(argv[i], "--no-fusion") == 0) {
+      options.fusion = 0;
+    } else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) {
+      options.slice = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--guests") == 0 && i + 1 < argc) {
+      options.guests = atoi(argv[++i]);
+    } else {
+      printf("Usage: %s [--reps N] [--warmup N] [--scale N] "
+             "[--engines decoded,threaded,lanes,jit,blocks,sliced,sampled,"
+             "string] [--filter NAME] [--json FILE] [--no-fusion] [--slice N] [--guests N]\n",
+             argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.reps < 1) options.reps = 1;
+  if (options.warmup < 0) options.warmup = 0;
+  if (options.scale < 1) options.scale = 1;
+  if (options.slice < 1) options.slice = 1;
+  if (options.guests < 1) options.guests = 1;
+
+  int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+  BenchResult *results =
+      malloc(num_workloads * (ENGINE_UNKNOWN + 2) * sizeof(BenchResult));
+  int num_results = 0, mismatches = 0;
+
+  printf("%-14s %-9s %14s %9s %12s %10s\n", "workload", "engine",
+         "instructions", "ns/inst", "Minst/s", "ms/run");
+
+  for (int w = 0; w < num_workloads; w++) {
+    if (options.filter && strstr(workloads[w].name, options.filter) == NULL) {
+      continue;
+    }
+    Buffer program = {0};
+    System sys;
+    workloads[w].generate(&program, options.scale);
+    load_program(&sys, &program);
+    free(program.text);
+    if (!options.fusion) unfuse_instructions(&sys);
+
+    unsigned long long instructions = count_instructions(&sys);
+    reset_system(&sys);
+    sys.engine = ENGINE_DECODED;
+    ExecResult status = execute_instructions(&sys);
+    unsigned long long reference = state_checksum(&sys, status);
+
+    for (Engine engine = 0; engine < ENGINE_UNKNOWN; engine++) {
+      if (!engine_selected(&options, get_engine_name(engine))) continue;
+      BenchResult *r = &results[num_results++];
+      *r = run_engine(&options, workloads[w].name, &sys, engine, instructions,
+                      reference);
+      print_result(r);
+      mismatches += !r->matches;
+    }
+    if (engine_selected(&options, "sliced")) {
+      BenchResult *r = &results[num_results++];
+      *r = run_sliced(&options, workloads[w].name, &sys, instructions,
+                      reference);
+      print_result(r);
+      mismatches += !r->matches;
+    }
+    if (engine_selected(&options, "sampled")) {
+      BenchResult *r = &results[num_results++];
+      *r = run_sampled(&options, workloads[w].name, &sys, instructions,
+                       reference);
+      print_result(r);
+      mismatches += !r->matches;
+    }
+    free_system(&sys);
+  }
+
+  LoadResult loads[3];
+  int num_loads = 0;
+  if (options.filter == NULL ||
+      strstr("load_text load_bytecode load_cached", options.filter) != NULL) {
+    printf("\n");
+    num_loads = run_load_workloads(&options, loads);
+  }
+
+  SwitchResult switching;
+  int has_switching = 0;
+  if (options.filter == NULL ||
+      strstr("context_switch", options.filter) != NULL) {
+    switching = run_switch_workload(&options);
+    has_switching = 1;
+  }
+
+  if (options.json) {
+    write_json(&options, results, num_results, loads, num_loads,
+               has_switching ? &switching : NULL);
+  }
+  free(results);
+
+  if (mismatches) {
+    printf("\n%d engine runs did not match the decoded engine\n", mismatches);
+    return EXIT_FAILURE;
+  }
+  return 0;
+}
@@ -0,0 +1,536 @@
+#include "blocks.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Basic-block engine.
+
+The decoded program is split into blocks at labels and after every branch,
+CALL, RET and END, and each block is formed once, the first time it is
+entered. While a block is formed the value of every register is followed as
+an offset from its value at block entry, as long as it only changes by
+PUSHL, POPL, or ADDL, SUBL, INCL or DECL of a constant. Each data access and
+ESP update through such a register becomes a range of offsets, and all of
+them are checked together when the block is entered.
+
+When the checks pass, the block runs as a straight-line sequence of handlers
+that check nothing, and EIP is only set once at the end. When they fail, the
+block is run one instruction at a time by step_instruction, which reports the
+errors exactly like the decoded engine. Accesses through a register whose
+value is not followed, invalid operands and bad jump targets are always left
+to step_instruction.
+*/
+
+typedef enum BlockOpKind {
+#define BLOCK_KIND(name, op, src, dst) BLOCK_##name,
+  SPECIALIZED_OPCODES(BLOCK_KIND)
+#undef BLOCK_KIND
+  BLOCK_PUSHL,
+  BLOCK_POPL,
+  BLOCK_INTERPRET,  // run by step_instruction, with its own checks
+  /* The last op of every block is one of the exits below */
+  EXIT_FALLTHROUGH,  // continue with the instruction after the block
+  EXIT_JUMP,         // JMP or conditional jump to a valid target
+  EXIT_CALL,
+  EXIT_RET,
+  EXIT_END,
+  EXIT_INTERPRETED   // the last op was interpreted and has set EIP
+} BlockOpKind;
+
+/* Conditions of the jumps as a mask of comparison outcomes
+ * (ComparisonOutcome), as in execute_jmp_op */
+static const unsigned char jump_conditions[OP_COUNT] = {
+    [OP_JMP] = COMPARE_LESS | COMPARE_EQUAL | COMPARE_GREATER,
+    [OP_JE] = COMPARE_EQUAL,
+    [OP_JNE] = COMPARE_LESS | COMPARE_GREATER,
+    [OP_JL] = COMPARE_LESS,
+    [OP_JG] = COMPARE_GREATER,
+    [OP_JLE] = COMPARE_LESS | COMPARE_EQUAL,
+    [OP_JGE] = COMPARE_GREATER | COMPARE_EQUAL,
+    [OP_JA] = COMPARE_ABOVE,
+    [OP_JB] = COMPARE_BELOW};
+
+// Offsets of the registers from their values at block entry
+typedef struct Tracker {
+  long long delta[EIP];
+  int known[EIP];
+  int used[EIP];
+  long long min_offset[EIP];
+  long long max_offset[EIP];
+} Tracker;
+
+/* Record an access at offset from the entry value of reg */
+static void use_range(Tracker *t, RegisterName reg, long long offset) {
+  offset += t->delta[reg];
+  if (!t->used[reg] || offset < t->min_offset[reg]) t->min_offset[reg] = offset;
+  if (!t->used[reg] || offset > t->max_offset[reg]) t->max_offset[reg] = offset;
+  t->used[reg] = 1;
+}
+
+/* 1 if a memory operand can be checked at block entry */
+static int is_tracked(const Tracker *t, MemoryType operand) {
+  return operand.type != MEM || t->known[operand.reg];
+}
+
+/* 1 if an operand reads or writes EIP, which ends the block */
+static int uses_eip(MemoryType operand) {
+  return (operand.type == REG || operand.type == MEM) && operand.reg == EIP;
+}
+
+/* Record the op for a MOVL, CMPL or arithmetic instruction and follow its
+ * destination */
+static int form_operation(Tracker *t, const Instruction *inst) {
+  Opcode specialized = get_specialized_opcode(inst);
+  int kind = BLOCK_INTERPRET;
+
+  if (specialized != inst->op && is_tracked(t, inst->src) &&
+      is_tracked(t, inst->dst)) {
+    switch (specialized) {
+#define BLOCK_CASE(name, op, src, dst) \
+  case name:                           \
+    kind = BLOCK_##name;               \
+    break;
+      SPECIALIZED_OPCODES(BLOCK_CASE)
+#undef BLOCK_CASE
+      default:
+        break;
+    }
+    if (inst->src.type == MEM) use_range(t, inst->src.reg, inst->src.value);
+    if (inst->dst.type == MEM) use_range(t, inst->dst.reg, inst->dst.value);
+  }
+
+  if (inst->op != OP_CMPL && inst->dst.type == REG) {
+    if ((inst->op == OP_ADDL || inst->op == OP_INCL) &&
+        inst->src.type == CONST) {
+      t->delta[inst->dst.reg] += inst->src.value;
+    } else if ((inst->op == OP_SUBL || inst->op == OP_DECL) &&
+               inst->src.type == CONST) {
+      t->delta[inst->dst.reg] -= inst->src.value;
+    } else {
+      t->known[inst->dst.reg] = 0;
+    }
+  }
+  return kind;
+}
+
+/* Form the block starting at instruction pc */
+static Block *form_block(BlockCache *cache, const System *sys, int pc) {
+  const Memory *mem = &sys->memory;
+  int n = mem->num_instructions;
+  int max_target = (mem->instruction_size - 1) * 4;
+  BlockOpKind exit = EXIT_FALLTHROUGH;
+  Tracker t;
+  int num_ops = 0, k;
+
+  memset(&t, 0, sizeof(t));
+  for (int r = EAX; r < EIP; r++) t.known[r] = 1;
+
+  for (k = pc; k < n; k++) {
+    const Instruction *inst = &mem->code[k];
+    int kind = BLOCK_INTERPRET;
+    int valid_target = inst->target >= 0 && inst->target <= max_target;
+
+    if (k > pc && cache->leaders[k]) break;
+    if (uses_eip(inst->src) || uses_eip(inst->dst)) {
+      if (k == pc) {
+        cache->scratch[num_ops++] = (BlockOp){BLOCK_INTERPRET, k * 4, inst, NULL};
+        exit = EXIT_INTERPRETED;
+        k++;
+      }
+      break;
+    }
+
+    switch (inst->op) {
+      case OP_MOVL:
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_IMULL:
+      case OP_ANDL:
+      case OP_ORL:
+      case OP_XORL:
+      case OP_SHLL:
+      case OP_SARL:
+      case OP_INCL:
+      case OP_DECL:
+      case OP_CMPL:
+        kind = form_operation(&t, inst);
+        break;
+      case OP_PUSHL:
+        if (t.known[ESP] && is_tracked(&t, inst->src) &&
+            inst->src.type != UNKNOWN) {
+          use_range(&t, ESP, -4);
+          if (inst->src.type == MEM) {
+            use_range(&t, inst->src.reg, inst->src.value);
+          }
+          kind = BLOCK_PUSHL;
+          t.delta[ESP] -= 4;
+        } else {
+          t.known[ESP] = 0;
+        }
+        break;
+      case OP_POPL:
+        if (t.known[ESP] && is_tracked(&t, inst->dst) &&
+            (inst->dst.type == REG || inst->dst.type == MEM)) {
+          use_range(&t, ESP, 0);
+          use_range(&t, ESP, 4);
+          if (inst->dst.type == MEM) {
+            use_range(&t, inst->dst.reg, inst->dst.value);
+          }
+          kind = BLOCK_POPL;
+          t.delta[ESP] += 4;
+        } else {
+          t.known[ESP] = 0;
+        }
+        if (inst->dst.type == REG) t.known[inst->dst.reg] = 0;
+        break;
+      case OP_JMP:
+      case OP_JE:
+      case OP_JNE:
+      case OP_JL:
+      case OP_JG:
+      case OP_JLE:
+      case OP_JGE:
+      case OP_JA:
+      case OP_JB:
+        exit = valid_target ? EXIT_JUMP : EXIT_INTERPRETED;
+        break;
+      case OP_CALL:
+        if (valid_target && t.known[ESP]) {
+          use_range(&t, ESP, -4);
+          exit = EXIT_CALL;
+        } else {
+          exit = EXIT_INTERPRETED;
+        }
+        break;
+      case OP_RET:
+        if (t.known[ESP]) {
+          use_range(&t, ESP, 0);
+          use_range(&t, ESP, 4);
+          exit = EXIT_RET;
+        } else {
+          exit = EXIT_INTERPRETED;
+        }
+        break;
+      case OP_END:
+        exit = EXIT_END;
+        break;
+      case OP_MOVSL:
+      case OP_STOSL:
+      case OP_CMPSL:
+        // Interpreted, as their ranges depend on ECX, which they change
+        t.known[ECX] = 0;
+        break;
+      default:
+        continue;  // labels and NOPs need no op
+    }
+
+    if (exit != EXIT_FALLTHROUGH) {
+      if (exit == EXIT_INTERPRETED) {
+        cache->scratch[num_ops++] = (BlockOp){BLOCK_INTERPRET, k * 4, inst, NULL};
+      }
+      k++;
+      break;
+    }
+    cache->scratch[num_ops++] = (BlockOp){kind, k * 4, inst, NULL};
+  }
+
+  // The exit op; an interpreted exit runs after the interpreted op
+  cache->scratch[num_ops++] = (BlockOp){exit, (k - 1) * 4, &mem->code[k - 1], NULL};
+
+  Block *block = malloc(sizeof(Block) + num_ops * sizeof(BlockOp));
+  if (block == NULL) return NULL;
+  block->start = pc * 4;
+  block->length = k - pc;
+  block->threaded = 0;
+  block->num_checks = 0;
+  for (int r = EAX; r < EIP; r++) {
+    if (t.used[r]) {
+      block->checks[block->num_checks++] =
+          (BlockCheck){r, t.min_offset[r], t.max_offset[r]};
+    }
+  }
+  block->num_ops = num_ops;
+  memcpy(block->ops, cache->scratch, num_ops * sizeof(BlockOp));
+  return block;
+}
+
+/*
+Create an empty block cache for the program loaded into sys. Instructions
+that labels point at are marked as block starts.
+
+It returns the cache, or NULL if it cannot be allocated.
+*/
+BlockCache *create_block_cache(const System *sys) {
+  const Memory *mem = &sys->memory;
+  int n = mem->num_instructions > 0 ? mem->num_instructions : 1;
+  BlockCache *cache = calloc(1, sizeof(BlockCache));
+  if (cache == NULL) return NULL;
+  cache->blocks = calloc(n, sizeof(Block *));
+  cache->leaders = calloc(n, 1);
+  cache->scratch = malloc((n + 1) * sizeof(BlockOp));
+  if (cache->blocks == NULL || cache->leaders == NULL ||
+      cache->scratch == NULL) {
+    free_block_cache(cache);
+    return NULL;
+  }
+  cache->program = mem->code;
+  cache->num_instructions = mem->num_instructions;
+  cache->instruction_size = mem->instruction_size;
+  for (int i = 0; i < mem->label_table_size; i++) {
+    int address = mem->labels[i].address;
+    if (mem->labels[i].name != NULL && address >= 0 &&
+        address / 4 < mem->num_instructions) {
+      cache->leaders[address / 4] = 1;
+    }
+  }
+  return cache;
+}
+
+void free_block_cache(BlockCache *cache) {
+  if (cache == NULL) return;
+  if (cache->blocks != NULL) {
+    for (int i = 0; i < cache->num_instructions; i++) free(cache->blocks[i]);
+  }
+  free(cache->blocks);
+  free(cache->leaders);
+  free(cache->scratch);
+  free(cache);
+}
+
+/* Return the block starting at instruction pc, forming it on first use, or
+ * NULL if it cannot be allocated */
+Block *get_block(BlockCache *cache, const System *sys, int pc) {
+  if (cache->blocks[pc] == NULL) {
+    cache->blocks[pc] = form_block(cache, sys, pc);
+  }
+  return cache->blocks[pc];
+}
+
+/* Return the block cache of sys, creating it if the system has none yet or
+ * its program has changed since */
+static BlockCache *get_block_cache(System *sys) {
+  BlockCache *cache = sys->blocks;
+  if (cache != NULL && cache->program == sys->memory.code &&
+      cache->num_instructions == sys->memory.num_instructions &&
+      cache->instruction_size == sys->memory.instruction_size) {
+    return cache;
+  }
+  free_block_cache(cache);
+  sys->blocks = create_block_cache(sys);
+  return sys->blocks;
+}
+
+/* Address of the data word of a memory operand already known to be valid */
+static inline int *unchecked_word(System *sys, MemoryType operand) {
+  return &sys->memory.data[(sys->registers[operand.reg] + operand.value) / 4];
+}
+
+/* MOVL, CMPL or arithmetic instruction with known operand types and operands checked at block
+ * entry, as execute_specialized_op without the checks */
+static inline __attribute__((always_inline)) void
+execute_unchecked_op(System *sys, const Instruction *inst, Opcode op,
+                     DataType src_type, DataType dst_type) {
+  int value;
+  int *destination;
+
+  if (src_type == MEM) {
+    value = *unchecked_word(sys, inst->src);
+  } else if (src_type == REG) {
+    value = sys->registers[inst->src.reg];
+  } else {
+    value = inst->src.value;
+  }
+
+  if (dst_type == MEM) {
+    destination = unchecked_word(sys, inst->dst);
+  } else if (dst_type == REG) {
+    destination = &sys->registers[inst->dst.reg];
+  } else {
+    destination = (int *)&inst->dst.value;
+  }
+
+  if (op == OP_CMPL) {
+    sys->comparison_flag = (int)((unsigned)*destination - (unsigned)value);
+    sys->comparison_source = value;
+  } else if (op == OP_MOVL) {
+    *destination = value;
+  } else {
+    *destination = apply_alu_op(op, *destination, value);
+  }
+}
+
+/* 1 if every check of the block passes for the current registers */
+static inline int block_checks_pass(const System *sys, const Block *block) {
+  long long limit = sys->memory.data_limit;
+  for (int c = 0; c < block->num_checks; c++) {
+    long long base = sys->registers[block->checks[c].reg];
+    if (base + block->checks[c].min_offset < 0 ||
+        base + block->checks[c].max_offset > limit) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+Run the program block by block. The bounds of a block are checked once when
+it is entered, and EIP is checked once when it is left. Like the threaded
+engine, ops jump straight to the handler of the next op, and exits go straight
+to the entry of the next block. A block whose checks fail, and any EIP that is
+not a multiple of 4, is run with step_instruction.
+
+Results are the same as with execute_decoded_instructions. If the cache cannot
+be allocated the program is run by the decoded engine instead.
+*/
+ExecResult execute_block_instructions(System *sys) {
+  BlockCache *cache = get_block_cache(sys);
+  ExecResult status = SUCCESS, result;
+  int *registers = sys->registers;
+  int *data = sys->memory.data;
+  const BlockOp *op;
+  const Instruction *inst;
+  Block *block;
+  int end, value, outcome, halted = 0;
+
+  if (cache == NULL) return execute_decoded_instructions(sys);
+
+// Keep the first error reported by an instruction
+#define RECORD(result)                          \
+  do {                                          \
+    if (status == SUCCESS) status = (result);   \
+  } while (0)
+
+#if USE_COMPUTED_GOTO
+  static const void *const handlers[] = {
+#define BLOCK_LABEL(name, op, src, dst) [BLOCK_##name] = &&do_BLOCK_##name,
+      SPECIALIZED_OPCODES(BLOCK_LABEL)
+#undef BLOCK_LABEL
+      [BLOCK_PUSHL] = &&do_BLOCK_PUSHL,
+      [BLOCK_POPL] = &&do_BLOCK_POPL,
+      [BLOCK_INTERPRET] = &&do_BLOCK_INTERPRET,
+      [EXIT_FALLTHROUGH] = &&do_EXIT_FALLTHROUGH,
+      [EXIT_JUMP] = &&do_EXIT_JUMP,
+      [EXIT_CALL] = &&do_EXIT_CALL,
+      [EXIT_RET] = &&do_EXIT_RET,
+      [EXIT_END] = &&do_EXIT_END,
+      [EXIT_INTERPRETED] = &&do_EXIT_INTERPRETED};
+
+#define HANDLER(kind) do_##kind:
+#define NEXT()              \
+  do {                      \
+    op++;                   \
+    inst = op->inst;        \
+    goto *op->handler;      \
+  } while (0)
+#else
+#define HANDLER(kind) case kind:
+#define NEXT()              \
+  do {                      \
+    op++;                   \
+    inst = op->inst;        \
+    goto dispatch;          \
+  } while (0)
+#endif
+
+enter:
+  {
+    int eip = registers[EIP];
+    int pc = eip / 4;
+    if (eip < 0 || pc >= sys->memory.num_instructions) return status;
+
+    block = eip % 4 == 0 ? get_block(cache, sys, pc) : NULL;
+    if (block == NULL || !block_checks_pass(sys, block)) {
+      int length = block != NULL ? block->length : 1;
+      for (int k = 0; k < length; k++) {
+        result = step_instruction(sys, &halted);
+        if (halted) return status;
+        RECORD(result);
+      }
+      goto enter;
+    }
+  }
+
+#if USE_COMPUTED_GOTO
+  if (!block->threaded) {
+    for (int i = 0; i < block->num_ops; i++) {
+      block->ops[i].handler = handlers[block->ops[i].kind];
+    }
+    block->threaded = 1;
+  }
+#endif
+  end = block->start + block->length * 4;
+  op = block->ops;
+  inst = op->inst;
+
+#if USE_COMPUTED_GOTO
+  goto *op->handler;
+#else
+dispatch:
+  switch (op->kind) {
+#endif
+
+#define UNCHECKED_HANDLER(name, op_, src_, dst_)     \
+  HANDLER(BLOCK_##name)                              \
+    execute_unchecked_op(sys, inst, op_, src_, dst_); \
+    NEXT();
+  SPECIALIZED_OPCODES(UNCHECKED_HANDLER)
+#undef UNCHECKED_HANDLER
+
+  HANDLER(BLOCK_PUSHL)
+    value = inst->src.type == MEM   ? *unchecked_word(sys, inst->src)
+            : inst->src.type == REG ? registers[inst->src.reg]
+                                    : inst->src.value;
+    registers[ESP] -= 4;
+    data[registers[ESP] / 4] = value;
+    NEXT();
+  HANDLER(BLOCK_POPL)
+    value = data[registers[ESP] / 4];
+    if (inst->dst.type == MEM) {
+      *unchecked_word(sys, inst->dst) = value;
+    } else {
+      registers[inst->dst.reg] = value;
+    }
+    registers[ESP] += 4;
+    NEXT();
+  HANDLER(BLOCK_INTERPRET)
+    registers[EIP] = op->address;
+    result = step_instruction(sys, &halted);
+    RECORD(result);
+    NEXT();
+  HANDLER(EXIT_FALLTHROUGH)
+    registers[EIP] = end;
+    goto enter;
+  HANDLER(EXIT_JUMP)
+    value = sys->comparison_source;
+    outcome = get_comparison_outcome(
+        (int)((unsigned)sys->comparison_flag + (unsigned)value), value);
+    registers[EIP] = jump_conditions[inst->op] & outcome ? inst->target : end;
+    goto enter;
+  HANDLER(EXIT_CALL)
+    registers[ESP] -= 4;
+    data[registers[ESP] / 4] = end;
+    registers[EIP] = inst->target;
+    goto enter;
+  HANDLER(EXIT_RET)
+    registers[EIP] = data[registers[ESP] / 4];
+    registers[ESP] += 4;
+    if (registers[EIP] < 0 ||
+        registers[EIP] / 4 >= sys->memory.num_instructions) {
+      RECORD(PC_ERROR);
+    }
+    goto enter;
+  HANDLER(EXIT_END)
+    registers[EIP] = op->address;
+    return status;
+  HANDLER(EXIT_INTERPRETED)
+    goto enter;
+
+#if !USE_COMPUTED_GOTO
+    default:
+      goto enter;
+  }
+#endif
+#undef RECORD
+#undef HANDLER
+#undef NEXT
+}
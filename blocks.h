@@ -0,0 +1,56 @@
+#ifndef __BLOCKS_H
+#define __BLOCKS_H
+
+#include "interpreter.h"
+
+/* Bounds of the data accesses of a block made through one register, as
+ * offsets from the value of the register when the block is entered */
+typedef struct BlockCheck {
+  RegisterName reg;
+  long long min_offset;
+  long long max_offset;
+} BlockCheck;
+
+typedef struct BlockOp {
+  int kind;                 // BlockOpKind, see blocks.c
+  int address;              // address of the instruction
+  const Instruction *inst;
+  const void *handler;      // handler of kind, set on the first run
+} BlockOp;
+
+/*
+A basic block: the straight-line instructions from a label or the instruction
+after a branch up to and including the next branch, CALL, RET or END, or up
+to the next label.
+
+If every check in checks passes when the block is entered, all the data
+accesses and stack updates of the ops are in bounds, and they run without
+checking anything. Labels and other NOPs have no op, and the last op says how
+the block is left.
+*/
+typedef struct Block {
+  int start;   // address of the first instruction
+  int length;  // number of instructions covered
+  int threaded;  // 1 once the handlers of the ops are set
+  int num_checks;
+  BlockCheck checks[EIP];
+  int num_ops;
+  BlockOp ops[];
+} Block;
+
+/* Blocks of a program, formed once per block start and reused */
+typedef struct BlockCache {
+  Block **blocks;  // indexed by instruction, NULL until formed
+  const Instruction *program;
+  int num_instructions;
+  int instruction_size;
+  unsigned char *leaders;  // 1 for the instructions labels point at
+  BlockOp *scratch;        // ops of the block being formed
+} BlockCache;
+
+BlockCache *create_block_cache(const System *sys);
+void free_block_cache(BlockCache *cache);
+Block *get_block(BlockCache *cache, const System *sys, int pc);
+ExecResult execute_block_instructions(System *sys);
+
+#endif
@@ -0,0 +1,295 @@
+#include "bytecode.h"
+#include "fusion.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Write the decoded program of the system and its label table to file in the
+.asmbc format described in bytecode.h. Errors are left in the error indicator
+of file.
+*/
+void write_bytecode(const System *sys, FILE *file) {
+  const Memory *mem = &sys->memory;
+  BytecodeHeader header;
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.byte_order = BYTECODE_BYTE_ORDER;
+  header.instruction_record_size = sizeof(Instruction);
+  header.num_instructions = mem->num_instructions;
+  header.num_labels = 0;
+  header.label_text_size = 0;
+  header.reserved = 0;
+
+  for (int i = 0; i < mem->label_table_size; i++) {
+    if (mem->labels[i].name == NULL) continue;
+    header.num_labels++;
+    header.label_text_size += strlen(mem->labels[i].name) + 1;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(mem->code, sizeof(Instruction), mem->num_instructions, file);
+
+  uint32_t offset = 0;
+  for (int i = 0; i < mem->label_table_size; i++) {
+    if (mem->labels[i].name == NULL) continue;
+    BytecodeLabel label = {offset, mem->labels[i].address};
+    fwrite(&label, sizeof(label), 1, file);
+    offset += strlen(mem->labels[i].name) + 1;
+  }
+  for (int i = 0; i < mem->label_table_size; i++) {
+    if (mem->labels[i].name == NULL) continue;
+    fwrite(mem->labels[i].name, 1, strlen(mem->labels[i].name) + 1, file);
+  }
+}
+
+/*
+Write the decoded program of the system and its label table to filename in the
+.asmbc format described in bytecode.h.
+
+It returns 0 on success, or -1 if the file cannot be written.
+*/
+int save_bytecode(System *sys, const char *filename) {
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  write_bytecode(sys, file);
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    perror("Error writing file");
+    return -1;
+  }
+  return 0;
+}
+
+/* Return 1 if every field of a decoded instruction read from a file is in
+ * range, so a corrupt file cannot index outside the register file */
+static int is_valid_operand(MemoryType operand) {
+  return operand.type >= REG && operand.type <= UNKNOWN &&
+         operand.reg >= EAX && operand.reg <= NOT_REG &&
+         (operand.type == CONST || operand.type == UNKNOWN ||
+          operand.reg != NOT_REG);
+}
+
+/* Jump and call targets must be -1 or the address of an instruction in a
+ * segment of instruction_size instructions, which the engines index with */
+static int is_valid_instruction(const Instruction *inst, int instruction_size) {
+  return inst->op >= OP_NOP && inst->op <= OP_END &&
+         is_valid_operand(inst->src) && is_valid_operand(inst->dst) &&
+         (inst->target == -1 ||
+          (inst->target >= 0 && inst->target % 4 == 0 &&
+           inst->target / 4 < instruction_size));
+}
+
+/*
+Check that the file_size bytes at src are a bytecode image of this version
+that fits the segments of sys, that every instruction in it is valid and that
+sys is not attached to another program. filename is only used in error
+messages.
+
+It returns the header of the image, or NULL after printing an error.
+*/
+static const BytecodeHeader *check_bytecode(const System *sys, const char *src,
+                                            size_t file_size,
+                                            const char *filename) {
+  const Memory *mem = &sys->memory;
+  if (check_own_program(sys) != 0) return NULL;
+  if (file_size < sizeof(BytecodeHeader)) {
+    fprintf(stderr, "Error: %s is not a bytecode file\n", filename);
+    return NULL;
+  }
+
+  const BytecodeHeader *header = (const BytecodeHeader *)src;
+  size_t code_size = (size_t)header->num_instructions * sizeof(Instruction);
+  size_t labels_size = (size_t)header->num_labels * sizeof(BytecodeLabel);
+  const char *label_text = src + sizeof(*header) + code_size + labels_size;
+
+  if (memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) != 0) {
+    fprintf(stderr, "Error: %s is not a bytecode file\n", filename);
+    return NULL;
+  }
+  if (header->version != BYTECODE_VERSION ||
+      header->byte_order != BYTECODE_BYTE_ORDER ||
+      header->instruction_record_size != sizeof(Instruction)) {
+    fprintf(stderr, "Error: %s was compiled by an incompatible version\n",
+            filename);
+    return NULL;
+  }
+  if (sizeof(*header) + code_size + labels_size + header->label_text_size !=
+          file_size ||
+      (header->label_text_size > 0 &&
+       label_text[header->label_text_size - 1] != '\0')) {
+    fprintf(stderr, "Error: %s is truncated or corrupt\n", filename);
+    return NULL;
+  }
+  if (header->num_instructions > (uint32_t)mem->instruction_size ||
+      2 * header->num_labels > (uint32_t)mem->label_table_size) {
+    fprintf(stderr, "Error: %s needs a code size of at least %u\n", filename,
+            header->num_instructions);
+    return NULL;
+  }
+
+  const Instruction *code = (const Instruction *)(src + sizeof(*header));
+  for (uint32_t i = 0; i < header->num_instructions; i++) {
+    if (!is_valid_instruction(&code[i], mem->instruction_size)) {
+      fprintf(stderr, "Error: %s has a corrupt instruction %u\n", filename, i);
+      return NULL;
+    }
+  }
+  return header;
+}
+
+/* Fill the label table of sys from the image behind header, with names
+ * pointing into text. It returns 0 on success, or -1 if the table is corrupt,
+ * in which case the label table is left empty. */
+static int load_labels(System *sys, const BytecodeHeader *header,
+                       const char *text, const char *filename) {
+  Memory *mem = &sys->memory;
+  const BytecodeLabel *labels =
+      (const BytecodeLabel *)((const char *)(header + 1) +
+                              (size_t)header->num_instructions *
+                                  sizeof(Instruction));
+
+  for (int i = 0; i < mem->label_table_size; i++) {
+    mem->labels[i] = (Label){NULL, -1};
+  }
+  mem->num_labels = 0;
+  for (uint32_t i = 0; i < header->num_labels; i++) {
+    if (labels[i].name_offset >= header->label_text_size ||
+        add_label(sys, text + labels[i].name_offset, labels[i].address) != 0) {
+      fprintf(stderr, "Error: %s has a corrupt label table\n", filename);
+      for (int j = 0; j < mem->label_table_size; j++) {
+        mem->labels[j] = (Label){NULL, -1};
+      }
+      mem->num_labels = 0;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+Load the program in the file_size bytes at src, written by write_bytecode,
+into a system created with initialize_system_with_size. The code segment is
+copied in with a single memcpy, so nothing is parsed. The label names are
+copied into memory.text; memory.instruction stays empty, so the string engine
+cannot run a program loaded this way. filename is only used in error messages.
+
+It returns 0 on success, or -1 if src is not a bytecode image of this version
+or does not fit the instruction segment.
+*/
+int load_bytecode(System *sys, const char *src, size_t file_size,
+                  const char *filename) {
+  Memory *mem = &sys->memory;
+  const BytecodeHeader *header = check_bytecode(sys, src, file_size, filename);
+  if (header == NULL) return -1;
+
+  size_t code_size = (size_t)header->num_instructions * sizeof(Instruction);
+  const char *label_text = src + sizeof(*header) + code_size +
+                           (size_t)header->num_labels * sizeof(BytecodeLabel);
+  char *text = malloc(header->label_text_size + 1);
+  if (text == NULL) {
+    perror("Error allocating memory");
+    return -1;
+  }
+  memcpy(text, label_text, header->label_text_size);
+  if (load_labels(sys, header, text, filename) != 0) {
+    free(text);
+    return -1;
+  }
+
+  discard_compiled_program(sys);
+  release_program_image(sys);
+  memcpy(mem->code, header + 1, code_size);
+  for (uint32_t i = 0; i < header->num_instructions; i++) {
+    mem->instruction[i] = NULL;
+  }
+  mem->num_instructions = header->num_instructions;
+  fuse_instructions(sys);
+  free(mem->text);
+  mem->text = text;
+  return 0;
+}
+
+/*
+Run the program in the size bytes at image, written by write_bytecode, in
+place: the code segment of sys points into image and the label names are not
+copied, so image must stay mapped and unchanged while sys uses it. The fused
+opcodes are taken from the image as written, so the image must come from a
+trusted writer such as the program cache (cache.h); they are only checked to
+be in range. Like load_bytecode, the string engine cannot run the program.
+
+It returns 0 on success, or -1 if image is not a bytecode image of this
+version or does not fit the instruction segment.
+*/
+int attach_bytecode(System *sys, const char *image, size_t size,
+                    const char *filename) {
+  Memory *mem = &sys->memory;
+  const BytecodeHeader *header = check_bytecode(sys, image, size, filename);
+  if (header == NULL) return -1;
+
+  const Instruction *code = (const Instruction *)(header + 1);
+  for (uint32_t i = 0; i < header->num_instructions; i++) {
+    if (code[i].fused < OP_NOP || code[i].fused >= OP_TRAP ||
+        i + get_fused_length(code[i].fused) > header->num_instructions) {
+      fprintf(stderr, "Error: %s has a corrupt instruction %u\n", filename, i);
+      return -1;
+    }
+  }
+
+  const char *label_text = (const char *)(code + header->num_instructions) +
+                           (size_t)header->num_labels * sizeof(BytecodeLabel);
+  if (load_labels(sys, header, label_text, filename) != 0) return -1;
+
+  discard_compiled_program(sys);
+  release_program_image(sys);
+  mem->code = (Instruction *)code;
+  for (uint32_t i = 0; i < header->num_instructions; i++) {
+    mem->instruction[i] = NULL;
+  }
+  mem->num_instructions = header->num_instructions;
+  free(mem->text);
+  mem->text = NULL;
+  return 0;
+}
+
+/*
+Load a program written by save_bytecode into a system created with
+initialize_system_with_size. The file is mapped and handed to load_bytecode.
+
+It returns 0 on success, or -1 if the file cannot be read, is not a bytecode
+file of this version, or does not fit the instruction segment.
+*/
+int load_bytecode_from_file(System *sys, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Error opening file");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  size_t file_size = st.st_size;
+  if (file_size < sizeof(BytecodeHeader)) {
+    fprintf(stderr, "Error: %s is not a bytecode file\n", filename);
+    close(fd);
+    return -1;
+  }
+  const char *src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (src == MAP_FAILED) {
+    perror("Error mapping file");
+    return -1;
+  }
+
+  int result = load_bytecode(sys, src, file_size, filename);
+  munmap((void *)src, file_size);
+  return result;
+}
@@ -0,0 +1,50 @@
+#ifndef __BYTECODE_H
+#define __BYTECODE_H
+
+#include <stdint.h>
+#include "interpreter.h"
+
+#define BYTECODE_MAGIC "ASBC"
+#define BYTECODE_VERSION 4
+
+/*
+Layout of a .asmbc file:
+
+  BytecodeHeader
+  Instruction[num_instructions]   the decoded code segment
+  BytecodeLabel[num_labels]       the label table
+  char[label_text_size]           label names, each terminated by '\0'
+
+instruction_record_size and the byte order check reject files written by a
+build with a different Instruction layout, and version rejects files written by
+an older or newer format.
+*/
+typedef struct BytecodeHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;  // BYTECODE_BYTE_ORDER as written by the producer
+  uint32_t instruction_record_size;
+  uint32_t num_instructions;
+  uint32_t num_labels;
+  uint32_t label_text_size;
+  uint32_t reserved;
+} BytecodeHeader;
+
+#define BYTECODE_BYTE_ORDER 0x01020304u
+
+typedef struct BytecodeLabel {
+  uint32_t name_offset;  // offset of the name in the label text
+  int32_t address;
+} BytecodeLabel;
+
+#include <stdio.h>
+
+void write_bytecode(const System *sys, FILE *file);
+int save_bytecode(System *sys, const char *filename);
+int load_bytecode(System *sys, const char *src, size_t file_size,
+                  const char *filename);
+int attach_bytecode(System *sys, const char *image, size_t size,
+                    const char *filename);
+int load_bytecode_from_file(System *sys, const char *filename);
+
+#endif
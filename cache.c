@@ -0,0 +1,464 @@
+#include "cache.h"
+#include "bytecode.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_VERSION 2
+#define CACHE_SLOTS 1024
+#define CACHE_NAME_MAX 64
+
+typedef struct CacheEntry {
+  uint64_t hash;         // hash_program of the program text
+  uint64_t source_size;  // size of the program text
+  uint64_t image_size;   // size of the .asmbc image at the start of the
+                         // object, which the program text follows
+  uint64_t last_used;    // clock at the last lookup, 0 for a free slot
+} CacheEntry;
+
+/* Index of the cache, in the shared memory object named after the cache.
+ * Everything but the counters is protected by lock. */
+typedef struct CacheIndex {
+  _Atomic uint32_t ready;  // CACHE_VERSION once the creator set it up
+  uint32_t num_entries;
+  uint64_t memory_cap;
+  uint64_t memory_used;
+  uint64_t clock;
+  _Atomic unsigned long long hits;
+  _Atomic unsigned long long misses;
+  _Atomic unsigned long long evictions;
+  pthread_mutex_t lock;  // process shared and robust
+  CacheEntry entries[CACHE_SLOTS];
+} CacheIndex;
+
+struct ProgramCache {
+  char name[CACHE_NAME_MAX + 2];  // name of the index object, with the '/'
+  CacheIndex *index;
+};
+
+/* 64-bit hash of a program text, eight bytes at a time: every word is mixed in
+ * with a multiply and xor-shift, and the result goes through the finalizer of
+ * splitmix64 so every input bit reaches every bit of the hash. Collisions can
+ * be made on purpose, so a hit is only trusted after comparing the text. */
+static uint64_t hash_program(const char *src, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, src + i, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; i++) {
+    hash = (hash ^ (unsigned char)src[i]) * 0x9e3779b97f4a7c15ull;
+  }
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 31);
+}
+
+static size_t round_to_pages(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+/* Memory taken by the object of an entry: its image and the program text */
+static size_t get_object_size(const CacheEntry *entry) {
+  return round_to_pages(entry->image_size + entry->source_size);
+}
+
+/* Store the name of the object of the index, "/name", in buffer. It returns 0
+ * on success, or -1 if name is empty, too long or has other characters than
+ * letters, digits, '-', '_' and '.'. */
+static int get_index_name(char *buffer, const char *name) {
+  size_t length = strlen(name);
+  if (length == 0 || length > CACHE_NAME_MAX) return -1;
+  for (size_t i = 0; i < length; i++) {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.')) {
+      return -1;
+    }
+  }
+  buffer[0] = '/';
+  memcpy(buffer + 1, name, length + 1);
+  return 0;
+}
+
+static void get_entry_name(char *buffer, size_t size, const char *index_name,
+                           const CacheEntry *entry) {
+  snprintf(buffer, size, "%s-%016llx-%llx", index_name,
+           (unsigned long long)entry->hash,
+           (unsigned long long)entry->source_size);
+}
+
+static void lock_index(CacheIndex *index) {
+  // A worker that died holding the lock leaves at worst one entry half
+  // updated, which only costs a miss, so the index is used as it is
+  if (pthread_mutex_lock(&index->lock) == EOWNERDEAD) {
+    pthread_mutex_consistent(&index->lock);
+  }
+}
+
+static void unlock_index(CacheIndex *index) {
+  pthread_mutex_unlock(&index->lock);
+}
+
+static CacheEntry *find_entry(CacheIndex *index, uint64_t hash,
+                              uint64_t source_size) {
+  for (int i = 0; i < CACHE_SLOTS; i++) {
+    CacheEntry *entry = &index->entries[i];
+    if (entry->last_used != 0 && entry->hash == hash &&
+        entry->source_size == source_size) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Remove an entry from the index and unlink its object; the lock is held */
+static void remove_entry(ProgramCache *cache, CacheEntry *entry) {
+  char name[CACHE_NAME_MAX + 64];
+  get_entry_name(name, sizeof(name), cache->name, entry);
+  shm_unlink(name);
+  cache->index->memory_used -= get_object_size(entry);
+  cache->index->num_entries--;
+  entry->last_used = 0;
+}
+
+static void evict_least_recently_used(ProgramCache *cache) {
+  CacheEntry *victim = NULL;
+  for (int i = 0; i < CACHE_SLOTS; i++) {
+    CacheEntry *entry = &cache->index->entries[i];
+    if (entry->last_used != 0 &&
+        (victim == NULL || entry->last_used < victim->last_used)) {
+      victim = entry;
+    }
+  }
+  if (victim == NULL) return;
+  remove_entry(cache, victim);
+  atomic_fetch_add(&cache->index->evictions, 1);
+}
+
+/*
+Open the program cache called name, creating it with a cap of memory_cap bytes
+of cached images if it does not exist yet; the cap of an existing cache is
+kept. name may have letters, digits, '-', '_' and '.'; the index is the POSIX
+shared memory object "/name" and the programs are "/name-HASH-SIZE", so on
+Linux they show up in /dev/shm. The cache stays until remove_program_cache,
+and a process that forks after opening it can use it in the children.
+
+It returns the cache, or NULL with errno set if it cannot be opened.
+*/
+ProgramCache *open_program_cache(const char *name, size_t memory_cap) {
+  ProgramCache *cache = malloc(sizeof(*cache));
+  if (cache == NULL) return NULL;
+  if (get_index_name(cache->name, name) != 0) {
+    free(cache);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int created = 1;
+  int fd = shm_open(cache->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(cache->name, O_RDWR, 0);
+  }
+  if (fd < 0 || (created && ftruncate(fd, sizeof(CacheIndex)) != 0)) {
+    int error = errno;
+    if (fd >= 0) {
+      close(fd);
+      shm_unlink(cache->name);
+    }
+    free(cache);
+    errno = error;
+    return NULL;
+  }
+
+  // A process opening the cache while another creates it waits for the
+  // creator to size and set up the index, for up to a second
+  struct stat st;
+  for (int tries = 0; !created; tries++) {
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheIndex)) break;
+    if (tries == 1000) {
+      close(fd);
+      free(cache);
+      errno = ETIMEDOUT;
+      return NULL;
+    }
+    nanosleep(&(struct timespec){0, 1000000}, NULL);
+  }
+
+  cache->index = mmap(NULL, sizeof(CacheIndex), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  int error = errno;
+  close(fd);
+  if (cache->index == MAP_FAILED) {
+    if (created) shm_unlink(cache->name);
+    free(cache);
+    errno = error;
+    return NULL;
+  }
+
+  CacheIndex *index = cache->index;
+  if (created) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&index->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    index->memory_cap = memory_cap;
+    atomic_store(&index->ready, CACHE_VERSION);
+    return cache;
+  }
+
+  for (int tries = 0; atomic_load(&index->ready) == 0; tries++) {
+    if (tries == 1000) break;
+    nanosleep(&(struct timespec){0, 1000000}, NULL);
+  }
+  if (atomic_load(&index->ready) != CACHE_VERSION) {
+    close_program_cache(cache);
+    errno = EPROTO;
+    return NULL;
+  }
+  return cache;
+}
+
+/* Unmap the index; the cache and programs attached from it stay */
+void close_program_cache(ProgramCache *cache) {
+  if (cache == NULL) return;
+  munmap(cache->index, sizeof(CacheIndex));
+  free(cache);
+}
+
+/*
+Unlink the program cache called name and every program in it. Processes that
+have it open or run programs from it are not affected, and the memory is
+released when the last of them unmaps it.
+
+It returns 0 on success, or -1 with errno set if the cache cannot be opened.
+*/
+int remove_program_cache(const char *name) {
+  char index_name[CACHE_NAME_MAX + 2];
+  if (get_index_name(index_name, name) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  int fd = shm_open(index_name, O_RDWR, 0);
+  if (fd < 0) return -1;
+  close(fd);
+
+  ProgramCache *cache = open_program_cache(name, 0);
+  if (cache == NULL) return -1;
+  lock_index(cache->index);
+  for (int i = 0; i < CACHE_SLOTS; i++) {
+    if (cache->index->entries[i].last_used != 0) {
+      remove_entry(cache, &cache->index->entries[i]);
+    }
+  }
+  shm_unlink(cache->name);
+  unlock_index(cache->index);
+  close_program_cache(cache);
+  return 0;
+}
+
+/* Attach the cached image of the program text src, whose hash is hash, to
+ * sys. It returns 0 on success, or -1 if it is not in the cache, the cached
+ * text differs or the image cannot be mapped */
+static int attach_cached_program(ProgramCache *cache, System *sys,
+                                 const char *src, uint64_t hash,
+                                 uint64_t source_size) {
+  CacheIndex *index = cache->index;
+  lock_index(index);
+  CacheEntry *entry = find_entry(index, hash, source_size);
+  if (entry == NULL) {
+    unlock_index(index);
+    return -1;
+  }
+  entry->last_used = ++index->clock;
+  CacheEntry found = *entry;
+  unlock_index(index);
+
+  // The program can be evicted from here on, but an object that could be
+  // opened stays valid while it is mapped
+  char name[CACHE_NAME_MAX + 64];
+  get_entry_name(name, sizeof(name), cache->name, &found);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return -1;
+  struct stat st;
+  size_t object_size = found.image_size + found.source_size;
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != object_size ||
+      found.image_size == 0) {
+    close(fd);
+    return -1;
+  }
+  const char *image = mmap(NULL, object_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) return -1;
+
+  // Another text with the same hash and size is a miss
+  if (memcmp(image + found.image_size, src, found.source_size) != 0 ||
+      attach_bytecode(sys, image, found.image_size, "cached program") != 0) {
+    munmap((void *)image, object_size);
+    return -1;
+  }
+  sys->memory.image = image;
+  sys->memory.image_size = object_size;
+  return 0;
+}
+
+static int write_all(int fd, const char *buffer, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, buffer, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buffer += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/* Add the program just loaded into sys from the text src to the cache,
+ * evicting the least recently used programs to stay under the memory cap.
+ * Failures only mean the program is not cached. */
+static void publish_program(ProgramCache *cache, const System *sys,
+                            const char *src, uint64_t hash,
+                            uint64_t source_size) {
+  CacheIndex *index = cache->index;
+  char *image;
+  size_t image_size;
+  FILE *file = open_memstream(&image, &image_size);
+  if (file == NULL) return;
+  write_bytecode(sys, file);
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    free(image);
+    return;
+  }
+  CacheEntry entry = {hash, source_size, image_size, 0};
+  if (get_object_size(&entry) > index->memory_cap) {
+    free(image);
+    return;
+  }
+
+  char name[CACHE_NAME_MAX + 64];
+  get_entry_name(name, sizeof(name), cache->name, &entry);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    // Another worker is publishing the program, or one died doing it and
+    // left an object that is not in the index: unlink that one so the next
+    // miss can publish the program again
+    if (errno == EEXIST) {
+      lock_index(index);
+      if (find_entry(index, hash, source_size) == NULL) shm_unlink(name);
+      unlock_index(index);
+    }
+    free(image);
+    return;
+  }
+  failed = write_all(fd, image, image_size) ||
+           write_all(fd, src, source_size);
+  close(fd);
+  free(image);
+  if (failed) {
+    shm_unlink(name);
+    return;
+  }
+
+  // The entry is only added once the image is complete, so a worker finding
+  // it can map it right away
+  lock_index(index);
+  if (find_entry(index, hash, source_size) == NULL) {
+    while (index->num_entries > 0 &&
+           (index->num_entries == CACHE_SLOTS ||
+            index->memory_used + get_object_size(&entry) >
+                index->memory_cap)) {
+      evict_least_recently_used(cache);
+    }
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+      if (index->entries[i].last_used == 0) {
+        entry.last_used = ++index->clock;
+        index->entries[i] = entry;
+        index->memory_used += get_object_size(&entry);
+        index->num_entries++;
+        break;
+      }
+    }
+  }
+  unlock_index(index);
+}
+
+/*
+Load the program text in the size bytes at src into a system created with
+initialize_system_with_size, attaching its image from the cache if another
+load has published it, or parsing it and publishing its image otherwise.
+
+It returns 0 on success, or -1 if the program cannot be parsed or sys is
+attached to another program.
+*/
+int load_cached_program(ProgramCache *cache, System *sys, const char *src,
+                        size_t size) {
+  if (check_own_program(sys) != 0) return -1;
+  uint64_t hash = hash_program(src, size);
+  if (attach_cached_program(cache, sys, src, hash, size) == 0) {
+    atomic_fetch_add(&cache->index->hits, 1);
+    return 0;
+  }
+  atomic_fetch_add(&cache->index->misses, 1);
+  if (load_instructions_from_buffer(sys, src, size) != 0) return -1;
+  publish_program(cache, sys, src, hash, size);
+  return 0;
+}
+
+/* Same as load_cached_program, from the program text in filename */
+int load_cached_program_from_file(ProgramCache *cache, System *sys,
+                                  const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Error opening file");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  size_t file_size = st.st_size;
+  const char *src = "";
+  if (file_size > 0) {
+    src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src == MAP_FAILED) {
+      perror("Error mapping file");
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  int result = load_cached_program(cache, sys, src, file_size);
+  if (file_size > 0) munmap((void *)src, file_size);
+  return result;
+}
+
+void get_program_cache_stats(ProgramCache *cache, ProgramCacheStats *stats) {
+  CacheIndex *index = cache->index;
+  lock_index(index);
+  stats->entries = index->num_entries;
+  stats->memory_used = index->memory_used;
+  stats->memory_cap = index->memory_cap;
+  unlock_index(index);
+  stats->hits = atomic_load(&index->hits);
+  stats->misses = atomic_load(&index->misses);
+  stats->evictions = atomic_load(&index->evictions);
+}
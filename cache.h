@@ -0,0 +1,48 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stddef.h>
+#include "interpreter.h"
+
+/*
+Program cache shared by the worker processes of a service.
+
+Each cached program is its decoded .asmbc image (bytecode.h), which holds no
+pointers, followed by its text, in a POSIX shared memory object of its own. A
+worker loading a program hashes its text and, on a hit, maps the object
+read-only, checks that the cached text is the one it loads, and runs the image
+in place with attach_bytecode instead of parsing it: the pages of the program
+are shared by every worker that runs it. On a miss the worker parses the
+program as usual and publishes its image for the next ones.
+
+The objects are found through an index, also in shared memory, keyed by a
+64-bit hash and the size of the program text. When publishing an image would
+exceed the memory cap of the cache, the least recently used programs are
+removed from the index and unlinked; workers that still have them mapped keep
+running them, and the memory is released with the last mapping.
+
+A program attached from the cache is read-only: it cannot be unfused, patched
+by the debugger or run by the string engine. free_system and the load
+functions unmap it.
+*/
+typedef struct ProgramCache ProgramCache;
+
+typedef struct ProgramCacheStats {
+  int entries;
+  size_t memory_used;  // bytes of the cached objects, rounded to pages
+  size_t memory_cap;
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+} ProgramCacheStats;
+
+ProgramCache *open_program_cache(const char *name, size_t memory_cap);
+void close_program_cache(ProgramCache *cache);
+int remove_program_cache(const char *name);
+int load_cached_program(ProgramCache *cache, System *sys, const char *src,
+                        size_t size);
+int load_cached_program_from_file(ProgramCache *cache, System *sys,
+                                  const char *filename);
+void get_program_cache_stats(ProgramCache *cache, ProgramCacheStats *stats);
+
+#endif
@@ -0,0 +1,445 @@
+#include "debugger.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fusion.h"
+
+/* Put the fused opcodes back and patch a trap over every breakpoint */
+static void apply_breakpoints(Debugger *dbg) {
+  Instruction *code = dbg->sys->memory.code;
+  int n = dbg->sys->memory.num_instructions;
+
+  for (int pc = 0; pc < n; pc++) code[pc].fused = dbg->fused[pc];
+  for (int pc = 0; pc < n; pc++) {
+    if (!dbg->breakpoints[pc]) continue;
+    // A superinstruction starting before pc would run past the trap
+    for (int start = pc - 2; start < pc; start++) {
+      if (start >= 0 && start + get_fused_length(code[start].fused) > pc) {
+        code[start].fused = get_specialized_opcode(&code[start]);
+      }
+    }
+    code[pc].fused = OP_TRAP;
+  }
+}
+
+/*
+Start a session on sys, which must have a program loaded and be in the state
+the program starts from; restart_debugger goes back to that state. The string
+engine, the lanes, the JIT and the blocks engine do not run the fused
+opcodes, so sys is switched to the decoded engine unless it uses the threaded
+one.
+
+It returns 0 on success, or -1 if the session cannot be allocated.
+*/
+int initialize_debugger(Debugger *dbg, System *sys) {
+  int n = sys->memory.num_instructions;
+
+  memset(dbg, 0, sizeof(*dbg));
+  dbg->sys = sys;
+  dbg->stopped_watchpoint = -1;
+  dbg->fused = malloc((n + 1) * sizeof(Opcode));
+  dbg->breakpoints = calloc(n + 1, 1);
+  if (dbg->fused == NULL || dbg->breakpoints == NULL ||
+      take_snapshot(&dbg->start, sys) != 0) {
+    free(dbg->fused);
+    free(dbg->breakpoints);
+    return -1;
+  }
+  for (int pc = 0; pc < n; pc++) dbg->fused[pc] = sys->memory.code[pc].fused;
+  if (sys->engine != ENGINE_THREADED) sys->engine = ENGINE_DECODED;
+  return 0;
+}
+
+/* End the session, leaving the program without traps */
+void free_debugger(Debugger *dbg) {
+  memset(dbg->breakpoints, 0, dbg->sys->memory.num_instructions);
+  apply_breakpoints(dbg);
+  free(dbg->fused);
+  free(dbg->breakpoints);
+  free_snapshot(&dbg->start);
+}
+
+static int is_instruction_address(const Debugger *dbg, int address) {
+  return address >= 0 && address % 4 == 0 &&
+         address / 4 < dbg->sys->memory.num_instructions;
+}
+
+/* Break before the instruction at address. It returns 0 on success, or -1 if
+ * no instruction is at address. */
+int set_breakpoint(Debugger *dbg, int address) {
+  if (!is_instruction_address(dbg, address)) return -1;
+  if (!dbg->breakpoints[address / 4]) {
+    dbg->breakpoints[address / 4] = 1;
+    dbg->num_breakpoints++;
+    apply_breakpoints(dbg);
+  }
+  return 0;
+}
+
+/* Remove the breakpoint at address. It returns 0 on success, or -1 if there
+ * is none. */
+int clear_breakpoint(Debugger *dbg, int address) {
+  if (!is_instruction_address(dbg, address) || !dbg->breakpoints[address / 4]) {
+    return -1;
+  }
+  dbg->breakpoints[address / 4] = 0;
+  dbg->num_breakpoints--;
+  apply_breakpoints(dbg);
+  return 0;
+}
+
+static int watched_value(const Debugger *dbg, const Watchpoint *w) {
+  return w->is_register ? dbg->sys->registers[w->index]
+                        : dbg->sys->memory.data[w->index];
+}
+
+/*
+Stop when a register or the data word at index changes. It returns 0 on
+success, or -1 if index is not a register or a word of the data segment or
+MAX_WATCHPOINTS are already set.
+*/
+int add_watchpoint(Debugger *dbg, int is_register, int index) {
+  int limit = is_register ? EIP : dbg->sys->memory.data_size - 1;
+  if (index < 0 || index > limit) return -1;
+  for (int i = 0; i < dbg->num_watchpoints; i++) {
+    Watchpoint *w = &dbg->watchpoints[i];
+    if (w->is_register == is_register && w->index == index) return 0;
+  }
+  if (dbg->num_watchpoints == MAX_WATCHPOINTS) return -1;
+
+  Watchpoint *w = &dbg->watchpoints[dbg->num_watchpoints++];
+  w->is_register = is_register;
+  w->index = index;
+  w->value = watched_value(dbg, w);
+  w->old_value = w->value;
+  return 0;
+}
+
+/* It returns 0 on success, or -1 if the watchpoint is not set */
+int remove_watchpoint(Debugger *dbg, int is_register, int index) {
+  for (int i = 0; i < dbg->num_watchpoints; i++) {
+    Watchpoint *w = &dbg->watchpoints[i];
+    if (w->is_register == is_register && w->index == index) {
+      *w = dbg->watchpoints[--dbg->num_watchpoints];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Update every watchpoint and return the first one that changed, or -1 */
+static int check_watchpoints(Debugger *dbg) {
+  int changed = -1;
+  for (int i = 0; i < dbg->num_watchpoints; i++) {
+    Watchpoint *w = &dbg->watchpoints[i];
+    int value = watched_value(dbg, w);
+    if (value == w->value) continue;
+    w->old_value = w->value;
+    w->value = value;
+    if (changed < 0) changed = i;
+  }
+  return changed;
+}
+
+/* 1 if EIP is on a breakpoint */
+static int at_breakpoint(const Debugger *dbg) {
+  int eip = dbg->sys->registers[EIP];
+  return is_instruction_address(dbg, eip) && dbg->breakpoints[eip / 4];
+}
+
+/* Run the instruction at EIP, breakpoint or not */
+DebugStop step_debugger(Debugger *dbg) {
+  int halted = 0;
+
+  if (dbg->ended) return DEBUG_ENDED;
+  ExecResult result = step_instruction(dbg->sys, &halted);
+  if (halted) {
+    dbg->ended = 1;
+    return DEBUG_ENDED;
+  }
+  if (dbg->status == SUCCESS) dbg->status = result;
+  dbg->stopped_watchpoint = check_watchpoints(dbg);
+  return dbg->stopped_watchpoint >= 0 ? DEBUG_WATCHPOINT : DEBUG_STEPPED;
+}
+
+/* Run until a breakpoint, a watchpoint or the end of the program. The
+ * instruction at EIP always runs, so a continue leaves the breakpoint it
+ * stopped at. */
+DebugStop continue_debugger(Debugger *dbg) {
+  DebugStop stop = step_debugger(dbg);
+  if (stop != DEBUG_STEPPED) return stop;
+
+  if (dbg->num_watchpoints > 0) {
+    while (!at_breakpoint(dbg)) {
+      stop = step_debugger(dbg);
+      if (stop != DEBUG_STEPPED) return stop;
+    }
+    return DEBUG_BREAKPOINT;
+  }
+
+  ExecResult result = execute_instructions(dbg->sys);
+  if (dbg->status == SUCCESS) dbg->status = result;
+  if (at_breakpoint(dbg)) return DEBUG_BREAKPOINT;
+  dbg->ended = 1;
+  return DEBUG_ENDED;
+}
+
+/* Go back to the state the session started in, keeping the breakpoints and
+ * watchpoints */
+void restart_debugger(Debugger *dbg) {
+  restore_snapshot(dbg->sys, &dbg->start);
+  dbg->status = SUCCESS;
+  dbg->ended = 0;
+  for (int i = 0; i < dbg->num_watchpoints; i++) {
+    Watchpoint *w = &dbg->watchpoints[i];
+    w->value = watched_value(dbg, w);
+    w->old_value = w->value;
+  }
+}
+
+/*** Command loop ***/
+
+static const char *const register_names[] = {"%EAX", "%EDX", "%ECX",
+                                             "%ESP", "%EBP", "%EIP"};
+
+static int parse_number(const char *text, int *value) {
+  char *end;
+  long number = strtol(text, &end, 0);
+  if (end == text || *end != '\0') return -1;
+  *value = (int)number;
+  return 0;
+}
+
+/* Address of a .label, or an instruction address */
+static int parse_location(Debugger *dbg, const char *text) {
+  int address;
+  if (text[0] == '.') return get_addr_from_label(dbg->sys, text);
+  return parse_number(text, &address) == 0 ? address : -1;
+}
+
+/* A %register, or the byte address of a data word */
+static int parse_watch(const Debugger *dbg, const char *text, int *is_register,
+                       int *index) {
+  int address;
+  if (text[0] == '%') {
+    *is_register = 1;
+    *index = get_register_by_name(text);
+    return *index == NOT_REG ? -1 : 0;
+  }
+  *is_register = 0;
+  if (parse_number(text, &address) != 0 || address < 0 ||
+      address > dbg->sys->memory.data_limit) {
+    return -1;
+  }
+  *index = address / 4;
+  return 0;
+}
+
+static void print_watch(FILE *out, const Watchpoint *w) {
+  if (w->is_register) {
+    fprintf(out, "%s", register_names[w->index]);
+  } else {
+    fprintf(out, "data at %d", w->index * 4);
+  }
+}
+
+static void print_registers(FILE *out, const System *sys) {
+  for (int r = EAX; r <= EIP; r++) {
+    fprintf(out, "%s %d  ", register_names[r] + 1, sys->registers[r]);
+  }
+  fprintf(out, "flag %d  source %d\n", sys->comparison_flag,
+          sys->comparison_source);
+}
+
+/* One line of a listing: => marks EIP and * a breakpoint */
+static void print_instruction(FILE *out, const Debugger *dbg, int pc) {
+  const Memory *mem = &dbg->sys->memory;
+  const char *text = mem->instruction[pc] != NULL
+                         ? mem->instruction[pc]
+                         : get_opcode_name(mem->code[pc].op);
+  fprintf(out, "%2s%c %6d  %s\n",
+          dbg->sys->registers[EIP] == pc * 4 ? "=>" : "",
+          dbg->breakpoints[pc] ? '*' : ' ', pc * 4, text);
+}
+
+static void print_current(FILE *out, const Debugger *dbg) {
+  int eip = dbg->sys->registers[EIP];
+  if (is_instruction_address(dbg, eip)) {
+    print_instruction(out, dbg, eip / 4);
+  } else {
+    fprintf(out, "EIP %d is outside the program\n", eip);
+  }
+}
+
+static void report_stop(FILE *out, const Debugger *dbg, DebugStop stop) {
+  switch (stop) {
+    case DEBUG_ENDED:
+      fprintf(out, "Program ended (%s)\n", get_result_name(dbg->status));
+      print_registers(out, dbg->sys);
+      return;
+    case DEBUG_BREAKPOINT:
+      fprintf(out, "Breakpoint at %d\n", dbg->sys->registers[EIP]);
+      break;
+    case DEBUG_WATCHPOINT: {
+      const Watchpoint *w = &dbg->watchpoints[dbg->stopped_watchpoint];
+      fprintf(out, "Watchpoint ");
+      print_watch(out, w);
+      fprintf(out, ": %d -> %d\n", w->old_value, w->value);
+      break;
+    }
+    default:
+      break;
+  }
+  print_current(out, dbg);
+}
+
+/* Print count data words from byte address on */
+static void print_words(FILE *out, const System *sys, int address, int count) {
+  for (int i = 0; i < count; i++, address += 4) {
+    if (address < 0 || address > sys->memory.data_limit) {
+      fprintf(out, "%8d  outside the data segment\n", address);
+      break;
+    }
+    fprintf(out, "%8d  %d\n", address, sys->memory.data[address / 4]);
+  }
+}
+
+static void print_info(FILE *out, const Debugger *dbg) {
+  fprintf(out, "%d breakpoints\n", dbg->num_breakpoints);
+  for (int pc = 0; pc < dbg->sys->memory.num_instructions; pc++) {
+    if (dbg->breakpoints[pc]) print_instruction(out, dbg, pc);
+  }
+  fprintf(out, "%d watchpoints\n", dbg->num_watchpoints);
+  for (int i = 0; i < dbg->num_watchpoints; i++) {
+    fprintf(out, "  ");
+    print_watch(out, &dbg->watchpoints[i]);
+    fprintf(out, " = %d\n", dbg->watchpoints[i].value);
+  }
+}
+
+static void print_help(FILE *out) {
+  fprintf(out,
+          "break LOC        break before the instruction at LOC, a .label or "
+          "an address\n"
+          "delete LOC       remove the breakpoint at LOC\n"
+          "watch WHAT       stop when WHAT changes, a %%register or a data "
+          "address\n"
+          "unwatch WHAT     remove the watchpoint on WHAT\n"
+          "step [N]         run N instructions, 1 by default\n"
+          "continue         run until a breakpoint, a watchpoint or the end\n"
+          "restart          go back to the start of the program\n"
+          "regs             print the registers\n"
+          "stack [N]        print N words from ESP, 8 by default\n"
+          "x ADDR [N]       print N data words from ADDR, 1 by default\n"
+          "list             print the instructions around EIP\n"
+          "info             list the breakpoints and watchpoints\n"
+          "quit             leave the debugger\n"
+          "An empty line repeats the last command.\n");
+}
+
+/* Run one command line. It returns 1 when the session should end. */
+static int run_command(Debugger *dbg, const char *line, FILE *out) {
+  char command[16], arg1[64], arg2[64];
+  int args = sscanf(line, "%15s %63s %63s", command, arg1, arg2) - 1;
+  int number, is_register, index;
+  System *sys = dbg->sys;
+
+  if (args < 0) return 0;
+  if (strcmp(command, "break") == 0 || strcmp(command, "b") == 0) {
+    if (args < 1 || set_breakpoint(dbg, parse_location(dbg, arg1)) != 0) {
+      fprintf(out, "No instruction at %s\n", args < 1 ? "?" : arg1);
+    } else {
+      fprintf(out, "Breakpoint at %d\n", parse_location(dbg, arg1));
+    }
+  } else if (strcmp(command, "delete") == 0 || strcmp(command, "d") == 0) {
+    if (args < 1 || clear_breakpoint(dbg, parse_location(dbg, arg1)) != 0) {
+      fprintf(out, "No breakpoint at %s\n", args < 1 ? "?" : arg1);
+    }
+  } else if (strcmp(command, "watch") == 0 || strcmp(command, "w") == 0) {
+    if (args < 1 || parse_watch(dbg, arg1, &is_register, &index) != 0 ||
+        add_watchpoint(dbg, is_register, index) != 0) {
+      fprintf(out, "Cannot watch %s\n", args < 1 ? "?" : arg1);
+    }
+  } else if (strcmp(command, "unwatch") == 0) {
+    if (args < 1 || parse_watch(dbg, arg1, &is_register, &index) != 0 ||
+        remove_watchpoint(dbg, is_register, index) != 0) {
+      fprintf(out, "No watchpoint on %s\n", args < 1 ? "?" : arg1);
+    }
+  } else if (strcmp(command, "step") == 0 || strcmp(command, "s") == 0) {
+    DebugStop stop = DEBUG_STEPPED;
+    if (args < 1 || parse_number(arg1, &number) != 0) number = 1;
+    for (int i = 0; i < number && stop == DEBUG_STEPPED; i++) {
+      stop = step_debugger(dbg);
+    }
+    report_stop(out, dbg, stop);
+  } else if (strcmp(command, "continue") == 0 || strcmp(command, "c") == 0) {
+    report_stop(out, dbg, continue_debugger(dbg));
+  } else if (strcmp(command, "restart") == 0) {
+    restart_debugger(dbg);
+    print_current(out, dbg);
+  } else if (strcmp(command, "regs") == 0) {
+    print_registers(out, sys);
+  } else if (strcmp(command, "stack") == 0) {
+    if (args < 1 || parse_number(arg1, &number) != 0) number = 8;
+    print_words(out, sys, sys->registers[ESP], number);
+  } else if (strcmp(command, "x") == 0) {
+    int address;
+    if (args < 1 || parse_number(arg1, &address) != 0) {
+      fprintf(out, "x needs a data address\n");
+      return 0;
+    }
+    if (args < 2 || parse_number(arg2, &number) != 0) number = 1;
+    print_words(out, sys, address, number);
+  } else if (strcmp(command, "list") == 0 || strcmp(command, "l") == 0) {
+    int pc = sys->registers[EIP] / 4;
+    for (int i = pc - 3; i <= pc + 4; i++) {
+      if (i >= 0 && i < sys->memory.num_instructions) {
+        print_instruction(out, dbg, i);
+      }
+    }
+  } else if (strcmp(command, "info") == 0 || strcmp(command, "i") == 0) {
+    print_info(out, dbg);
+  } else if (strcmp(command, "help") == 0 || strcmp(command, "h") == 0) {
+    print_help(out);
+  } else if (strcmp(command, "quit") == 0 || strcmp(command, "q") == 0) {
+    return 1;
+  } else {
+    fprintf(out, "Unknown command %s, try help\n", command);
+  }
+  return 0;
+}
+
+/*
+Debug the program loaded into sys from its current state, reading commands
+from in until quit or the end of the input.
+
+It returns 0, or -1 if the session cannot be created.
+*/
+int run_debugger(System *sys, FILE *in, FILE *out) {
+  Debugger dbg;
+  char line[256], last[256] = "";
+  int interactive = isatty(fileno(in));
+
+  if (initialize_debugger(&dbg, sys) != 0) return -1;
+  fprintf(out, "Debugging %d instructions with the %s engine, type help for "
+               "the commands\n",
+          sys->memory.num_instructions, get_engine_name(sys->engine));
+  print_current(out, &dbg);
+
+  for (;;) {
+    if (interactive) {
+      fprintf(out, "(asm) ");
+      fflush(out);
+    }
+    if (fgets(line, sizeof(line), in) == NULL) break;
+    if (strspn(line, " \t\r\n") == strlen(line)) {
+      strcpy(line, last);
+    } else {
+      strcpy(last, line);
+    }
+    if (run_command(&dbg, line, out)) break;
+  }
+
+  free_debugger(&dbg);
+  return 0;
+}
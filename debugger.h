@@ -0,0 +1,63 @@
+#ifndef __DEBUGGER_H
+#define __DEBUGGER_H
+
+#include <stdio.h>
+#include "interpreter.h"
+#include "snapshot.h"
+
+#define MAX_WATCHPOINTS 16
+
+typedef struct Watchpoint {
+  int is_register;  // 1 for a register, 0 for a data word
+  int index;        // RegisterName, or word index in memory.data
+  int value;        // value when last checked
+  int old_value;    // value before the change that stopped the run
+} Watchpoint;
+
+// Why a step or continue of the debugger returned
+typedef enum DebugStop {
+  DEBUG_STEPPED,     // one instruction ran
+  DEBUG_BREAKPOINT,  // EIP is on a breakpoint
+  DEBUG_WATCHPOINT,  // a watched value changed
+  DEBUG_ENDED        // END, or EIP left the program
+} DebugStop;
+
+/*
+Debugger session on a loaded program.
+
+A breakpoint replaces the fused opcode of its instruction with OP_TRAP, which
+the decoded and threaded engines run like END, so a continue is a plain run of
+the engine that stops on the trap: the other instructions are dispatched as
+usual and a program without breakpoints runs unchanged. Superinstructions
+covering a breakpoint are split so the trap is always reached. The
+instruction under a trap is run through step_instruction, which dispatches on
+the plain opcode.
+
+Watchpoints are checked after every instruction, so with any watchpoint set a
+continue steps one instruction at a time.
+*/
+typedef struct Debugger {
+  System *sys;
+  Opcode *fused;               // fused opcodes without breakpoints
+  unsigned char *breakpoints;  // 1 for every instruction with a breakpoint
+  int num_breakpoints;
+  Watchpoint watchpoints[MAX_WATCHPOINTS];
+  int num_watchpoints;
+  int stopped_watchpoint;  // watchpoint of the last DEBUG_WATCHPOINT
+  Snapshot start;          // state restored by restart_debugger
+  ExecResult status;       // error of the first failing instruction so far
+  int ended;
+} Debugger;
+
+int initialize_debugger(Debugger *dbg, System *sys);
+void free_debugger(Debugger *dbg);
+int set_breakpoint(Debugger *dbg, int address);
+int clear_breakpoint(Debugger *dbg, int address);
+int add_watchpoint(Debugger *dbg, int is_register, int index);
+int remove_watchpoint(Debugger *dbg, int is_register, int index);
+DebugStop step_debugger(Debugger *dbg);
+DebugStop continue_debugger(Debugger *dbg);
+void restart_debugger(Debugger *dbg);
+int run_debugger(System *sys, FILE *in, FILE *out);
+
+#endif
@@ -0,0 +1,234 @@
+#include "embed.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bytecode.h"
+
+struct Interpreter {
+  System sys;
+  int loaded;  // 1 once a program has been loaded or shared
+  char error[160];
+};
+
+/* Record the error of the last failed call: what, about filename if it is
+ * not NULL, and because of reason if it is not NULL */
+static void set_error(Interpreter *interp, const char *what,
+                      const char *filename, const char *reason) {
+  snprintf(interp->error, sizeof(interp->error), "%s%s%s%s%s", what,
+           filename ? " " : "", filename ? filename : "", reason ? ": " : "",
+           reason ? reason : "");
+}
+
+/* Map filename read-only into *src and *size. It returns 0 on success, or
+ * -1 with the error recorded in interp. */
+static int map_file(Interpreter *interp, const char *filename, char **src,
+                    size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    set_error(interp, "cannot open", filename, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  *size = st.st_size;
+  *src = "";
+  if (*size > 0) {
+    *src = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*src == MAP_FAILED) {
+      set_error(interp, "cannot map", filename, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static void unmap_file(char *src, size_t size) {
+  if (size > 0) munmap(src, size);
+}
+
+/*
+Create a handle with an instruction segment of instruction_size instructions,
+a data segment of data_size words and the given engine.
+
+It returns the handle, or NULL with errno set if a size is invalid or the
+allocation fails.
+*/
+Interpreter *create_interpreter(int instruction_size, int data_size,
+                                Engine engine) {
+  Interpreter *interp = calloc(1, sizeof(Interpreter));
+  if (interp == NULL) return NULL;
+  if (initialize_system_with_size(&interp->sys, instruction_size, data_size) !=
+      0) {
+    free(interp);
+    return NULL;
+  }
+  interp->sys.engine = engine;
+  return interp;
+}
+
+void free_interpreter(Interpreter *interp) {
+  if (interp == NULL) return;
+  free_system(&interp->sys);
+  free(interp);
+}
+
+/* Description of the last failure, or an empty string */
+const char *get_interpreter_error(const Interpreter *interp) {
+  return interp->error;
+}
+
+/* Get ready to load a new program into interp */
+static int prepare_load(Interpreter *interp) {
+  if (interp->sys.memory.attached) {
+    set_error(interp, "cannot load into a handle sharing a program", NULL,
+              NULL);
+    return -1;
+  }
+  interp->loaded = 0;
+  interp->error[0] = '\0';
+  return 0;
+}
+
+/*
+Load the program text of filename. The details of a program with errors are
+written to stderr.
+
+It returns 0 on success, or -1 if the file cannot be read or the program has
+errors.
+*/
+int load_interpreter_file(Interpreter *interp, const char *filename) {
+  char *src;
+  size_t size;
+  if (prepare_load(interp) != 0) return -1;
+  if (map_file(interp, filename, &src, &size) != 0) return -1;
+  int result = load_instructions_from_buffer(&interp->sys, src, size);
+  unmap_file(src, size);
+  if (result != 0) {
+    set_error(interp, "cannot load", filename, "invalid program");
+    return -1;
+  }
+  interp->loaded = 1;
+  return 0;
+}
+
+/* Same as load_interpreter_file, from the size bytes of program text */
+int load_interpreter_buffer(Interpreter *interp, const char *text,
+                            size_t size) {
+  if (prepare_load(interp) != 0) return -1;
+  if (load_instructions_from_buffer(&interp->sys, text, size) != 0) {
+    set_error(interp, "cannot load the program", NULL, "invalid program");
+    return -1;
+  }
+  interp->loaded = 1;
+  return 0;
+}
+
+/* Same as load_interpreter_file, from a .asmbc file (bytecode.h). The string
+ * engine cannot run programs loaded this way. */
+int load_interpreter_bytecode(Interpreter *interp, const char *filename) {
+  char *src;
+  size_t size;
+  if (prepare_load(interp) != 0) return -1;
+  if (map_file(interp, filename, &src, &size) != 0) return -1;
+  int result = load_bytecode(&interp->sys, src, size, filename);
+  unmap_file(src, size);
+  if (result != 0) {
+    set_error(interp, "cannot load", filename, "invalid bytecode");
+    return -1;
+  }
+  interp->loaded = 1;
+  return 0;
+}
+
+/* Same as load_interpreter_file, through a program cache shared with other
+ * processes (cache.h). The string engine cannot run programs attached from the
+ * cache. */
+int load_interpreter_cached(Interpreter *interp, ProgramCache *cache,
+                            const char *filename) {
+  char *src;
+  size_t size;
+  if (prepare_load(interp) != 0) return -1;
+  if (map_file(interp, filename, &src, &size) != 0) return -1;
+  int result = load_cached_program(cache, &interp->sys, src, size);
+  unmap_file(src, size);
+  if (result != 0) {
+    set_error(interp, "cannot load", filename, "invalid program");
+    return -1;
+  }
+  interp->loaded = 1;
+  return 0;
+}
+
+/*
+Make interp run the program loaded into program, without copying it.
+program must not load another program or be freed while interp uses it, and
+interp cannot load programs of its own afterwards.
+
+It returns 0 on success, or -1 if program has no program or it does not fit
+the instruction segment of interp.
+*/
+int share_interpreter_program(Interpreter *interp, const Interpreter *program) {
+  if (!program->loaded || interp->loaded ||
+      attach_program(&interp->sys, &program->sys) != 0) {
+    set_error(interp, "cannot share the program", NULL, NULL);
+    return -1;
+  }
+  interp->loaded = 1;
+  return 0;
+}
+
+/*
+Run the program from the start. registers, if not NULL, gives the initial
+EAX, EDX, ECX, ESP and EBP and receives the final registers; otherwise the
+defaults of reset_system are used. The data segment is cleared first.
+
+Without limits the engine of the handle runs the program to the end and
+executed is not counted; with limits the run goes through
+execute_with_limits and can be continued with resume_interpreter.
+*/
+RunResult run_interpreter(Interpreter *interp, Registers registers[6],
+                          const RunLimits *limits) {
+  reset_system(&interp->sys);
+  if (registers != NULL) {
+    memcpy(interp->sys.registers, registers, EIP * sizeof(Registers));
+  }
+  return resume_interpreter(interp, registers, limits);
+}
+
+/*
+Go on running the program from the current state, after a run was stopped by
+its limits or after the data segment was prepared with get_interpreter_data.
+registers, if not NULL, receives the final registers.
+*/
+RunResult resume_interpreter(Interpreter *interp, Registers registers[6],
+                             const RunLimits *limits) {
+  RunResult run = {RUN_FINISHED, SUCCESS, 0, 0};
+
+  if (!interp->loaded) {
+    set_error(interp, "no program loaded", NULL, NULL);
+    run.status = RUN_ERROR;
+    run.result = INSTRUCTION_ERROR;
+  } else if (limits != NULL) {
+    run = execute_with_limits(&interp->sys, limits);
+  } else {
+    run.result = execute_instructions(&interp->sys);
+    run.eip = interp->sys.registers[EIP];
+  }
+  if (registers != NULL) {
+    memcpy(registers, interp->sys.registers, sizeof(interp->sys.registers));
+  }
+  return run;
+}
+
+/* The data segment of the handle, of *data_size words */
+int *get_interpreter_data(Interpreter *interp, int *data_size) {
+  *data_size = interp->sys.memory.data_size;
+  return interp->sys.memory.data;
+}
@@ -0,0 +1,41 @@
+#ifndef __EMBED_H
+#define __EMBED_H
+
+#include <stddef.h>
+#include "cache.h"
+#include "interpreter.h"
+
+/*
+Interpreter handle for programs that embed the interpreter, built into
+libinterpreter.a. A handle owns one System, allocated once by
+create_interpreter: loading a program and running it any number of times
+reuse that state, so runs allocate nothing (the jit and blocks engines only
+on the first run after a load). Failures are returned, never turned into an
+exit, and get_interpreter_error describes the last one.
+
+A handle is not thread safe; use one per thread. Handles made with
+share_interpreter_program run the program of another handle without copying
+it, as batch mode does.
+*/
+typedef struct Interpreter Interpreter;
+
+Interpreter *create_interpreter(int instruction_size, int data_size,
+                                Engine engine);
+void free_interpreter(Interpreter *interp);
+const char *get_interpreter_error(const Interpreter *interp);
+
+int load_interpreter_file(Interpreter *interp, const char *filename);
+int load_interpreter_buffer(Interpreter *interp, const char *text,
+                            size_t size);
+int load_interpreter_bytecode(Interpreter *interp, const char *filename);
+int load_interpreter_cached(Interpreter *interp, ProgramCache *cache,
+                            const char *filename);
+int share_interpreter_program(Interpreter *interp, const Interpreter *program);
+
+RunResult run_interpreter(Interpreter *interp, Registers registers[6],
+                          const RunLimits *limits);
+RunResult resume_interpreter(Interpreter *interp, Registers registers[6],
+                             const RunLimits *limits);
+int *get_interpreter_data(Interpreter *interp, int *data_size);
+
+#endif
@@ -0,0 +1,116 @@
+#include "fusion.h"
+
+/*
+Peephole pass choosing superinstructions for the decoded and threaded engines.
+
+Only forms that cannot fail are fused: register destinations, register or
+constant sources, and jumps to a label inside the program. EIP is never an
+operand, since a superinstruction only updates it once at the end. This keeps
+the error behaviour of the fused code identical to running the instructions
+one by one, and lets the handlers skip every check.
+*/
+
+/* A register other than EIP, or a constant */
+static int is_simple_source(MemoryType operand) {
+  return operand.type == CONST || (operand.type == REG && operand.reg < EIP);
+}
+
+/* A register other than EIP */
+static int is_simple_destination(MemoryType operand) {
+  return operand.type == REG && operand.reg < EIP;
+}
+
+static int is_simple(const Instruction *inst, Opcode op) {
+  return inst->op == op && is_simple_source(inst->src) &&
+         is_simple_destination(inst->dst);
+}
+
+/* A jump whose target is an instruction of the program, so it never fails */
+static int is_simple_jump(const System *sys, const Instruction *inst) {
+  return inst->op >= OP_JMP && inst->op <= OP_JB && inst->target >= 0 &&
+         inst->target / 4 < sys->memory.num_instructions;
+}
+
+/* Return the superinstruction for the sequence starting at instruction i, or
+ * its specialized opcode if none applies */
+static Opcode choose_fusion(const System *sys, int i) {
+  const Instruction *code = sys->memory.code;
+  int remaining = sys->memory.num_instructions - i;
+
+  if (remaining >= 3 && is_simple(&code[i], OP_ADDL) &&
+      is_simple(&code[i + 1], OP_CMPL) && is_simple_jump(sys, &code[i + 2])) {
+    return OP_ADDL_CMPL_JCC;
+  }
+  if (remaining >= 2 && is_simple(&code[i], OP_CMPL) &&
+      is_simple_jump(sys, &code[i + 1])) {
+    return OP_CMPL_JCC;
+  }
+  if (remaining >= 2 && is_simple(&code[i], OP_ADDL) &&
+      is_simple(&code[i + 1], OP_ADDL)) {
+    return OP_ADDL_ADDL;
+  }
+  return get_specialized_opcode(&code[i]);
+}
+
+/*
+Set the fused opcode of every decoded instruction, choosing the longest
+superinstruction that starts at it. Every instruction is considered on its
+own, so an instruction covered by the superinstruction before it also gets
+one, for the jumps that land on it.
+
+It returns the number of instructions that start a superinstruction.
+*/
+int fuse_instructions(System *sys) {
+  int fused = 0;
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    Instruction *inst = &sys->memory.code[i];
+    inst->fused = choose_fusion(sys, i);
+    fused += inst->fused >= OP_ADDL_ADDL;
+  }
+  return fused;
+}
+
+/* Drop the superinstructions, keeping the specialized opcodes */
+void unfuse_instructions(System *sys) {
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    sys->memory.code[i].fused = get_specialized_opcode(&sys->memory.code[i]);
+  }
+}
+
+/* Return the number of instructions run by one dispatch of op */
+int get_fused_length(Opcode op) {
+  switch (op) {
+    case OP_ADDL_ADDL:
+    case OP_CMPL_JCC:
+      return 2;
+    case OP_ADDL_CMPL_JCC:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+/* Print how many superinstructions of each kind the program uses */
+void print_fusion_stats(FILE *out, const System *sys) {
+  int counts[OP_COUNT] = {0};
+  int total = 0, specialized = 0;
+
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    counts[sys->memory.code[i].fused]++;
+  }
+  fprintf(out, "\n%-16s %8s %8s\n", "superinstruction", "sites", "length");
+  // The specialized opcodes come right before the superinstructions
+  for (int op = OP_END + 1; op < OP_ADDL_ADDL; op++) {
+    specialized += counts[op];
+  }
+  for (int op = OP_ADDL_ADDL; op < OP_COUNT; op++) {
+    if (counts[op] == 0) continue;
+    fprintf(out, "%-16s %8d %8d\n", get_opcode_name(op), counts[op],
+            get_fused_length(op));
+    total += counts[op];
+  }
+  fprintf(out, "%d of %d instructions start a superinstruction\n", total,
+          sys->memory.num_instructions);
+  fprintf(out, "%d use a handler specialized for their operand types\n",
+          specialized);
+}
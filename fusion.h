@@ -0,0 +1,12 @@
+#ifndef __FUSION_H
+#define __FUSION_H
+
+#include <stdio.h>
+#include "interpreter.h"
+
+int fuse_instructions(System *sys);
+void unfuse_instructions(System *sys);
+int get_fused_length(Opcode op);
+void print_fusion_stats(FILE *out, const System *sys);
+
+#endif
@@ -0,0 +1,715 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bytecode.h"
+#include "fusion.h"
+#include "interpreter.h"
+#include "lanes.h"
+#include "sampler.h"
+#include "snapshot.h"
+
+/*
+Differential fuzzer for the execution engines.
+
+Every case is a random program over the whole instruction set and every
+addressing mode, with labels, jumps, CALL and RET, run from random initial
+registers. The string engine, which runs the reference semantics of
+execute_movl, execute_addl and the other string handlers, gives the expected
+final state; every other engine, the decoded engine in slices of
+execute_with_limits, a run with a call stack sampler, a run of the program
+round-tripped through its bytecode image and resumed from a snapshot, and the
+decoded engine without superinstructions must end with the same registers,
+comparison flag and source, data segment and ExecResult.
+
+The lanes engine is also run over a full lane group, every lane from initial
+registers of its own so that lanes take different branches and run masked, and
+each lane is compared with a string engine run from the same registers.
+
+Programs that do not end within --steps instructions are skipped, and their
+share is printed at the end. A failing case is shrunk by removing lines for as
+long as it still fails, then printed with its seed, so
+`fuzz --seed S --cases 1` runs it again.
+*/
+
+// Data segment of every case: the default size, which the larger random
+// offsets run out of
+#define FUZZ_DATA_SIZE MEMORY_SIZE
+#define FUZZ_MAX_LINES 256
+#define FUZZ_LINE_SIZE 40
+#define FUZZ_LABELS 6
+
+// Seconds a case may take before it is reported as hanging
+#define FUZZ_TIMEOUT 10
+
+// Instructions the round trip variant runs before taking its snapshot
+#define FUZZ_SNAPSHOT_STEPS 16
+
+typedef struct FuzzOptions {
+  long long cases;
+  unsigned long long seed;
+  int max_lines;
+  long long steps;  // instruction budget of the reference run
+  int keep_going;   // report every failing case instead of stopping
+  const char *out;  // file receiving the shrunk program of a failure
+} FuzzOptions;
+
+typedef struct Program {
+  char lines[FUZZ_MAX_LINES][FUZZ_LINE_SIZE];
+  int num_lines;
+  Registers registers[3];  // initial EAX, EDX and ECX
+  Registers lane_registers[LANE_COUNT - 1][3];  // of the other lanes of the
+                                                // lane group variant
+} Program;
+
+// How a variant runs the loaded program
+typedef enum VariantMode {
+  RUN_ENGINE,
+  RUN_SLICED,
+  RUN_SAMPLED,
+  RUN_ROUND_TRIP,
+  RUN_LANE_GROUP,
+  RUN_UNFUSED
+} VariantMode;
+
+typedef struct Variant {
+  const char *name;
+  Engine engine;
+  VariantMode mode;
+} Variant;
+
+// Unfused must stay last: it changes the loaded program
+static const Variant variants[] = {
+    {"decoded", ENGINE_DECODED, RUN_ENGINE},
+    {"threaded", ENGINE_THREADED, RUN_ENGINE},
+    {"lanes", ENGINE_LANES, RUN_ENGINE},
+    {"jit", ENGINE_JIT, RUN_ENGINE},
+    {"blocks", ENGINE_BLOCKS, RUN_ENGINE},
+    {"sliced", ENGINE_DECODED, RUN_SLICED},
+    {"sampled", ENGINE_DECODED, RUN_SAMPLED},
+    {"bytecode", ENGINE_DECODED, RUN_ROUND_TRIP},
+    {"lane group", ENGINE_LANES, RUN_LANE_GROUP},
+    {"unfused", ENGINE_DECODED, RUN_UNFUSED},
+};
+
+#define NUM_VARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+
+typedef struct Outcome {
+  Registers registers[6];
+  int comparison_flag;
+  int comparison_source;
+  ExecResult result;
+  int data[FUZZ_DATA_SIZE];
+} Outcome;
+
+/*** Random programs ***/
+
+static unsigned long long next_random(unsigned long long *state) {
+  // splitmix64
+  unsigned long long z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static int random_below(unsigned long long *state, int n) {
+  return (int)(next_random(state) % n);
+}
+
+static const char *const register_names[] = {"%EAX", "%EDX", "%ECX", "%ESP",
+                                             "%EBP"};
+
+/* A register, a constant or a memory operand; %EIP only rarely, since most
+ * writes to it leave the program */
+static void random_operand(unsigned long long *state, char *out) {
+  // The extremes make CMPL overflow, and 31 and 32 are shift counts
+  static const int constants[] = {0, 1,  -1, 2,  3,    4,          -4,
+                                  7, 100, 31, 32, 1000, 2147483647,
+                                  -2147483647 - 1};
+  static const int offsets[] = {0, 4, -4, 8, 256};
+  int num_constants = sizeof(constants) / sizeof(constants[0]);
+  int kind = random_below(state, 100);
+
+  if (kind < 3) {
+    strcpy(out, "%EIP");
+  } else if (kind < 40) {
+    strcpy(out, register_names[random_below(state, 5)]);
+  } else if (kind < 58) {
+    sprintf(out, "$%d", constants[random_below(state, num_constants)]);
+  } else if (kind < 70) {
+    sprintf(out, "$%d", random_below(state, 10001) - 5000);
+  } else if (kind < 80) {
+    sprintf(out, "(%s)", register_names[random_below(state, 5)]);
+  } else if (kind < 92) {
+    sprintf(out, "%d(%s)", offsets[random_below(state, 5)],
+            register_names[random_below(state, 5)]);
+  } else {
+    sprintf(out, "%d(%s)", random_below(state, 4501) - 300,
+            register_names[random_below(state, 5)]);
+  }
+}
+
+/* Fill program with up to max_lines lines ending in END. Every label that is
+ * jumped to is defined exactly once. */
+static void generate_program(Program *program, unsigned long long seed,
+                             int max_lines) {
+  static const char *const jumps[] = {"JMP", "JE", "JNE", "JL", "JG",
+                                      "JLE", "JGE", "JA", "JB"};
+  static const char *const arithmetic[] = {"SUBL", "IMULL", "ANDL",
+                                           "ORL",  "XORL",  "SHLL",
+                                           "SARL", "INCL",  "DECL"};
+  static const char *const block[] = {"MOVSL", "STOSL", "CMPSL"};
+  unsigned long long state = seed;
+  int num_lines = 1 + random_below(&state, max_lines - FUZZ_LABELS - 2);
+  int placed[FUZZ_LABELS] = {0};
+  char a[FUZZ_LINE_SIZE / 2], b[FUZZ_LINE_SIZE / 2];
+
+  program->num_lines = 1;  // the return address pushed below
+  for (int i = 0; i < num_lines; i++) {
+    char *line = program->lines[program->num_lines++];
+    int kind = random_below(&state, 100);
+    int label = random_below(&state, FUZZ_LABELS);
+
+    random_operand(&state, a);
+    random_operand(&state, b);
+    if (kind >= 67 && kind < 88 && placed[label] &&
+        random_below(&state, 4) > 0) {
+      // Most jumps and calls go forward, or few programs would end
+      int forward = random_below(&state, FUZZ_LABELS);
+      for (int n = 0; n < FUZZ_LABELS && placed[label]; n++) {
+        label = (forward + n) % FUZZ_LABELS;
+      }
+    }
+    if (kind < 12) {
+      if (placed[label]) {
+        strcpy(line, "NOP");
+      } else {
+        sprintf(line, ".L%d", label);
+        placed[label] = 1;
+      }
+    } else if (kind < 24) {
+      sprintf(line, "MOVL %s %s", a, b);
+    } else if (kind < 33) {
+      sprintf(line, "ADDL %s %s", a, b);
+    } else if (kind < 45) {
+      int op = random_below(&state, 9);
+      if (op < 7) {
+        sprintf(line, "%s %s %s", arithmetic[op], a, b);
+      } else {
+        sprintf(line, "%s %s", arithmetic[op], b);
+      }
+    } else if (kind < 55) {
+      sprintf(line, "CMPL %s %s", a, b);
+    } else if (kind < 61) {
+      sprintf(line, "PUSHL %s", a);
+    } else if (kind < 67) {
+      sprintf(line, "POPL %s", a);
+    } else if (kind < 81) {
+      sprintf(line, "%s .L%d", jumps[random_below(&state, 9)], label);
+    } else if (kind < 88) {
+      sprintf(line, "CALL .L%d", label);
+    } else if (kind < 94) {
+      strcpy(line, "RET");
+    } else if (kind < 96) {
+      // Counts the block instructions can run with
+      sprintf(line, "MOVL $%d %%ECX", random_below(&state, 40));
+    } else if (kind < 99) {
+      // Mostly operands of the right kind, at short distances so that the
+      // ranges overlap
+      int op = random_below(&state, 3);
+      if (random_below(&state, 4) > 0) {
+        if (op != 1) {
+          sprintf(a, "%d(%s)", 4 * random_below(&state, 24),
+                  register_names[random_below(&state, 5)]);
+        }
+        sprintf(b, "%d(%s)", 4 * random_below(&state, 24),
+                register_names[random_below(&state, 5)]);
+      }
+      sprintf(line, "%s %s %s", block[op], a, b);
+    } else {
+      // Not END: loading stops at the first one, and labels after it
+      strcpy(line, "NOP");
+    }
+  }
+  for (int label = 0; label < FUZZ_LABELS; label++) {
+    if (!placed[label]) {
+      sprintf(program->lines[program->num_lines++], ".L%d", label);
+    }
+  }
+  strcpy(program->lines[program->num_lines++], "END");
+  // A RET without a CALL would otherwise pop a 0 off the clear stack and
+  // start the program again, usually forever
+  sprintf(program->lines[0], "PUSHL $%d", 4 * (program->num_lines - 1));
+
+  for (int r = 0; r < 3; r++) {
+    program->registers[r] = random_below(&state, 2001) - 1000;
+  }
+  // Half the lanes start close to the first one, so some of them only part
+  // ways at a later branch
+  for (int lane = 0; lane < LANE_COUNT - 1; lane++) {
+    int near = random_below(&state, 2);
+    for (int r = 0; r < 3; r++) {
+      program->lane_registers[lane][r] =
+          near ? program->registers[r] + random_below(&state, 5) - 2
+               : random_below(&state, 2001) - 1000;
+    }
+  }
+}
+
+/* Whether every label a line jumps to is still defined, so a shrunk program
+ * still loads */
+static int labels_defined(const Program *program) {
+  for (int i = 0; i < program->num_lines; i++) {
+    const char *target = strchr(program->lines[i], '.');
+    if (target == NULL || target == program->lines[i]) continue;
+    int found = 0;
+    for (int j = 0; j < program->num_lines && !found; j++) {
+      found = strcmp(program->lines[j], target) == 0;
+    }
+    if (!found) return 0;
+  }
+  return 1;
+}
+
+static size_t program_text(const Program *program, char *text) {
+  size_t size = 0;
+  for (int i = 0; i < program->num_lines; i++) {
+    size += sprintf(text + size, "%s\n", program->lines[i]);
+  }
+  return size;
+}
+
+/*** Running a case ***/
+
+// The running case, written out if an engine hangs or crashes on it
+static char current_text[FUZZ_MAX_LINES * FUZZ_LINE_SIZE];
+static size_t current_size;
+static char current_seed[64];
+static const char *current_engine = "";
+
+static void write_string(const char *s) {
+  if (write(STDOUT_FILENO, s, strlen(s)) < 0) _exit(2);
+}
+
+static void report_signal(int signal) {
+  write_string("\nfuzz: ");
+  write_string(current_engine);
+  write_string(signal == SIGALRM ? " engine did not stop on case seed "
+                                 : " engine crashed on case seed ");
+  write_string(current_seed);
+  write_string(":\n");
+  if (write(STDOUT_FILENO, current_text, current_size) < 0) _exit(2);
+  _exit(2);
+}
+
+static int load_program(System *sys, const Program *program) {
+  current_size = program_text(program, current_text);
+  return load_instructions_from_buffer(sys, current_text, current_size);
+}
+
+/* Start a run of the loaded program from the initial EAX, EDX and ECX in
+ * registers */
+static void start_run(System *sys, const Registers registers[3]) {
+  reset_system(sys);
+  memcpy(sys->registers, registers, 3 * sizeof(Registers));
+}
+
+static void save_outcome(const System *sys, ExecResult result, Outcome *out) {
+  memcpy(out->registers, sys->registers, sizeof(out->registers));
+  out->comparison_flag = sys->comparison_flag;
+  out->comparison_source = sys->comparison_source;
+  out->result = result;
+  memcpy(out->data, sys->memory.data, sizeof(out->data));
+}
+
+static int outcomes_differ(const Outcome *a, const Outcome *b) {
+  return memcmp(a->registers, b->registers, sizeof(a->registers)) ||
+         a->comparison_flag != b->comparison_flag ||
+         a->comparison_source != b->comparison_source ||
+         a->result != b->result || memcmp(a->data, b->data, sizeof(a->data));
+}
+
+/* Run the loaded program on the string engine, the reference */
+static void run_reference(System *sys, const Registers registers[3],
+                          Outcome *out) {
+  start_run(sys, registers);
+  sys->engine = ENGINE_STRING;
+  save_outcome(sys, execute_instructions(sys), out);
+}
+
+// System the round trip variant loads the bytecode image of the case into
+static System round_trip;
+
+/*
+Write the program of sys as a bytecode image and load it into round_trip, run
+the first FUZZ_SNAPSHOT_STEPS instructions or so on sys and finish the run on
+round_trip from a snapshot of that point. It returns the ExecResult of the
+whole run, whose final state is left in round_trip.
+*/
+static ExecResult run_round_trip(System *sys) {
+  char *image;
+  size_t size;
+  FILE *file = open_memstream(&image, &size);
+  if (file == NULL) {
+    perror("Error creating bytecode image");
+    exit(EXIT_FAILURE);
+  }
+  write_bytecode(sys, file);
+  if (fclose(file) != 0 ||
+      load_bytecode(&round_trip, image, size, "bytecode image") != 0) {
+    fprintf(stderr, "fuzz: the bytecode image of case %s does not load\n",
+            current_seed);
+    exit(EXIT_FAILURE);
+  }
+  free(image);
+
+  RunLimits limits = {FUZZ_SNAPSHOT_STEPS, 0, NULL, 0};
+  RunResult run = execute_with_limits(sys, &limits);
+  Snapshot snapshot;
+  if (take_snapshot(&snapshot, sys) != 0 ||
+      restore_snapshot(&round_trip, &snapshot) != 0) {
+    perror("Error taking snapshot");
+    exit(EXIT_FAILURE);
+  }
+  free_snapshot(&snapshot);
+  if (run.status == RUN_FINISHED) return run.result;
+
+  round_trip.engine = ENGINE_DECODED;
+  ExecResult result = execute_instructions(&round_trip);
+  return run.result != SUCCESS ? run.result : result;
+}
+
+static void run_variant(System *sys, const Program *program,
+                        const Variant *variant, Outcome *out) {
+  ExecResult result = SUCCESS;
+  const System *final = sys;
+
+  if (variant->mode == RUN_UNFUSED) unfuse_instructions(sys);
+  start_run(sys, program->registers);
+  sys->engine = variant->engine;
+  if (variant->mode == RUN_SLICED) {
+    // A budget of 1 stops the run at every jump, CALL, RET and write to EIP
+    RunLimits limits = {1, 0, NULL, 0};
+    RunResult run;
+    do {
+      run = execute_with_limits(sys, &limits);
+      if (result == SUCCESS) result = run.result;
+    } while (run.status == RUN_BUDGET_EXHAUSTED);
+  } else if (variant->mode == RUN_SAMPLED) {
+    // Sampling often, so the shadow stack is read at odd points as well
+    Sampler sampler;
+    if (initialize_sampler(&sampler, sys, 3, 0) != 0) {
+      perror("Error creating sampler");
+      exit(EXIT_FAILURE);
+    }
+    sys->sampler = &sampler;
+    result = execute_instructions(sys);
+    sys->sampler = NULL;
+    free_sampler(&sampler);
+  } else if (variant->mode == RUN_ROUND_TRIP) {
+    result = run_round_trip(sys);
+    final = &round_trip;
+  } else {
+    result = execute_instructions(sys);
+  }
+
+  save_outcome(final, result, out);
+}
+
+// Lane of the last lane group run that differed, and its initial registers
+static int failed_lane;
+static Registers failed_lane_registers[3];
+
+/*
+Run the loaded program on every lane of a lane group, each lane from its own
+initial registers, and compare every lane with a reference run from the same
+registers. Lanes whose registers do not end within steps instructions start
+from those of the case instead, which do.
+
+It returns 0 if every lane matches, or 1 with the lane recorded in failed_lane
+and expected and got holding the outcomes of that lane.
+*/
+static int run_lane_group(System *sys, const Program *program, long long steps,
+                          Outcome *expected, Outcome *got) {
+  Registers inputs[LANE_COUNT][3];
+  RunLimits limits = {steps, 0, NULL, 0};
+  for (int lane = 0; lane < LANE_COUNT; lane++) {
+    const Registers *registers =
+        lane == 0 ? program->registers : program->lane_registers[lane - 1];
+    start_run(sys, registers);
+    if (execute_with_limits(sys, &limits).status != RUN_FINISHED) {
+      registers = program->registers;
+    }
+    memcpy(inputs[lane], registers, sizeof(inputs[lane]));
+  }
+
+  LaneGroup group;
+  if (initialize_lane_group(&group, sys) != 0) {
+    perror("Error creating lane group");
+    exit(EXIT_FAILURE);
+  }
+  for (int lane = 0; lane < LANE_COUNT; lane++) {
+    for (int r = 0; r < 3; r++) {
+      group.registers[r][lane] = inputs[lane][r];
+    }
+  }
+  execute_lanes(&group);
+
+  int failed = 0;
+  for (int lane = 0; lane < LANE_COUNT && !failed; lane++) {
+    run_reference(sys, inputs[lane], expected);
+    for (int r = 0; r < 6; r++) {
+      got->registers[r] = group.registers[r][lane];
+    }
+    got->comparison_flag = group.comparison_flag[lane];
+    got->comparison_source = group.comparison_source[lane];
+    got->result = group.results[lane];
+    memcpy(got->data, group.data + (size_t)lane * FUZZ_DATA_SIZE,
+           sizeof(got->data));
+    if (outcomes_differ(expected, got)) {
+      failed = 1;
+      failed_lane = lane;
+      memcpy(failed_lane_registers, inputs[lane], sizeof(inputs[lane]));
+    }
+  }
+  free_lane_group(&group);
+  return failed;
+}
+
+/* Print how got differs from expected */
+static void print_difference(const Outcome *expected, const Outcome *got) {
+  static const char *const names[] = {"EAX", "EDX", "ECX",
+                                      "ESP", "EBP", "EIP"};
+  for (int r = 0; r < 6; r++) {
+    if (got->registers[r] != expected->registers[r]) {
+      printf("  %s: %d, expected %d\n", names[r], got->registers[r],
+             expected->registers[r]);
+    }
+  }
+  if (got->comparison_flag != expected->comparison_flag) {
+    printf("  comparison flag: %d, expected %d\n", got->comparison_flag,
+           expected->comparison_flag);
+  }
+  if (got->comparison_source != expected->comparison_source) {
+    printf("  comparison source: %d, expected %d\n", got->comparison_source,
+           expected->comparison_source);
+  }
+  if (got->result != expected->result) {
+    printf("  result: %s, expected %s\n", get_result_name(got->result),
+           get_result_name(expected->result));
+  }
+  int words = 0;
+  for (int i = 0; i < FUZZ_DATA_SIZE; i++) {
+    if (got->data[i] == expected->data[i]) continue;
+    if (++words > 8) {
+      printf("  more data words differ\n");
+      break;
+    }
+    printf("  data at %d: %d, expected %d\n", i * 4, got->data[i],
+           expected->data[i]);
+  }
+}
+
+/*
+Run program on the reference and on every variant.
+
+It returns -1 if the program does not load or does not end within steps
+instructions, 0 if every variant matches the reference, or 1 + the index of
+the first variant that does not. expected and got then hold the outcomes of
+the reference and of that variant.
+*/
+static int run_case(System *sys, const Program *program, long long steps,
+                    Outcome *expected, Outcome *got) {
+  if (load_program(sys, program) != 0) return -1;
+
+  RunLimits limits = {steps, 0, NULL, 0};
+  start_run(sys, program->registers);
+  current_engine = "sliced";
+  if (execute_with_limits(sys, &limits).status != RUN_FINISHED) return -1;
+
+  current_engine = "string";
+  run_reference(sys, program->registers, expected);
+
+  for (int v = 0; v < NUM_VARIANTS; v++) {
+    current_engine = variants[v].name;
+    if (variants[v].mode == RUN_LANE_GROUP) {
+      // The lanes are compared with references of their own, kept apart
+      // from the expected outcome of the other variants
+      static Outcome lane_expected, lane_got;
+      if (run_lane_group(sys, program, steps, &lane_expected, &lane_got)) {
+        *expected = lane_expected;
+        *got = lane_got;
+        return 1 + v;
+      }
+      continue;
+    }
+    run_variant(sys, program, &variants[v], got);
+    if (outcomes_differ(expected, got)) return 1 + v;
+  }
+  return 0;
+}
+
+/*
+Remove lines of a failing program, in chunks halving down to single lines,
+for as long as some variant still fails on it. The failing variant may
+change on the way; the first failing one of the result is returned as for
+run_case.
+*/
+static int shrink_program(System *sys, Program *program, long long steps,
+                          Outcome *expected, Outcome *got) {
+  Program candidate;
+  int failure = run_case(sys, program, steps, expected, got);
+
+  for (int chunk = program->num_lines / 2; chunk >= 1; chunk /= 2) {
+    int removed;
+    do {
+      removed = 0;
+      for (int start = 0; start + chunk <= program->num_lines;) {
+        candidate = *program;
+        memmove(candidate.lines[start], candidate.lines[start + chunk],
+                (candidate.num_lines - start - chunk) * FUZZ_LINE_SIZE);
+        candidate.num_lines -= chunk;
+        if (labels_defined(&candidate) &&
+            run_case(sys, &candidate, steps, expected, got) > 0) {
+          *program = candidate;
+          removed = 1;
+        } else {
+          start += chunk;
+        }
+      }
+    } while (removed);
+  }
+
+  // Simpler initial registers make the failure easier to follow
+  for (int r = 0; r < 3; r++) {
+    candidate = *program;
+    candidate.registers[r] = 0;
+    if (run_case(sys, &candidate, steps, expected, got) > 0) {
+      *program = candidate;
+    }
+  }
+
+  int shrunk = run_case(sys, program, steps, expected, got);
+  return shrunk > 0 ? shrunk : failure;
+}
+
+static void report_failure(const FuzzOptions *options, System *sys,
+                           Program *program, unsigned long long seed) {
+  Outcome *expected = malloc(sizeof(Outcome));
+  Outcome *got = malloc(sizeof(Outcome));
+  int lines = program->num_lines;
+  int failure = shrink_program(sys, program, options->steps, expected, got);
+
+  printf("\nMISMATCH: case seed %llu, %s engine, shrunk from %d to %d lines\n",
+         seed, variants[failure - 1].name, lines, program->num_lines);
+  printf("Initial EAX=%d EDX=%d ECX=%d\n", program->registers[0],
+         program->registers[1], program->registers[2]);
+  if (variants[failure - 1].mode == RUN_LANE_GROUP) {
+    printf("Lane %d of %d differs, initial EAX=%d EDX=%d ECX=%d\n",
+           failed_lane, LANE_COUNT, failed_lane_registers[0],
+           failed_lane_registers[1], failed_lane_registers[2]);
+  }
+  program_text(program, current_text);
+  printf("%s", current_text);
+  print_difference(expected, got);
+  fflush(stdout);
+
+  if (options->out) {
+    FILE *file = fopen(options->out, "w");
+    if (!file) {
+      perror("Error opening file");
+    } else {
+      fputs(current_text, file);
+      fclose(file);
+    }
+  }
+  free(expected);
+  free(got);
+}
+
+int main(int argc, char *argv[]) {
+  FuzzOptions options = {100000, (unsigned long long)time(NULL), 40, 10000, 0,
+                         NULL};
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cases") == 0 && i + 1 < argc) {
+      options.cases = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      options.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+      options.max_lines = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+      options.steps = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--keep-going") == 0) {
+      options.keep_going = 1;
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      options.out = argv[++i];
+    } else {
+      printf("Usage: %s [--cases N] [--seed S] [--lines N] [--steps N] "
+             "[--keep-going] [--out FILE]\n",
+             argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (options.max_lines < FUZZ_LABELS + 3) options.max_lines = FUZZ_LABELS + 3;
+  if (options.max_lines > FUZZ_MAX_LINES) options.max_lines = FUZZ_MAX_LINES;
+  if (options.steps < 1) options.steps = 1;
+
+  System sys;
+  if (initialize_system_with_size(&sys, FUZZ_MAX_LINES, FUZZ_DATA_SIZE) != 0 ||
+      initialize_system_with_size(&round_trip, FUZZ_MAX_LINES,
+                                  FUZZ_DATA_SIZE) != 0) {
+    perror("Error creating system");
+    return EXIT_FAILURE;
+  }
+  Program *program = malloc(sizeof(Program));
+  Outcome *expected = malloc(sizeof(Outcome));
+  Outcome *got = malloc(sizeof(Outcome));
+  signal(SIGALRM, report_signal);
+  signal(SIGSEGV, report_signal);
+  signal(SIGBUS, report_signal);
+  signal(SIGFPE, report_signal);
+
+  printf("Fuzzing %lld cases from seed %llu\n", options.cases, options.seed);
+  fflush(stdout);
+  long long compared = 0, skipped = 0, failures = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (long long i = 0; i < options.cases; i++) {
+    unsigned long long seed = options.seed + i;
+    generate_program(program, seed, options.max_lines);
+    snprintf(current_seed, sizeof(current_seed), "%llu", seed);
+    alarm(FUZZ_TIMEOUT);
+    int result = run_case(&sys, program, options.steps, expected, got);
+    if (result < 0) {
+      skipped++;
+      continue;
+    }
+    compared++;
+    if (result > 0) {
+      failures++;
+      report_failure(&options, &sys, program, seed);
+      if (!options.keep_going) break;
+    }
+  }
+  alarm(0);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  long long run = compared + skipped;
+  printf("%lld cases compared, %lld did not end within %lld steps (%.1f%%), "
+         "%lld failed (%.0f cases/s)\n",
+         compared, skipped, options.steps, run ? 100.0 * skipped / run : 0.0,
+         failures, run / seconds);
+
+  free(program);
+  free(expected);
+  free(got);
+  free_system(&sys);
+  free_system(&round_trip);
+  return failures ? EXIT_FAILURE : 0;
+}
@@ -1,41 +1,172 @@
 #include "interpreter.h"
+#include "blocks.h"
+#include "fusion.h"
+#include "jit.h"
+#include "lanes.h"
+#include "profile.h"
+#include "sampler.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Split the first three space separated tokens of input into str1, str2 and
+ * str3, buffers of TOKEN_SIZE bytes; missing tokens are empty. It returns 0, or
+ * -1 if a token had to be cut short to fit. */
+int splitString(const char *input, char *str1, char *str2, char *str3) {
+  char *parts[3] = {str1, str2, str3};
+  int result = 0;
+
+  for (int i = 0; i < 3; i++) {
+    input += strspn(input, " ");
+    size_t len = strcspn(input, " ");
+    size_t kept = len < TOKEN_SIZE ? len : TOKEN_SIZE - 1;
+    if (kept < len) result = -1;
+    memcpy(parts[i], input, kept);
+    parts[i][kept] = '\0';
+    input += len;
+  }
+  return result;
+}
 
-void splitString(const char *input, char *str1, char *str2, char *str3) {
-  char temp[100]; 
-  strncpy(temp, input, sizeof(temp) - 1);
-  temp[sizeof(temp) - 1] = '\0'; 
+/* Whether a token of a normalized line does not fit in TOKEN_SIZE bytes */
+static int has_long_token(const char *line) {
+  while (*line != '\0') {
+    size_t len = strcspn(line, " ");
+    if (len >= TOKEN_SIZE) return 1;
+    line += len;
+    line += strspn(line, " ");
+  }
+  return 0;
+}
 
-  str1[0] = str2[0] = str3[0] = '\0';
+/* reset the system to a defulat status, with segments of MEMORY_SIZE */
+void initialize_system(System *sys) {
+  if (initialize_system_with_size(sys, MEMORY_SIZE, MEMORY_SIZE) != 0) {
+    perror("Error allocating memory");
+    exit(EXIT_FAILURE);
+  }
+}
 
-  char *token = strtok(temp, " ");
-  if (token) strcpy(str1, token);
+/*
+Reset the system to a default status with an instruction segment of
+instruction_size instructions and a data segment of data_size words. Both
+segments, the decoded code and the label table come from a single allocation
+that is released by free_system.
 
-  token = strtok(NULL, " ");
-  if (token) strcpy(str2, token);
+ESP and EBP start at data_size - 256, like they did with the fixed size
+segments, so data_size has to be larger than 256.
 
-  token = strtok(NULL, " ");
-  if (token) strcpy(str3, token);
-}
+It returns 0 on success, or -1 if a size is invalid or the allocation fails.
+*/
+int initialize_system_with_size(System *sys, int instruction_size,
+                                int data_size) {
+  if (instruction_size <= 0 || data_size <= 256 || data_size > INT_MAX / 4) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int label_table_size = 1;
+  while (label_table_size < 2 * instruction_size) label_table_size *= 2;
+
+  // Arrays are laid out by decreasing alignment so none needs padding
+  size_t size = (size_t)instruction_size * sizeof(char *) +
+                (size_t)instruction_size * sizeof(void *) +
+                (size_t)label_table_size * sizeof(Label) +
+                (size_t)instruction_size * sizeof(Instruction) +
+                (size_t)data_size * sizeof(int);
+  char *arena = calloc(1, size);
+  if (arena == NULL) return -1;
+
+  Memory *mem = &sys->memory;
+  mem->arena = arena;
+  mem->text = NULL;
+  mem->image = NULL;
+  mem->image_size = 0;
+  mem->attached = 0;
+  mem->instruction = (char **)arena;
+  mem->threaded = (const void **)(mem->instruction + instruction_size);
+  mem->labels = (Label *)(mem->threaded + instruction_size);
+  mem->code = (Instruction *)(mem->labels + label_table_size);
+  mem->data = (int *)(mem->code + instruction_size);
+
+  mem->num_instructions = 0;
+  mem->instruction_size = instruction_size;
+  mem->data_size = data_size;
+  mem->data_limit = (data_size - 1) * 4;
+  mem->label_table_size = label_table_size;
+  mem->num_labels = 0;
+  for (int i = 0; i < label_table_size; i++) {
+    mem->labels[i] = (Label){NULL, -1};
+  }
 
-/* reset the system to a defulat status */
-void initialize_system(System *sys) {
   sys->registers[EAX] = 0;
   sys->registers[EDX] = 0;
   sys->registers[ECX] = 0;
-  sys->registers[ESP] = MEMORY_SIZE - 256;
-  sys->registers[EBP] = MEMORY_SIZE - 256;
+  sys->registers[ESP] = data_size - 256;
+  sys->registers[EBP] = data_size - 256;
   sys->registers[EIP] = 0;  // Program counter
 
-  sys->memory.num_instructions = 0;
-  for (int i = 0; i < MEMORY_SIZE; i++) {
-    sys->memory.instruction[i] = NULL;
-    sys->memory.data[i] = 0;
-  }
   sys->comparison_flag = 0;
+  sys->comparison_source = 0;
+  sys->engine = ENGINE_DECODED;
+  sys->profile = NULL;
+  sys->jit = NULL;
+  sys->blocks = NULL;
+  sys->trace = NULL;
+  sys->sampler = NULL;
+  return 0;
+}
+
+/* Release the program text and the segments of the system */
+void free_system(System *sys) {
+  discard_compiled_program(sys);
+  release_program_image(sys);
+  free(sys->memory.text);
+  free(sys->memory.arena);
+  sys->memory.text = NULL;
+  sys->memory.arena = NULL;
+  sys->memory.num_instructions = 0;
+}
+
+/* Free the native code and blocks compiled from the program of sys. They are
+ * only checked against the location and size of the code segment, which the
+ * next program loaded into sys reuses, so every load discards them. */
+void discard_compiled_program(System *sys) {
+  free_jit(sys->jit);
+  free_block_cache(sys->blocks);
+  sys->jit = NULL;
+  sys->blocks = NULL;
+}
+
+/* Unmap the shared program image the code segment points into, if any, and
+ * point the code segment back at the arena so a program can be loaded again.
+ * A system attached to another one's program has no image of its own. */
+void release_program_image(System *sys) {
+  Memory *mem = &sys->memory;
+  if (mem->image == NULL || mem->attached) return;
+  munmap((void *)mem->image, mem->image_size);
+  mem->image = NULL;
+  mem->image_size = 0;
+  mem->code = (Instruction *)(mem->labels + mem->label_table_size);
+}
+
+/* Loading into a system attached to another one's program (attach_program)
+ * would overwrite that program. It reports it on stderr and returns -1 for
+ * such a system, or 0 if sys owns its program. */
+int check_own_program(const System *sys) {
+  if (!sys->memory.attached) return 0;
+  fprintf(stderr, "Error: cannot load into a system sharing a program\n");
+  return -1;
 }
 
 /* Remove leading and extra space, and \n from the input string and return the
@@ -62,32 +193,104 @@ int reformat(char *line) {
   return size;
 }
 
-/* Load all the instruction from the file into the instruction segment in the
- * system */
-void load_instructions_from_file(System *sys, const char *filename) {
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    perror("Error opening file");
-    exit(EXIT_FAILURE);
+/*
+Load the program text in the size bytes at src into the instruction segment in
+the system. Every line is normalized with reformat into one text buffer, so
+instruction[] holds views into that buffer instead of a separate allocation
+per line.
+
+The label table is built and the instructions are decoded once the whole text
+is read; duplicate or missing labels are load errors. The errors are reported
+on stderr.
+
+It returns 0 on success, or -1 if the text buffer cannot be allocated or the
+program has errors, in which case the system is left without a program. It
+also returns -1, leaving the system as it is, if sys is attached to another
+program.
+*/
+int load_instructions_from_buffer(System *sys, const char *src, size_t size) {
+  if (check_own_program(sys) != 0) return -1;
+  discard_compiled_program(sys);
+  // A normalized line is never longer than the raw one
+  char *text = malloc(size + 1);
+  if (text == NULL) {
+    perror("Error allocating memory");
+    return -1;
   }
+  release_program_image(sys);
+  free(sys->memory.text);
+  // The labels of a program loaded before point into the text just freed
+  for (int i = 0; i < sys->memory.label_table_size; i++) {
+    sys->memory.labels[i] = (Label){NULL, -1};
+  }
+  sys->memory.num_labels = 0;
 
-  char line[256];
+  size_t pos = 0, used = 0;
   int address = 0;
 
-  while (fgets(line, sizeof(line), file) != NULL && address < MEMORY_SIZE) {
-    // Remove newline character
-    line[strlen(line) - 1] = '\0';
+  while (pos < size && address < sys->memory.instruction_size) {
+    const char *eol = memchr(src + pos, '\n', size - pos);
+    size_t len = eol ? (size_t)(eol - (src + pos)) : size - pos;
+
+    char *line = text + used;
+    memcpy(line, src + pos, len);
+    line[len] = '\0';
+    pos += len + 1;
+
     // Save instruction to the memory
-    int size = reformat(line);
-    if (size == 0) continue;
-    sys->memory.instruction[address] = strdup(line);
+    int line_size = reformat(line);
+    if (line_size == 0) continue;
+    sys->memory.instruction[address] = line;
+    used += line_size + 1;
     address++;
     // Reach out the end of the instruction
     if (strcmp(line, "END") == 0) break;
   }
   sys->memory.num_instructions = address;
+  sys->memory.text = text;
 
-  fclose(file);
+  int errors = build_label_table(sys);
+  errors += decode_instructions(sys);
+  if (errors != 0) {
+    sys->memory.num_instructions = 0;
+    return -1;
+  }
+  fuse_instructions(sys);
+  return 0;
+}
+
+/*
+Load all the instruction from the file into the instruction segment in the
+system, as load_instructions_from_buffer does. The file is mapped rather than
+read line by line.
+
+It returns 0 on success, or -1 if the file cannot be read or the program has
+errors.
+*/
+int load_instructions_from_file(System *sys, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Error opening file");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  size_t file_size = st.st_size;
+  const char *src = "";
+  if (file_size > 0) {
+    src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src == MAP_FAILED) {
+      perror("Error mapping file");
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+
+  int result = load_instructions_from_buffer(sys, src, file_size);
+  if (file_size > 0) munmap((void *)src, file_size);
+  return result;
 }
 
 /* Return value could be the name of one of the valid registers, or NOT_REG for
@@ -134,14 +337,18 @@ MemoryType get_memory_type(const char *operand) {
       result.type = CONST;
       result.value = atoi(&operand[1]);
     } else if (strstr(operand, "(") && strstr(operand, ")")) {
-      char str[5];
+      // The register is what follows ( up to the last character, like ")"
+      char str[TOKEN_SIZE];
+      char *end = (char *)operand;
       if (operand[0] == '(') {
-        sscanf(operand, "(%s)", str);
         result.value = 0;
       } else {
-        sscanf(operand, "%d(%s", &result.value, str);
+        result.value = (int)strtol(operand, &end, 10);
       }
-      str[strlen(str) - 1] = '\0';
+      size_t len = *end == '(' ? strcspn(end + 1, " ") : 0;
+      if (len == 0 || len > sizeof(str)) return result;
+      memcpy(str, end + 1, len - 1);
+      str[len - 1] = '\0';
       result.reg = get_register_by_name(str);
       if (result.reg != NOT_REG) {
         result.type = MEM;
@@ -151,6 +358,61 @@ MemoryType get_memory_type(const char *operand) {
   return result;
 }
 
+/* FNV-1a hash of a label, used to index the label table */
+static unsigned int hash_label(const char *label) {
+  unsigned int hash = 2166136261u;
+  for (; *label; label++) {
+    hash = (hash ^ (unsigned char)*label) * 16777619u;
+  }
+  return hash;
+}
+
+/* Return the slot of the label table that holds label, or the empty slot where
+ * it would be inserted */
+static Label *find_label_slot(System *sys, const char *label) {
+  unsigned int mask = sys->memory.label_table_size - 1;
+  unsigned int idx = hash_label(label) & mask;
+  while (sys->memory.labels[idx].name != NULL &&
+         strcmp(sys->memory.labels[idx].name, label) != 0) {
+    idx = (idx + 1) & mask;
+  }
+  return &sys->memory.labels[idx];
+}
+
+/*
+Build the label table from the instruction segment. Every instruction that
+starts with . is a label, and maps to the address of the instruction after it.
+
+It returns 0 on success, or the number of duplicate labels found. Each
+duplicate is reported on stderr.
+*/
+int build_label_table(System *sys) {
+  int errors = 0;
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    const char *line = sys->memory.instruction[i];
+    if (line[0] != '.') continue;
+    if (add_label(sys, line, (i + 1) * 4) != 0) {
+      fprintf(stderr, "Error: duplicate label %s at instruction %d\n", line,
+              i);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+/* Add a label to the label table. name must stay valid as long as the table is
+ * used. It returns 0 on success, or -1 if the label is already in the table. */
+int add_label(System *sys, const char *name, int address) {
+  Label *slot = find_label_slot(sys, name);
+  if (slot->name != NULL) {
+    return -1;
+  }
+  slot->name = name;
+  slot->address = address;
+  sys->memory.num_labels++;
+  return 0;
+}
+
 /*
 This function takes a string that represnts a label in the instruction.
 It returns the memory address of the next instruction
@@ -161,14 +423,196 @@ int get_addr_from_label(System *sys, const char *label) {
   if (label[0] != '.') {
     return -1;
   }
+  return find_label_slot(sys, label)->address;
+}
+
+/* Return the name of the label whose address is addr, or NULL if no label
+ * has that address. This scans the whole table and is meant for reports. */
+const char *get_label_by_addr(System *sys, int addr) {
+  for (int i = 0; i < sys->memory.label_table_size; i++) {
+    if (sys->memory.labels[i].name != NULL &&
+        sys->memory.labels[i].address == addr) {
+      return sys->memory.labels[i].name;
+    }
+  }
+  return NULL;
+}
+
+/* Return the opcode for an instruction mnemonic, or OP_NOP if the mnemonic is
+ * not one the interpreter knows (labels included) */
+Opcode get_opcode_by_name(const char *name) {
+  if (strcmp(name, "MOVL") == 0) return OP_MOVL;
+  if (strcmp(name, "ADDL") == 0) return OP_ADDL;
+  if (strcmp(name, "SUBL") == 0) return OP_SUBL;
+  if (strcmp(name, "IMULL") == 0) return OP_IMULL;
+  if (strcmp(name, "ANDL") == 0) return OP_ANDL;
+  if (strcmp(name, "ORL") == 0) return OP_ORL;
+  if (strcmp(name, "XORL") == 0) return OP_XORL;
+  if (strcmp(name, "SHLL") == 0) return OP_SHLL;
+  if (strcmp(name, "SARL") == 0) return OP_SARL;
+  if (strcmp(name, "INCL") == 0) return OP_INCL;
+  if (strcmp(name, "DECL") == 0) return OP_DECL;
+  if (strcmp(name, "PUSHL") == 0) return OP_PUSHL;
+  if (strcmp(name, "POPL") == 0) return OP_POPL;
+  if (strcmp(name, "CMPL") == 0) return OP_CMPL;
+  if (strcmp(name, "MOVSL") == 0) return OP_MOVSL;
+  if (strcmp(name, "STOSL") == 0) return OP_STOSL;
+  if (strcmp(name, "CMPSL") == 0) return OP_CMPSL;
+  if (strcmp(name, "CALL") == 0) return OP_CALL;
+  if (strcmp(name, "RET") == 0) return OP_RET;
+  if (strcmp(name, "JMP") == 0) return OP_JMP;
+  if (strcmp(name, "JE") == 0) return OP_JE;
+  if (strcmp(name, "JNE") == 0) return OP_JNE;
+  if (strcmp(name, "JL") == 0) return OP_JL;
+  if (strcmp(name, "JG") == 0) return OP_JG;
+  if (strcmp(name, "JLE") == 0) return OP_JLE;
+  if (strcmp(name, "JGE") == 0) return OP_JGE;
+  if (strcmp(name, "JA") == 0) return OP_JA;
+  if (strcmp(name, "JB") == 0) return OP_JB;
+  if (strcmp(name, "END") == 0) return OP_END;
+  return OP_NOP;
+}
+
+/* Return the mnemonic of an opcode; labels and unknown lines are NOP */
+const char *get_opcode_name(Opcode op) {
+  static const char *const names[] = {
+      [OP_NOP] = "NOP",   [OP_MOVL] = "MOVL", [OP_ADDL] = "ADDL",
+      [OP_SUBL] = "SUBL", [OP_IMULL] = "IMULL", [OP_ANDL] = "ANDL",
+      [OP_ORL] = "ORL",   [OP_XORL] = "XORL", [OP_SHLL] = "SHLL",
+      [OP_SARL] = "SARL", [OP_INCL] = "INCL", [OP_DECL] = "DECL",
+      [OP_PUSHL] = "PUSHL", [OP_POPL] = "POPL", [OP_CMPL] = "CMPL",
+      [OP_MOVSL] = "MOVSL", [OP_STOSL] = "STOSL", [OP_CMPSL] = "CMPSL",
+      [OP_CALL] = "CALL", [OP_RET] = "RET",   [OP_JMP] = "JMP",
+      [OP_JE] = "JE",     [OP_JNE] = "JNE",   [OP_JL] = "JL",
+      [OP_JG] = "JG",     [OP_JLE] = "JLE",   [OP_JGE] = "JGE",
+      [OP_JA] = "JA",     [OP_JB] = "JB",     [OP_END] = "END",
+#define OPCODE_NAME(name, op, src, dst) [name] = #name + 3,
+      SPECIALIZED_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+      [OP_ADDL_ADDL] = "ADDL_ADDL", [OP_CMPL_JCC] = "CMPL_JCC",
+      [OP_ADDL_CMPL_JCC] = "ADDL_CMPL_JCC", [OP_TRAP] = "TRAP"};
+  return op >= OP_NOP && op < OP_COUNT ? names[op] : "UNKNOWN";
+}
+
+/* Return the specialized opcode for the operand types of a decoded MOVL, CMPL
+ * or arithmetic instruction, or its own opcode if the combination has no
+ * specialized handler. Instructions that write EIP keep the generic handler,
+ * which execute_with_limits treats as a branch. */
+Opcode get_specialized_opcode(const Instruction *inst) {
+  if (inst->dst.type == REG && inst->dst.reg == EIP) return inst->op;
+#define SELECT_OPCODE(name, op_, src_, dst_)                            \
+  if (inst->op == op_ && inst->src.type == src_ && inst->dst.type == dst_) \
+    return name;
+  SPECIALIZED_OPCODES(SELECT_OPCODE)
+#undef SELECT_OPCODE
+  return inst->op;
+}
+
+/*
+Turn one line of instruction text into its decoded form. Operands are parsed
+with get_memory_type and branch labels are resolved to addresses, so this is
+the only place the text of an instruction has to be looked at.
+*/
+Instruction decode_instruction(System *sys, const char *line) {
+  char part1[TOKEN_SIZE], part2[TOKEN_SIZE], part3[TOKEN_SIZE];
+  Instruction inst = {OP_NOP, {UNKNOWN, NOT_REG, -1}, {UNKNOWN, NOT_REG, -1},
+                      -1, OP_NOP};
+
+  splitString(line, part1, part2, part3);
+  inst.op = get_opcode_by_name(part1);
+
+  switch (inst.op) {
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_SUBL:
+    case OP_IMULL:
+    case OP_ANDL:
+    case OP_ORL:
+    case OP_XORL:
+    case OP_SHLL:
+    case OP_SARL:
+    case OP_CMPL:
+    case OP_MOVSL:
+    case OP_STOSL:
+    case OP_CMPSL:
+      inst.src = get_memory_type(part2);
+      inst.dst = get_memory_type(part3);
+      break;
+    case OP_INCL:
+    case OP_DECL:
+      inst.src = (MemoryType){CONST, NOT_REG, 1};
+      inst.dst = get_memory_type(part2);
+      break;
+    case OP_PUSHL:
+      inst.src = get_memory_type(part2);
+      break;
+    case OP_POPL:
+      inst.dst = get_memory_type(part2);
+      break;
+    case OP_CALL:
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JLE:
+    case OP_JGE:
+    case OP_JA:
+    case OP_JB:
+      inst.target = get_addr_from_label(sys, part2);
+      break;
+    default:
+      break;
+  }
+  inst.fused = get_specialized_opcode(&inst);
+  return inst;
+}
+
+/*
+Decode every loaded instruction into the code segment of the system.
+
+It returns 0 on success, or the number of jumps and calls whose label cannot be
+found and of lines with a token longer than TOKEN_SIZE - 1 characters. Each of
+them is reported on stderr.
+*/
+int decode_instructions(System *sys) {
+  int errors = 0;
   for (int i = 0; i < sys->memory.num_instructions; i++) {
-    if (strcmp(sys->memory.instruction[i], label) == 0) {
-      return (i + 1) * 4;
+    if (has_long_token(sys->memory.instruction[i])) {
+      fprintf(stderr,
+              "Error: opcode, operand or label longer than %d characters at "
+              "instruction %d\n",
+              TOKEN_SIZE - 1, i);
+      errors++;
+      sys->memory.code[i] = decode_instruction(sys, "NOP");
+      continue;
     }
+    Instruction inst = decode_instruction(sys, sys->memory.instruction[i]);
+    if ((inst.op == OP_CALL || (inst.op >= OP_JMP && inst.op <= OP_JB)) &&
+        inst.target < 0) {
+      fprintf(stderr, "Error: undefined label in \"%s\" at instruction %d\n",
+              sys->memory.instruction[i], i);
+      errors++;
+    }
+    sys->memory.code[i] = inst;
   }
-  return -1;
+  return errors;
 }
 
+/* Address of a memory operand. It wraps around like the arithmetic, so an
+ * address that overflows is simply one outside the data segment. Operands
+ * without a register give their value, so it can be taken before the type
+ * of the operand is checked. */
+static inline int memory_address(const System *sys, MemoryType operand) {
+  unsigned base = operand.reg < NOT_REG ? (unsigned)sys->registers[operand.reg]
+                                        : 0;
+  return (int)(base + (unsigned)operand.value);
+}
+
+/* *target += value, wrapping around like the other arithmetic */
+static inline void add_wrapped(int *target, int value) {
+  *target = apply_alu_op(OP_ADDL, *target, value);
+}
 
 /*
 The execute_movl function validates and executes a movl instruction, ensuring source and destination operands are of known and appropriate types, and then performs the move operation if valid.
@@ -186,7 +630,7 @@ It will return Success if there is no error.
     if both src and dst are memory addresses. 
     
 It will return MEMORY_ERROR 
-    if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+    if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than data_limit).
 
 If there is any error, all the system registers, memory, and system status should remain unchanged.
 
@@ -194,10 +638,8 @@ Do not change EIP in this function.
 
 HINT: you may use get_memory_type in this function.
 */
-ExecResult execute_movl(System *sys, char *src, char *dst) {
-  MemoryType source = get_memory_type(src);
-  MemoryType destination = get_memory_type(dst);
-
+ExecResult execute_movl_op(System *sys, MemoryType source,
+                           MemoryType destination) {
   if(source.type == REG){
     if(destination.type == CONST){
       return INSTRUCTION_ERROR;
@@ -207,8 +649,8 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
       return SUCCESS;
     }
     else if(destination.type == MEM){
-      int totalVal = sys->registers[destination.reg] + destination.value;
-      if((totalVal < 0 || totalVal > ((MEMORY_SIZE - 1) * 4))){
+      int totalVal = memory_address(sys, destination);
+      if((totalVal < 0 || totalVal > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       sys->memory.data[totalVal / 4] = sys->registers[source.reg];
@@ -227,8 +669,8 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
       return SUCCESS;
     }
     else if(destination.type == MEM){
-      int totalVal = sys->registers[destination.reg] + destination.value;
-      if((totalVal < 0 || totalVal > ((MEMORY_SIZE - 1) * 4))){
+      int totalVal = memory_address(sys, destination);
+      if((totalVal < 0 || totalVal > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       else{
@@ -245,9 +687,9 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
       return INSTRUCTION_ERROR;
     }
     else if(destination.type == REG){
-      int totalVal = sys->registers[source.reg] + source.value;
+      int totalVal = memory_address(sys, source);
 
-      if((totalVal < 0 || totalVal > ((MEMORY_SIZE - 1) * 4))){
+      if((totalVal < 0 || totalVal > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       else{
@@ -266,6 +708,11 @@ ExecResult execute_movl(System *sys, char *src, char *dst) {
   return INSTRUCTION_ERROR;
 }
 
+/* String form of execute_movl_op: both operands are parsed on every call */
+ExecResult execute_movl(System *sys, char *src, char *dst) {
+  return execute_movl_op(sys, get_memory_type(src), get_memory_type(dst));
+}
+
 /*
 The execute_addl function validates and executes a addl instruction
   ensuring source and destination operands are of known and appropriate types
@@ -285,35 +732,36 @@ It will return INSTRUCTION_ERROR
   if both src and dst are memory addresses.
 
 It will return MEMORY_ERROR 
-  if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+  if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than data_limit).
 
 If there is any error, all the system registers, memory, and system status should remain unchanged.
 Do not change EIP in this function.
 
 HINT: you may use get_memory_type in this function.
 */
-ExecResult execute_addl(System *sys, char *src, char *dst) {
-  MemoryType source = get_memory_type(src);
-  MemoryType destination = get_memory_type(dst);
-  int totalValDest = sys->registers[destination.reg] + destination.value;
-  int totalValSrc = sys->registers[source.reg] + source.value;
+ExecResult execute_addl_op(System *sys, MemoryType source,
+                           MemoryType destination) {
+  int totalValDest = memory_address(sys, destination);
+  int totalValSrc = memory_address(sys, source);
 
   switch (destination.type) {
     case REG:
       if(source.type == CONST){
-        sys->registers[destination.reg] += source.value;
+        add_wrapped(&sys->registers[destination.reg], source.value);
         return SUCCESS;
       }
       else if(source.type == MEM){
-        //int totalValSrc = sys->registers[source.reg] + source.value;
-        if((totalValSrc < 0 || totalValSrc > ((MEMORY_SIZE - 1) * 4))){
+        //int totalValSrc = memory_address(sys, source);
+        if((totalValSrc < 0 || totalValSrc > sys->memory.data_limit)){
           return MEMORY_ERROR;
         }
-        sys->registers[destination.reg] += sys->memory.data[totalValSrc / 4];
+        add_wrapped(&sys->registers[destination.reg],
+                    sys->memory.data[totalValSrc / 4]);
         return SUCCESS;
       }
       else if(source.type == REG){
-        sys->registers[destination.reg] += sys->registers[source.reg];
+        add_wrapped(&sys->registers[destination.reg],
+                    sys->registers[source.reg]);
         return SUCCESS;
       }
       else{
@@ -322,19 +770,20 @@ ExecResult execute_addl(System *sys, char *src, char *dst) {
       break; 
 
     case MEM:
-      //int totalValDest = sys->registers[destination.reg] + destination.value;
-      if((totalValDest < 0 || totalValDest > ((MEMORY_SIZE - 1) * 4))){
+      //int totalValDest = memory_address(sys, destination);
+      if((totalValDest < 0 || totalValDest > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       else if(source.type == CONST){
-        sys->memory.data[totalValDest / 4] += source.value;
+        add_wrapped(&sys->memory.data[totalValDest / 4], source.value);
         return SUCCESS;
       }
       else if(source.type == MEM){
         return INSTRUCTION_ERROR;
       }
       else if(source.type == REG){
-        sys->memory.data[totalValDest / 4] += sys->registers[source.reg];
+        add_wrapped(&sys->memory.data[totalValDest / 4],
+                    sys->registers[source.reg]);
         return SUCCESS;
       }
       else{
@@ -354,6 +803,67 @@ ExecResult execute_addl(System *sys, char *src, char *dst) {
   return INSTRUCTION_ERROR;
 }
 
+/* String form of execute_addl_op */
+ExecResult execute_addl(System *sys, char *src, char *dst) {
+  return execute_addl_op(sys, get_memory_type(src), get_memory_type(dst));
+}
+
+/*
+Execute the arithmetic instruction op, one of SUBL, IMULL, ANDL, ORL, XORL,
+SHLL, SARL, INCL and DECL (or ADDL), storing apply_alu_op of the destination
+and the source in the destination. The operands are checked like those of
+ADDL, and like ADDL these instructions leave the comparison flag alone.
+
+It will return SUCCESS if there is no error.
+It will return INSTRUCTION_ERROR
+  if op is not an arithmetic instruction, src or dst is an undefined memory
+  space, dst is a constant value, or both src and dst are memory addresses.
+It will return MEMORY_ERROR
+  if there is a memory address from src or dst that is an invalid memory
+  address (less than 0, or greater than data_limit).
+
+If there is any error, all the system registers, memory, and system status
+remain unchanged. EIP is not changed.
+*/
+ExecResult execute_alu_op(System *sys, Opcode op, MemoryType source,
+                          MemoryType destination) {
+  int address, value;
+  int *target;
+
+  if (op < OP_ADDL || op > OP_DECL) return INSTRUCTION_ERROR;
+
+  if (destination.type == REG) {
+    target = &sys->registers[destination.reg];
+  } else if (destination.type == MEM) {
+    address = memory_address(sys, destination);
+    if (address < 0 || address > sys->memory.data_limit) return MEMORY_ERROR;
+    target = &sys->memory.data[address / 4];
+  } else {
+    return INSTRUCTION_ERROR;
+  }
+
+  if (source.type == CONST) {
+    value = source.value;
+  } else if (source.type == REG) {
+    value = sys->registers[source.reg];
+  } else if (source.type == MEM && destination.type == REG) {
+    address = memory_address(sys, source);
+    if (address < 0 || address > sys->memory.data_limit) return MEMORY_ERROR;
+    value = sys->memory.data[address / 4];
+  } else {
+    return INSTRUCTION_ERROR;
+  }
+
+  *target = apply_alu_op(op, *target, value);
+  return SUCCESS;
+}
+
+/* String form of execute_alu_op: op is the mnemonic of the instruction */
+ExecResult execute_alu(System *sys, char *op, char *src, char *dst) {
+  return execute_alu_op(sys, get_opcode_by_name(op), get_memory_type(src),
+                        get_memory_type(dst));
+}
+
 /*
 The execute_push function validates and executes a pushl instruction, ensuring source operands is of known and appropriate type, and then performs the push operation if valid.
 
@@ -361,9 +871,9 @@ It will return SUCCESS if there is no error.
 It will return INSTRUCTION_ERROR 
   if src is a undifined memory space. In this case, the type of a MemoryType data will be UNKNOWN. 
 It will return MEMORY_ERROR
-  if the address stored in src is an invalid memory address (less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+  if the address stored in src is an invalid memory address (less than 0, or greater than data_limit).
 It will return MEMORY_ERROR 
-  if esp is an invalid memory address: less than 4, greater than or equal to MEMORY_SIZE * 4).
+  if esp is an invalid memory address: less than 4, greater than or equal to data_size * 4).
 
 If there is any error, all the system registers, memory, and system 
   status should remain unchanged.
@@ -371,13 +881,11 @@ If there is any error, all the system registers, memory, and system
 Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
-ExecResult execute_push(System *sys, char *src) {
-  MemoryType source = get_memory_type(src);
-
-  int totalValSrc = sys->registers[source.reg] + source.value;
+ExecResult execute_push_op(System *sys, MemoryType source) {
+  int totalValSrc = memory_address(sys, source);
   int valToCopy;
 
-  if(sys->registers[ESP] - 4 < 0 || sys->registers[ESP] - 4 > ((MEMORY_SIZE - 1) * 4)){
+  if(sys->registers[ESP] < 4 || sys->registers[ESP] - 4 > sys->memory.data_limit){
     return MEMORY_ERROR;
   }
 
@@ -387,7 +895,7 @@ ExecResult execute_push(System *sys, char *src) {
       break;
 
     case MEM:
-      if((totalValSrc < 0 || totalValSrc > ((MEMORY_SIZE - 1) * 4))){
+      if((totalValSrc < 0 || totalValSrc > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       sys->registers[ESP] -= 4;
@@ -416,6 +924,11 @@ ExecResult execute_push(System *sys, char *src) {
   return INSTRUCTION_ERROR;
 }
 
+/* String form of execute_push_op */
+ExecResult execute_push(System *sys, char *src) {
+  return execute_push_op(sys, get_memory_type(src));
+}
+
 /*
 The execute_pop function validates and executes a popl instruction, ensuring the destination operand is of known and appropriate type, and then performs the pop
 operation if valid.
@@ -425,22 +938,20 @@ It will return SUCCESS
 It will return INSTRUCTION_ERROR 
   if dst is not a register or memory address.
 It will return MEMORY_ERROR 
-  if dst is an invalid memory address: less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+  if dst is an invalid memory address: less than 0, or greater than data_limit).
 It will return MEMORY_ERROR 
-  if the address stored in esp is an invalid memory address: less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+  if the address stored in esp is an invalid memory address: less than 0, or greater than data_limit).
 
 If there is any error, all the system registers, memory, and system status should remain unchanged.
 
 Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
-ExecResult execute_pop(System *sys, char *dst) {
-  MemoryType destination = get_memory_type(dst);
-
-  int totalValDest = sys->registers[destination.reg] + destination.value;
+ExecResult execute_pop_op(System *sys, MemoryType destination) {
+  int totalValDest = memory_address(sys, destination);
   int valToCopy;
 
-  if(sys->registers[ESP] + 4 < 0 || sys->registers[ESP] + 4 > ((MEMORY_SIZE - 1) * 4)){
+  if(sys->registers[ESP] < 0 || sys->registers[ESP] > sys->memory.data_limit - 4){
     return MEMORY_ERROR;
   }
 
@@ -450,20 +961,20 @@ ExecResult execute_pop(System *sys, char *dst) {
       break;
 
     case MEM:
-      if((totalValDest < 0 || totalValDest > ((MEMORY_SIZE - 1) * 4))){
+      if((totalValDest < 0 || totalValDest > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       valToCopy = sys->memory.data[sys->registers[ESP] / 4];
       sys->memory.data[totalValDest / 4] = valToCopy;
       //sys->memory.data[totalValDest / 4];
-      sys->registers[ESP] += 4;
+      add_wrapped(&sys->registers[ESP], 4);
       return SUCCESS;
       break;
 
     case REG:
       valToCopy = sys->memory.data[sys->registers[ESP] / 4];
       sys->registers[destination.reg] = valToCopy;
-      sys->registers[ESP] += 4;
+      add_wrapped(&sys->registers[ESP], 4);
       return SUCCESS;
       break;
 
@@ -479,6 +990,11 @@ ExecResult execute_pop(System *sys, char *dst) {
   return INSTRUCTION_ERROR;
 }
 
+/* String form of execute_pop_op */
+ExecResult execute_pop(System *sys, char *dst) {
+  return execute_pop_op(sys, get_memory_type(dst));
+}
+
 /*
 The execute_cmpl function validates and executes a cmpl instruction, ensuring
 the source and destination operands are of known and appropriate types, and then
@@ -492,7 +1008,7 @@ It will return INSTRUCTION_ERROR
 It will return INSTRUCTION_ERROR 
   if both src and dst are memory addresses.
 It will return MEMORY_ERROR 
-  if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than (MEMORY_SIZE - 1) * 4).
+  if there is a memory address from src or dst that is an invalid memory address (less than 0, or greater than data_limit).
 
 comparison
 cmpl src2, src1
@@ -502,18 +1018,19 @@ zf=1 if (src1==src2)
 sf=1 if (src1-src2 < 0)
 of=1 if two's complement
 
+The flags are evaluated lazily (interpreter.h): comparison_flag gets source2 -
+source1 wrapped to 32 bits and comparison_source gets source1, and the jumps
+work out their conditions from the two.
+
 If there is any error, all the system registers, memory, and
-system status should remain unchanged. You can decide the value of
-comparison_flag for each comparison result.
+system status should remain unchanged.
 Do not change EIP in this function.
 HINT: you may use get_memory_type in this function.
 */
-ExecResult execute_cmpl(System *sys, char *src, char *dst) {
-  MemoryType source2 = get_memory_type(dst);
-  MemoryType source1 = get_memory_type(src);
-
-  int totalValSrc2 = sys->registers[source2.reg] + source2.value;
-  int totalValSrc1 = sys->registers[source1.reg] + source1.value;
+ExecResult execute_cmpl_op(System *sys, MemoryType source1,
+                           MemoryType source2) {
+  int totalValSrc2 = memory_address(sys, source2);
+  int totalValSrc1 = memory_address(sys, source1);
 
   int val1, val2;
 
@@ -525,7 +1042,7 @@ ExecResult execute_cmpl(System *sys, char *src, char *dst) {
       if(source2.type == MEM){
         return INSTRUCTION_ERROR;
       }
-      if((totalValSrc1 < 0 || totalValSrc1 > ((MEMORY_SIZE - 1) * 4))){
+      if((totalValSrc1 < 0 || totalValSrc1 > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       val1 = sys->memory.data[totalValSrc1 / 4];
@@ -549,7 +1066,7 @@ ExecResult execute_cmpl(System *sys, char *src, char *dst) {
       if(source1.type == MEM){
         return INSTRUCTION_ERROR;
       }
-      if((totalValSrc2 < 0 || totalValSrc2 > ((MEMORY_SIZE - 1) * 4))){
+      if((totalValSrc2 < 0 || totalValSrc2 > sys->memory.data_limit)){
         return MEMORY_ERROR;
       }
       val2 = sys->memory.data[totalValSrc2 / 4];
@@ -565,16 +1082,171 @@ ExecResult execute_cmpl(System *sys, char *src, char *dst) {
       break;
   }
 
-  sys->comparison_flag = val2 - val1;
+  sys->comparison_flag = (int)((unsigned)val2 - (unsigned)val1);
+  sys->comparison_source = val1;
 
   return SUCCESS;
 }
 
+/* String form of execute_cmpl_op: src is source1 and dst is source2 */
+ExecResult execute_cmpl(System *sys, char *src, char *dst) {
+  return execute_cmpl_op(sys, get_memory_type(src), get_memory_type(dst));
+}
+
+/*
+Host kernels of the block instructions. Copies go to memmove, and fills of a
+value whose four bytes are equal, such as 0 and -1, to memset; the C library
+runs both with its widest vector instructions. Other fills store 32-byte
+vectors, built for AVX2 when the CPU supports it. Comparisons run memcmp over
+chunks of words and only look at the words of the first chunk that differs.
+*/
+typedef int WordVector __attribute__((vector_size(32)));
+
+#define WORDS_PER_VECTOR ((int)(sizeof(WordVector) / sizeof(int)))
+#define WORDS_PER_CHUNK 256
+
+static inline __attribute__((always_inline)) void
+store_words(int *words, int value, int count) {
+  WordVector fill = (WordVector){0} + value;
+  int k = 0;
+  for (; k + WORDS_PER_VECTOR <= count; k += WORDS_PER_VECTOR) {
+    memcpy(words + k, &fill, sizeof(fill));
+  }
+  for (; k < count; k++) words[k] = value;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void store_words_avx2(int *words,
+                                                             int value,
+                                                             int count) {
+  store_words(words, value, count);
+}
+#endif
+
+static void fill_words(int *words, int value, int count) {
+  unsigned byte = (unsigned)value & 0xff;
+  if ((unsigned)value == byte * 0x01010101u) {
+    memset(words, (int)byte, (size_t)count * sizeof(int));
+    return;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    store_words_avx2(words, value, count);
+    return;
+  }
+#endif
+  store_words(words, value, count);
+}
+
+/* Index of the first of count words where a and b differ, or count */
+static int find_mismatch(const int *a, const int *b, int count) {
+  int k = 0;
+  for (; k + WORDS_PER_CHUNK <= count; k += WORDS_PER_CHUNK) {
+    if (memcmp(a + k, b + k, WORDS_PER_CHUNK * sizeof(int)) != 0) break;
+  }
+  for (; k < count; k++) {
+    if (a[k] != b[k]) break;
+  }
+  return k;
+}
+
+/* Index of the first of count words at a memory operand, or -1 if any of them
+ * is outside the data segment */
+static int block_start(const System *sys, MemoryType operand, unsigned count) {
+  int address = memory_address(sys, operand);
+  if (address < 0 ||
+      address + 4 * ((long long)count - 1) > sys->memory.data_limit) {
+    return -1;
+  }
+  return address / 4;
+}
+
+/*
+Execute the block instruction op, MOVSL, STOSL or CMPSL, on ECX words. As
+with the REP forms of the x86 string instructions, ECX is an unsigned count
+and is counted down as the words are done, but both addresses are ordinary
+memory operands and their registers are left alone:
+
+  MOVSL src dst  copy the ECX words at src to dst, as if through a temporary
+                 buffer, so the two ranges may overlap
+  STOSL src dst  store src, a register or constant, in the ECX words at dst
+  CMPSL src dst  compare the words at src and dst pair by pair up to the
+                 first pair that differs and set the flags as CMPL of the
+                 last pair compared does. ECX is left at the number of pairs
+                 after it, so 0 if the ECX pairs were all equal.
+
+Each range is checked against the data segment once, before any word is read
+or written. With ECX at 0 nothing is accessed and the flags are unchanged.
+
+It will return SUCCESS if there is no error.
+It will return INSTRUCTION_ERROR
+  if op is not a block instruction, dst is not a memory address, or src is not
+  a memory address for MOVSL and CMPSL or a register or constant for STOSL.
+It will return MEMORY_ERROR
+  if a range starts below 0 or ends above data_limit.
+
+If there is any error, all the system registers, memory, and system status
+remain unchanged. EIP is not changed.
+*/
+ExecResult execute_rep_op(System *sys, Opcode op, MemoryType source,
+                          MemoryType destination) {
+  unsigned count = (unsigned)sys->registers[ECX];
+  int *data = sys->memory.data;
+  int from = 0, to, k;
+
+  if (destination.type != MEM) return INSTRUCTION_ERROR;
+  if (op == OP_STOSL) {
+    if (source.type != REG && source.type != CONST) return INSTRUCTION_ERROR;
+  } else if (op == OP_MOVSL || op == OP_CMPSL) {
+    if (source.type != MEM) return INSTRUCTION_ERROR;
+  } else {
+    return INSTRUCTION_ERROR;
+  }
+  if (count == 0) return SUCCESS;
+
+  if ((to = block_start(sys, destination, count)) < 0) return MEMORY_ERROR;
+  if (op != OP_STOSL && (from = block_start(sys, source, count)) < 0) {
+    return MEMORY_ERROR;
+  }
+
+  switch (op) {
+    case OP_MOVSL:
+      memmove(data + to, data + from, (size_t)count * sizeof(int));
+      sys->registers[ECX] = 0;
+      break;
+    case OP_STOSL:
+      fill_words(data + to, source.type == CONST ? source.value
+                                                 : sys->registers[source.reg],
+                 (int)count);
+      sys->registers[ECX] = 0;
+      break;
+    default:
+      k = find_mismatch(data + from, data + to, (int)count);
+      if (k == (int)count) k--;
+      sys->comparison_flag =
+          (int)((unsigned)data[to + k] - (unsigned)data[from + k]);
+      sys->comparison_source = data[from + k];
+      sys->registers[ECX] = (int)count - k - 1;
+      break;
+  }
+  return SUCCESS;
+}
+
+/* String form of execute_rep_op: op is the mnemonic of the instruction */
+ExecResult execute_rep(System *sys, char *op, char *src, char *dst) {
+  return execute_rep_op(sys, get_opcode_by_name(op), get_memory_type(src),
+                        get_memory_type(dst));
+}
+
 /*
 The execute_jmp function validates and executes a condition or direct jump instruction, ensuring the destination operands is of known label,
 and then performs the direct jump operation, or condition jump if condition is met.
 
-A valid condition argument should be one of the following strings: "JE", "JNE", "JL", "JG", or "JMP"
+A valid condition argument should be one of the following opcodes: OP_JE, OP_JNE, OP_JL, OP_JG, OP_JLE, OP_JGE, OP_JA, OP_JB, or OP_JMP.
+The conditions compare the operands of the last CMPL or CMPSL, signed for JL,
+JG, JLE and JGE and unsigned for JA and JB, as the matching x86 jumps do after
+CMP.
+memAdd is the address of the destination label as returned by get_addr_from_label.
 
 It will return SUCCESS 
   if the jump is executed successfully no matter whether condition is met. 
@@ -585,66 +1257,60 @@ If there is any error, all the system registers (except for EIP), memory, and sy
 
 Please update program counter (EIP) in this function.
 
-HINT: you may use get_addr_from_label in this function.
 */
-ExecResult execute_jmp(System *sys, char *condition, char *dst) {
-
-  int memAdd = get_addr_from_label(sys, dst);
+ExecResult execute_jmp_op(System *sys, Opcode condition, int memAdd) {
 
-  if((memAdd < 0 || memAdd > ((MEMORY_SIZE - 1) * 4))){
+  if((memAdd < 0 || memAdd > ((sys->memory.instruction_size - 1) * 4))){
     return PC_ERROR;
   }
 
-  if(strcmp(condition, "JE") == 0){
-    if(sys->comparison_flag == 0){
-      sys->registers[EIP] += 4;
-      sys->registers[EIP] = memAdd;
-    }
-    else{
-      sys->registers[EIP] += 4;
-    }
-    return SUCCESS;
-  }
-  else if(strcmp(condition, "JNE") == 0){
-    if(sys->comparison_flag > 0 || sys->comparison_flag < 0){
-      sys->registers[EIP] += 4;
-      sys->registers[EIP] = memAdd;
-    }
-    else{
-      sys->registers[EIP] += 4;
-    }
-    return SUCCESS;
-  }
-  else if(strcmp(condition, "JL") == 0){
-    if(sys->comparison_flag < 0){
-      sys->registers[EIP] += 4;
-      sys->registers[EIP] = memAdd;
-    }
-    else{
-      sys->registers[EIP] += 4;
-    }
-    return SUCCESS;
-  }
-  else if(strcmp(condition, "JG") == 0){
-    if(sys->comparison_flag > 0){
-      sys->registers[EIP] += 4;
-      sys->registers[EIP] = memAdd;
-    }
-    else{
-      sys->registers[EIP] += 4;
-    }
-    return SUCCESS;
-  }
-  else if(strcmp(condition, "JMP") == 0){
-    sys->registers[EIP] += 4;
-    sys->registers[EIP] = memAdd;
-    return SUCCESS;
-  }
-  else{
-    sys->registers[EIP] += 4;
-    return PC_ERROR;
+  // Operands of the last CMPL, the destination compared with the source
+  int source = sys->comparison_source;
+  int destination = (int)((unsigned)sys->comparison_flag + (unsigned)source);
+  int taken;
+
+  switch (condition) {
+    case OP_JMP:
+      taken = 1;
+      break;
+    case OP_JE:
+      taken = destination == source;
+      break;
+    case OP_JNE:
+      taken = destination != source;
+      break;
+    case OP_JL:
+      taken = destination < source;
+      break;
+    case OP_JG:
+      taken = destination > source;
+      break;
+    case OP_JLE:
+      taken = destination <= source;
+      break;
+    case OP_JGE:
+      taken = destination >= source;
+      break;
+    case OP_JA:
+      taken = (unsigned)destination > (unsigned)source;
+      break;
+    case OP_JB:
+      taken = (unsigned)destination < (unsigned)source;
+      break;
+    default:
+      add_wrapped(&sys->registers[EIP], 4);
+      return PC_ERROR;
   }
-  return PC_ERROR;
+
+  sys->registers[EIP] = taken ? memAdd : sys->registers[EIP] + 4;
+  return SUCCESS;
+}
+
+/* String form of execute_jmp_op: the condition is the jump mnemonic and dst is
+ * the destination label */
+ExecResult execute_jmp(System *sys, char *condition, char *dst) {
+  return execute_jmp_op(sys, get_opcode_by_name(condition),
+                        get_addr_from_label(sys, dst));
 }
 
 /*
@@ -661,25 +1327,27 @@ system status should remain unchanged.
 
 Please update program counter (EIP) in this function.
 
-HINT: you may use get_addr_from_label in this function.
 */
-ExecResult execute_call(System *sys, char *dst) {
+ExecResult execute_call_op(System *sys, int memAdd) {
 
-  int memAdd = get_addr_from_label(sys, dst);
-
-  if((memAdd < 0 || memAdd > ((MEMORY_SIZE - 1) * 4))){
+  if((memAdd < 0 || memAdd > ((sys->memory.instruction_size - 1) * 4))){
     return PC_ERROR;
   }
 
-  sys->registers[EIP] += 4;
+  add_wrapped(&sys->registers[EIP], 4);
 
-  execute_push(sys, "%EIP");
+  execute_push_op(sys, (MemoryType){REG, EIP, -1});
 
   sys->registers[EIP] = memAdd;
   
   return SUCCESS;
 }
 
+/* String form of execute_call_op: dst is the destination label */
+ExecResult execute_call(System *sys, char *dst) {
+  return execute_call_op(sys, get_addr_from_label(sys, dst));
+}
+
 /*
 The execute_ret function validates and executes a return instruction, which pops
 the return address from the stack and update EIP (program counter).
@@ -694,9 +1362,9 @@ memory, and system status should remain unchanged.
 Please update program counter (EIP) in this function.
 */
 ExecResult execute_ret(System *sys) {
-  execute_pop(sys, "%EIP");
+  execute_pop_op(sys, (MemoryType){REG, EIP, -1});
 
-  if(sys->registers[EIP] < 0 || sys->registers[EIP] > (MEMORY_SIZE - 1) || sys->registers[EIP] > sys->memory.num_instructions){
+  if(sys->registers[EIP] < 0 || sys->registers[EIP] / 4 >= sys->memory.num_instructions){
     return PC_ERROR;
   }
 
@@ -706,21 +1374,20 @@ ExecResult execute_ret(System *sys) {
 /*
 Utilizing the EIP register's value (also known as the program counter), the
 function fetches instructions from the instruction segment in system memory. It
-then executes each instruction, which can be one of MOVL, ADDL PUSHL, POPL,
-CMPL, CALL, RET, JMP, JNE, JE, JL, or JG, by employing the corresponding execute
+then executes each instruction, which can be one of MOVL, ADDL, SUBL, IMULL,
+ANDL, ORL, XORL, SHLL, SARL, INCL, DECL, PUSHL, POPL, CMPL, CALL, RET, JMP,
+JNE, JE, JL, JG, JLE, JGE, JA, or JB, by employing the corresponding execute
 functions. This process continues until the program encounters any Error status
 or the END instruction. 
 
 During the execution, it will ignore all the
 instructions that are not listed above and continue to the next one.
-Please update program counter (EIP) for MOVL, ADDL, PUSHL, POPL, and CMPL in
-this function.
+Please update program counter (EIP) for MOVL, the arithmetic instructions,
+PUSHL, POPL, and CMPL in this function.
 */
-void execute_instructions(System *sys) {
-  char inst[256];  // you can use strcpy to copy instruction from memory to this
-                   // variable
+ExecResult execute_string_instructions(System *sys) {
   // TODO
-  // for(int i = 0; i < MEMORY_SIZE - 1; ++i){
+  // for(int i = 0; i < sys->memory.num_instructions; ++i){
   //   printf("this is an instruction: %s\n", sys->memory.instruction[i]);
   // }
 
@@ -751,50 +1418,760 @@ void execute_instructions(System *sys) {
 
   //load instruction from
 
-  int num_instructions = sizeof(sys->memory.instruction) / sizeof(sys->memory.instruction[0]);
+  ExecResult status = SUCCESS;
 
   for(;;){
+    ExecResult result = SUCCESS;
+
+    if(sys->registers[EIP] < 0 || sys->registers[EIP] / 4 >= sys->memory.num_instructions){
+      break;
+    }
 
     //printf("this is an instruction: %s\n", sys->memory.instruction[sys->registers[EIP] / 4]);
 
-    char part1[20], part2[20], part3[20];
+    char part1[TOKEN_SIZE], part2[TOKEN_SIZE], part3[TOKEN_SIZE];
 
     splitString(sys->memory.instruction[sys->registers[EIP] / 4], part1, part2, part3);
 
     if(strcmp(part1, "MOVL") == 0){
-      execute_movl(sys, part2, part3);
-      sys->registers[EIP] += 4;
+      result = execute_movl(sys, part2, part3);
+      add_wrapped(&sys->registers[EIP], 4);
     }
     else if(strcmp(part1, "ADDL") == 0){
-      execute_addl(sys, part2, part3);
-      sys->registers[EIP] += 4;
+      result = execute_addl(sys, part2, part3);
+      add_wrapped(&sys->registers[EIP], 4);
+    }
+    else if(strcmp(part1, "SUBL") == 0 || strcmp(part1, "IMULL") == 0 || strcmp(part1, "ANDL") == 0 || strcmp(part1, "ORL") == 0 || strcmp(part1, "XORL") == 0 || strcmp(part1, "SHLL") == 0 || strcmp(part1, "SARL") == 0){
+      result = execute_alu(sys, part1, part2, part3);
+      add_wrapped(&sys->registers[EIP], 4);
+    }
+    else if(strcmp(part1, "INCL") == 0 || strcmp(part1, "DECL") == 0){
+      result = execute_alu(sys, part1, "$1", part2);
+      add_wrapped(&sys->registers[EIP], 4);
     }
     else if(strcmp(part1, "PUSHL") == 0){
-      execute_push(sys, part2);
-      sys->registers[EIP] += 4;
+      result = execute_push(sys, part2);
+      add_wrapped(&sys->registers[EIP], 4);
     }
     else if(strcmp(part1, "POPL") == 0){
-      execute_pop(sys, part2);
-      sys->registers[EIP] += 4;
+      result = execute_pop(sys, part2);
+      add_wrapped(&sys->registers[EIP], 4);
     }
     else if(strcmp(part1, "CMPL") == 0){
-      execute_cmpl(sys, part2, part3);
-      sys->registers[EIP] += 4;
+      result = execute_cmpl(sys, part2, part3);
+      add_wrapped(&sys->registers[EIP], 4);
+    }
+    else if(strcmp(part1, "MOVSL") == 0 || strcmp(part1, "STOSL") == 0 || strcmp(part1, "CMPSL") == 0){
+      result = execute_rep(sys, part1, part2, part3);
+      add_wrapped(&sys->registers[EIP], 4);
     }
     else if(strcmp(part1, "CALL") == 0){
-      execute_call(sys, part2);
+      result = execute_call(sys, part2);
     }
     else if(strcmp(part1, "RET") == 0){
-      execute_ret(sys);
+      result = execute_ret(sys);
     }
-    else if(strcmp(part1, "JMP") == 0 || strcmp(part1, "JNE") == 0 || strcmp(part1, "JE") == 0 || strcmp(part1, "JL") == 0 || strcmp(part1, "JG") == 0){
-      execute_jmp(sys, part1, part2);
+    else if(strcmp(part1, "JMP") == 0 || strcmp(part1, "JNE") == 0 || strcmp(part1, "JE") == 0 || strcmp(part1, "JL") == 0 || strcmp(part1, "JG") == 0 || strcmp(part1, "JLE") == 0 || strcmp(part1, "JGE") == 0 || strcmp(part1, "JA") == 0 || strcmp(part1, "JB") == 0){
+      result = execute_jmp(sys, part1, part2);
     }
     else if(strcmp(part1, "END") == 0){
       break;
     }
     else{
-      sys->registers[EIP] += 4;
+      add_wrapped(&sys->registers[EIP], 4);
+    }
+
+    if(status == SUCCESS){
+      status = result;
     }
   }
-}
\ No newline at end of file
+  return status;
+}
+
+/* Conditions of the jumps as a mask of comparison outcomes
+ * (ComparisonOutcome); JMP is taken on every outcome */
+static const unsigned char jump_conditions[OP_COUNT] = {
+    [OP_JMP] = COMPARE_LESS | COMPARE_EQUAL | COMPARE_GREATER,
+    [OP_JE] = COMPARE_EQUAL,
+    [OP_JNE] = COMPARE_LESS | COMPARE_GREATER,
+    [OP_JL] = COMPARE_LESS,
+    [OP_JG] = COMPARE_GREATER,
+    [OP_JLE] = COMPARE_LESS | COMPARE_EQUAL,
+    [OP_JGE] = COMPARE_GREATER | COMPARE_EQUAL,
+    [OP_JA] = COMPARE_ABOVE,
+    [OP_JB] = COMPARE_BELOW};
+
+/* Whether the jump condition, OP_JMP to OP_JB, holds after the last CMPL; it
+ * is the decision execute_jmp_op makes */
+int is_jump_taken(const System *sys, Opcode condition) {
+  int source = sys->comparison_source;
+  int destination = (int)((unsigned)sys->comparison_flag + (unsigned)source);
+  if (condition < OP_JMP || condition > OP_JB) return 0;
+  return (jump_conditions[condition] &
+          get_comparison_outcome(destination, source)) != 0;
+}
+
+/* Value of a register or constant operand of a superinstruction */
+static inline int operand_value(const System *sys, MemoryType operand) {
+  return operand.type == CONST ? operand.value : sys->registers[operand.reg];
+}
+
+/* Address of a memory operand, or -1 if it is outside the data segment */
+static inline int operand_address(const System *sys, MemoryType operand) {
+  int address = memory_address(sys, operand);
+  return address < 0 || address > sys->memory.data_limit ? -1 : address;
+}
+
+/*
+Template of the specialized handlers: execute a MOVL, CMPL or arithmetic
+instruction whose operand types are known. Every caller passes constants for
+op, src_type and dst_type, so after inlining only the code for that one
+combination is left. The results match execute_movl_op, execute_cmpl_op and
+execute_alu_op.
+*/
+static inline __attribute__((always_inline)) ExecResult
+execute_specialized_op(System *sys, const Instruction *inst, Opcode op,
+                       DataType src_type, DataType dst_type) {
+  int value, address;
+  int *destination;
+
+  if (src_type == MEM) {
+    if ((address = operand_address(sys, inst->src)) < 0) return MEMORY_ERROR;
+    value = sys->memory.data[address / 4];
+  } else if (src_type == REG) {
+    value = sys->registers[inst->src.reg];
+  } else {
+    value = inst->src.value;
+  }
+
+  if (dst_type == MEM) {
+    if ((address = operand_address(sys, inst->dst)) < 0) return MEMORY_ERROR;
+    destination = &sys->memory.data[address / 4];
+  } else if (dst_type == REG) {
+    destination = &sys->registers[inst->dst.reg];
+  } else {
+    destination = (int *)&inst->dst.value;
+  }
+
+  if (op == OP_CMPL) {
+    sys->comparison_flag = (int)((unsigned)*destination - (unsigned)value);
+    sys->comparison_source = value;
+  } else if (op == OP_MOVL) {
+    *destination = value;
+  } else {
+    *destination = apply_alu_op(op, *destination, value);
+  }
+  return SUCCESS;
+}
+
+/*
+Run the CMPL at inst and the jump that follows it, as OP_CMPL_JCC. The operands
+and target were checked by fuse_instructions, so neither can fail, and the
+branch is chosen without a conditional jump on the host.
+*/
+static inline void execute_cmpl_jcc(System *sys, const Instruction *inst) {
+  int destination = sys->registers[inst->dst.reg];
+  int source = operand_value(sys, inst->src);
+  int outcome = get_comparison_outcome(destination, source);
+  int next = sys->registers[EIP] + 8;
+  sys->comparison_flag = (int)((unsigned)destination - (unsigned)source);
+  sys->comparison_source = source;
+  sys->registers[EIP] =
+      jump_conditions[inst[1].op] & outcome ? inst[1].target : next;
+}
+
+/* Whether a generic MOVL, arithmetic instruction or POPL writes EIP */
+#define WRITES_EIP(inst) ((inst)->dst.type == REG && (inst)->dst.reg == EIP)
+
+/*
+Execute one decoded instruction, which must be the instruction at EIP, and
+return its result. op is the opcode to dispatch on: inst->op to run exactly one
+instruction, or inst->fused to let a superinstruction run the whole sequence.
+*halted is set to 1 if the instruction is END.
+
+With budgeted set, *halted is also set to 2 after every instruction that
+ends a straight-line stretch: jumps, CALL, RET and writes to EIP. Every caller
+passes a constant, so the other loops carry no trace of it.
+*/
+static inline __attribute__((always_inline)) ExecResult
+execute_decoded_op(System *sys, const Instruction *inst, Opcode op,
+                   int *halted, int budgeted) {
+  ExecResult result = SUCCESS;
+
+  switch (op) {
+    case OP_MOVL:
+      result = execute_movl_op(sys, inst->src, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      if (budgeted && WRITES_EIP(inst)) *halted = 2;
+      break;
+    case OP_ADDL:
+      result = execute_addl_op(sys, inst->src, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      if (budgeted && WRITES_EIP(inst)) *halted = 2;
+      break;
+    case OP_SUBL:
+    case OP_IMULL:
+    case OP_ANDL:
+    case OP_ORL:
+    case OP_XORL:
+    case OP_SHLL:
+    case OP_SARL:
+    case OP_INCL:
+    case OP_DECL:
+      result = execute_alu_op(sys, op, inst->src, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      if (budgeted && WRITES_EIP(inst)) *halted = 2;
+      break;
+    case OP_PUSHL:
+      result = execute_push_op(sys, inst->src);
+      add_wrapped(&sys->registers[EIP], 4);
+      break;
+    case OP_POPL:
+      result = execute_pop_op(sys, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      if (budgeted && WRITES_EIP(inst)) *halted = 2;
+      break;
+    case OP_CMPL:
+      result = execute_cmpl_op(sys, inst->src, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      break;
+    case OP_MOVSL:
+    case OP_STOSL:
+    case OP_CMPSL:
+      result = execute_rep_op(sys, op, inst->src, inst->dst);
+      add_wrapped(&sys->registers[EIP], 4);
+      break;
+    case OP_CALL:
+      result = execute_call_op(sys, inst->target);
+      if (budgeted) *halted = 2;
+      break;
+    case OP_RET:
+      result = execute_ret(sys);
+      if (budgeted) *halted = 2;
+      break;
+    case OP_JMP:
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JLE:
+    case OP_JGE:
+    case OP_JA:
+    case OP_JB:
+      result = execute_jmp_op(sys, inst->op, inst->target);
+      if (budgeted) *halted = 2;
+      break;
+    case OP_END:
+    case OP_TRAP:
+      // A trap stops the run like END, at the instruction it replaces
+      *halted = 1;
+      break;
+#define SPECIALIZED_CASE(name, op_, src_, dst_)                 \
+    case name:                                                  \
+      result = execute_specialized_op(sys, inst, op_, src_, dst_); \
+      sys->registers[EIP] += 4;                                 \
+      break;
+    SPECIALIZED_OPCODES(SPECIALIZED_CASE)
+#undef SPECIALIZED_CASE
+    case OP_ADDL_ADDL:
+      add_wrapped(&sys->registers[inst[0].dst.reg],
+                  operand_value(sys, inst[0].src));
+      add_wrapped(&sys->registers[inst[1].dst.reg],
+                  operand_value(sys, inst[1].src));
+      add_wrapped(&sys->registers[EIP], 8);
+      break;
+    case OP_ADDL_CMPL_JCC:
+      add_wrapped(&sys->registers[inst->dst.reg],
+                  operand_value(sys, inst->src));
+      add_wrapped(&sys->registers[EIP], 4);
+      execute_cmpl_jcc(sys, inst + 1);
+      if (budgeted) *halted = 2;
+      break;
+    case OP_CMPL_JCC:
+      execute_cmpl_jcc(sys, inst);
+      if (budgeted) *halted = 2;
+      break;
+    default:
+      add_wrapped(&sys->registers[EIP], 4);
+      break;
+  }
+  return result;
+}
+
+/*
+Execute the single instruction at EIP with the decoded engine and return its
+result. *halted is set to 1 if the program has stopped, because EIP is outside
+the program or the instruction is END.
+*/
+ExecResult step_instruction(System *sys, int *halted) {
+  int pc = sys->registers[EIP] / 4;
+  *halted = 0;
+  if(sys->registers[EIP] < 0 || pc >= sys->memory.num_instructions){
+    *halted = 1;
+    return SUCCESS;
+  }
+  const Instruction *inst = &sys->memory.code[pc];
+  return execute_decoded_op(sys, inst, inst->op, halted, 0);
+}
+
+/*
+Same as execute_string_instructions, but dispatches on the records built by
+decode_instructions instead of splitting and comparing the instruction text on
+every step, including the superinstructions chosen by fuse_instructions.
+Execution also stops if EIP leaves the loaded program.
+*/
+ExecResult execute_decoded_instructions(System *sys) {
+  const Instruction *code = sys->memory.code;
+  ExecResult status = SUCCESS;
+  int halted = 0;
+
+  for(;;){
+    int pc = sys->registers[EIP] / 4;
+    if(sys->registers[EIP] < 0 || pc >= sys->memory.num_instructions){
+      break;
+    }
+
+    ExecResult result = execute_decoded_op(sys, &code[pc], code[pc].fused,
+                                           &halted, 0);
+    if(halted){
+      break;
+    }
+
+    if(status == SUCCESS){
+      status = result;
+    }
+  }
+  return status;
+}
+
+// Instructions between two looks at the clock and the preempt flag
+#define RUN_CHECK_INTERVAL 65536
+
+/* Accounting of a run of execute_with_limits */
+typedef struct RunBudget {
+  const RunLimits *limits;
+  long long executed;  // instructions charged so far
+  long long next;      // executed count at which check_limits runs
+  int start;           // first instruction of the current straight-line run
+} RunBudget;
+
+/* Return the status the run has to stop with, or RUN_FINISHED to go on and
+ * set when to check again */
+static RunStatus check_limits(RunBudget *budget) {
+  const RunLimits *limits = budget->limits;
+
+  if (limits->budget > 0 && budget->executed >= limits->budget) {
+    return RUN_BUDGET_EXHAUSTED;
+  }
+  if (limits->preempt != NULL &&
+      atomic_load_explicit(limits->preempt, memory_order_relaxed)) {
+    return RUN_PREEMPTED;
+  }
+  if (limits->deadline > 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec * 1000000000ll + now.tv_nsec >= limits->deadline) {
+      return RUN_DEADLINE;
+    }
+  }
+
+  budget->next = LLONG_MAX;
+  if (limits->preempt != NULL || limits->deadline > 0) {
+    budget->next = budget->executed + RUN_CHECK_INTERVAL;
+  }
+  if (limits->budget > 0 && limits->budget < budget->next) {
+    budget->next = limits->budget;
+  }
+  return RUN_FINISHED;
+}
+
+/*
+Run the program from EIP like execute_decoded_instructions until it ends or a
+limit in limits is reached, and return why it stopped and where. The limits
+are only checked when a straight-line run of instructions ends, at jumps,
+CALL, RET and writes to EIP, so the instructions in between run exactly as
+fast as without limits and a budget can be overshot by up to one straight-line
+run. The deadline and the preempt flag are looked at every
+RUN_CHECK_INTERVAL instructions or so.
+
+When the run is stopped by a limit, EIP is left at the next instruction to
+run, so calling execute_with_limits again resumes it; this is how a scheduler
+time-slices guest programs. Profiling, tracing and the engine selected in
+sys->engine do not apply to these runs; with sys->sampler set, CALL and RET
+update its shadow call stack.
+*/
+RunResult execute_with_limits(System *sys, const RunLimits *limits) {
+  const Instruction *code = sys->memory.code;
+  RunResult run = {RUN_FINISHED, SUCCESS, 0, 0};
+  RunBudget budget = {limits, 0, 0, sys->registers[EIP] / 4};
+  int halted = 0;
+
+  run.status = check_limits(&budget);
+  while (run.status == RUN_FINISHED) {
+    int pc = sys->registers[EIP] / 4;
+    if (sys->registers[EIP] < 0 || pc >= sys->memory.num_instructions) {
+      budget.executed += pc - budget.start;
+      break;
+    }
+
+    Opcode op = code[pc].fused;
+    ExecResult result = execute_decoded_op(sys, &code[pc], op, &halted, 1);
+    if (result != SUCCESS) {
+      if (run.result == SUCCESS) run.result = result;
+      if (limits->stop_on_error) {
+        // A failing instruction never ends a fused sequence early
+        budget.executed += pc + 1 - budget.start;
+        run.status = RUN_ERROR;
+        run.eip = pc * 4;
+        run.executed = budget.executed;
+        return run;
+      }
+    }
+    if (halted) {
+      int last = pc + (op == OP_CMPL_JCC) + 2 * (op == OP_ADDL_CMPL_JCC);
+      budget.executed += last + 1 - budget.start;
+      if (halted == 1) break;
+      halted = 0;
+#ifndef NO_PROFILER
+      if (sys->sampler != NULL && result == SUCCESS &&
+          (op == OP_CALL || op == OP_RET)) {
+        track_call(sys->sampler, sys, op == OP_CALL ? code[pc].target : -1);
+      }
+#endif
+      budget.start = sys->registers[EIP] / 4;
+      if (budget.executed >= budget.next) {
+        run.status = check_limits(&budget);
+      }
+    }
+  }
+  run.eip = sys->registers[EIP];
+  run.executed = budget.executed;
+  return run;
+}
+
+/*
+Same as execute_decoded_instructions, but with direct-threaded dispatch: the
+address of the handler of every instruction is stored in
+sys->memory.threaded, and each handler jumps straight to the handler of the
+next instruction instead of going back to a central switch. Without computed
+goto support this falls back to a switch over the opcode.
+*/
+ExecResult execute_threaded_instructions(System *sys) {
+  const Instruction *code = sys->memory.code;
+  const Instruction *inst;
+  ExecResult status = SUCCESS, result;
+  int pc;
+
+#define FETCH()                                              \
+  do {                                                       \
+    pc = sys->registers[EIP] / 4;                            \
+    if (sys->registers[EIP] < 0 || pc >= sys->memory.num_instructions) \
+      return status;                                         \
+    inst = &code[pc];                                        \
+  } while (0)
+
+// Keep the first error reported by an instruction
+#define RECORD(result)                          \
+  do {                                          \
+    if (status == SUCCESS) status = (result);   \
+  } while (0)
+
+#if USE_COMPUTED_GOTO
+  static const void *const handlers[] = {
+      [OP_NOP] = &&do_OP_NOP,   [OP_MOVL] = &&do_OP_MOVL,
+      [OP_ADDL] = &&do_OP_ADDL, [OP_SUBL] = &&do_OP_SUBL,
+      [OP_IMULL] = &&do_OP_SUBL, [OP_ANDL] = &&do_OP_SUBL,
+      [OP_ORL] = &&do_OP_SUBL,  [OP_XORL] = &&do_OP_SUBL,
+      [OP_SHLL] = &&do_OP_SUBL, [OP_SARL] = &&do_OP_SUBL,
+      [OP_INCL] = &&do_OP_SUBL, [OP_DECL] = &&do_OP_SUBL,
+      [OP_PUSHL] = &&do_OP_PUSHL, [OP_POPL] = &&do_OP_POPL,
+      [OP_CMPL] = &&do_OP_CMPL, [OP_MOVSL] = &&do_OP_MOVSL,
+      [OP_STOSL] = &&do_OP_MOVSL, [OP_CMPSL] = &&do_OP_MOVSL,
+      [OP_CALL] = &&do_OP_CALL,
+      [OP_RET] = &&do_OP_RET,   [OP_JMP] = &&do_OP_JMP,
+      [OP_JE] = &&do_OP_JMP,    [OP_JNE] = &&do_OP_JMP,
+      [OP_JL] = &&do_OP_JMP,    [OP_JG] = &&do_OP_JMP,
+      [OP_JLE] = &&do_OP_JMP,   [OP_JGE] = &&do_OP_JMP,
+      [OP_JA] = &&do_OP_JMP,    [OP_JB] = &&do_OP_JMP,
+      [OP_END] = &&do_OP_END,
+#define SPECIALIZED_LABEL(name, op, src, dst) [name] = &&do_##name,
+      SPECIALIZED_OPCODES(SPECIALIZED_LABEL)
+#undef SPECIALIZED_LABEL
+      [OP_ADDL_ADDL] = &&do_OP_ADDL_ADDL,
+      [OP_CMPL_JCC] = &&do_OP_CMPL_JCC,
+      [OP_ADDL_CMPL_JCC] = &&do_OP_ADDL_CMPL_JCC,
+      [OP_TRAP] = &&do_OP_END};
+  const void **threaded = sys->memory.threaded;
+
+  for (int i = 0; i < sys->memory.num_instructions; i++) {
+    threaded[i] = handlers[code[i].fused];
+  }
+
+#define HANDLER(op) do_##op:
+#define NEXT()              \
+  do {                      \
+    FETCH();                \
+    goto *threaded[pc];     \
+  } while (0)
+
+  NEXT();
+#else
+#define HANDLER(op) case op:
+#define NEXT() goto dispatch
+
+dispatch:
+  FETCH();
+  switch (inst->fused) {
+    case OP_JE:
+    case OP_JNE:
+    case OP_JL:
+    case OP_JG:
+    case OP_JLE:
+    case OP_JGE:
+    case OP_JA:
+    case OP_JB:
+#endif
+
+  HANDLER(OP_JMP)
+    result = execute_jmp_op(sys, inst->op, inst->target);
+    RECORD(result);
+    NEXT();
+  HANDLER(OP_MOVL)
+    result = execute_movl_op(sys, inst->src, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+  HANDLER(OP_ADDL)
+    result = execute_addl_op(sys, inst->src, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+#if !USE_COMPUTED_GOTO
+    case OP_IMULL:
+    case OP_ANDL:
+    case OP_ORL:
+    case OP_XORL:
+    case OP_SHLL:
+    case OP_SARL:
+    case OP_INCL:
+    case OP_DECL:
+#endif
+  HANDLER(OP_SUBL)
+    result = execute_alu_op(sys, inst->op, inst->src, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+  HANDLER(OP_PUSHL)
+    result = execute_push_op(sys, inst->src);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+  HANDLER(OP_POPL)
+    result = execute_pop_op(sys, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+  HANDLER(OP_CMPL)
+    result = execute_cmpl_op(sys, inst->src, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+#if !USE_COMPUTED_GOTO
+    case OP_STOSL:
+    case OP_CMPSL:
+#endif
+  HANDLER(OP_MOVSL)
+    result = execute_rep_op(sys, inst->op, inst->src, inst->dst);
+    RECORD(result);
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+  HANDLER(OP_CALL)
+    result = execute_call_op(sys, inst->target);
+    RECORD(result);
+    NEXT();
+  HANDLER(OP_RET)
+    result = execute_ret(sys);
+    RECORD(result);
+    NEXT();
+  HANDLER(OP_NOP)
+    add_wrapped(&sys->registers[EIP], 4);
+    NEXT();
+#define SPECIALIZED_HANDLER(name, op_, src_, dst_)             \
+  HANDLER(name)                                                \
+    result = execute_specialized_op(sys, inst, op_, src_, dst_); \
+    RECORD(result);                                            \
+    sys->registers[EIP] += 4;                                  \
+    NEXT();
+  SPECIALIZED_OPCODES(SPECIALIZED_HANDLER)
+#undef SPECIALIZED_HANDLER
+  HANDLER(OP_ADDL_ADDL)
+    add_wrapped(&sys->registers[inst[0].dst.reg],
+                operand_value(sys, inst[0].src));
+    add_wrapped(&sys->registers[inst[1].dst.reg],
+                operand_value(sys, inst[1].src));
+    add_wrapped(&sys->registers[EIP], 8);
+    NEXT();
+  HANDLER(OP_ADDL_CMPL_JCC)
+    add_wrapped(&sys->registers[inst->dst.reg], operand_value(sys, inst->src));
+    add_wrapped(&sys->registers[EIP], 4);
+    execute_cmpl_jcc(sys, inst + 1);
+    NEXT();
+  HANDLER(OP_CMPL_JCC)
+    execute_cmpl_jcc(sys, inst);
+    NEXT();
+  HANDLER(OP_END)
+    return status;
+
+#if !USE_COMPUTED_GOTO
+    default:
+      return status;
+  }
+#endif
+#undef FETCH
+#undef RECORD
+#undef HANDLER
+#undef NEXT
+}
+
+/* Return the engine with the given name, or ENGINE_UNKNOWN */
+Engine get_engine_by_name(const char *name) {
+  if (strcmp(name, "decoded") == 0) return ENGINE_DECODED;
+  if (strcmp(name, "string") == 0) return ENGINE_STRING;
+  if (strcmp(name, "threaded") == 0) return ENGINE_THREADED;
+  if (strcmp(name, "lanes") == 0) return ENGINE_LANES;
+  if (strcmp(name, "jit") == 0) return ENGINE_JIT;
+  if (strcmp(name, "blocks") == 0) return ENGINE_BLOCKS;
+  return ENGINE_UNKNOWN;
+}
+
+/* Return the name of an engine, as accepted by get_engine_by_name */
+const char *get_engine_name(Engine engine) {
+  switch (engine) {
+    case ENGINE_DECODED:
+      return "decoded";
+    case ENGINE_STRING:
+      return "string";
+    case ENGINE_THREADED:
+      return "threaded";
+    case ENGINE_LANES:
+      return "lanes";
+    case ENGINE_JIT:
+      return "jit";
+    case ENGINE_BLOCKS:
+      return "blocks";
+    default:
+      return "unknown";
+  }
+}
+
+/* Return the name of an ExecResult, as spelled in the enum */
+const char *get_run_status_name(RunStatus status) {
+  switch (status) {
+    case RUN_FINISHED:
+      return "FINISHED";
+    case RUN_BUDGET_EXHAUSTED:
+      return "BUDGET_EXHAUSTED";
+    case RUN_DEADLINE:
+      return "DEADLINE";
+    case RUN_PREEMPTED:
+      return "PREEMPTED";
+    case RUN_ERROR:
+      return "ERROR";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+const char *get_result_name(ExecResult result) {
+  switch (result) {
+    case SUCCESS:
+      return "SUCCESS";
+    case INSTRUCTION_ERROR:
+      return "INSTRUCTION_ERROR";
+    case MEMORY_ERROR:
+      return "MEMORY_ERROR";
+    case PC_ERROR:
+      return "PC_ERROR";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+/*
+Execute the loaded program with the engine selected in sys->engine.
+
+Like before, an instruction that fails does not stop the program. The return
+value is SUCCESS if every instruction succeeded, or the error reported by the
+first one that did not.
+
+If sys->profile is set the run is profiled instead, whatever the engine, if
+sys->trace is set it is traced, and if sys->sampler is set its call stack is
+sampled. The checks are made once per run, and builds with -DNO_PROFILER
+leave them out.
+*/
+ExecResult execute_instructions(System *sys) {
+#ifndef NO_PROFILER
+  if (sys->profile != NULL) {
+    return execute_profiled_instructions(sys);
+  }
+  if (sys->trace != NULL) {
+    return execute_traced_instructions(sys);
+  }
+  if (sys->sampler != NULL) {
+    return execute_sampled_instructions(sys);
+  }
+#endif
+  switch (sys->engine) {
+    case ENGINE_STRING:
+      return execute_string_instructions(sys);
+    case ENGINE_THREADED:
+      return execute_threaded_instructions(sys);
+    case ENGINE_LANES:
+      return execute_lanes_instructions(sys);
+    case ENGINE_JIT:
+      return execute_jit_instructions(sys);
+    case ENGINE_BLOCKS:
+      return execute_block_instructions(sys);
+    default:
+      return execute_decoded_instructions(sys);
+  }
+}
+
+/* Reset the registers, comparison flag and data segment of the system to their
+ * initial state, keeping the loaded program */
+void reset_system(System *sys) {
+  sys->registers[EAX] = 0;
+  sys->registers[EDX] = 0;
+  sys->registers[ECX] = 0;
+  sys->registers[ESP] = sys->memory.data_size - 256;
+  sys->registers[EBP] = sys->memory.data_size - 256;
+  sys->registers[EIP] = 0;
+  sys->comparison_flag = 0;
+  sys->comparison_source = 0;
+  memset(sys->memory.data, 0, (size_t)sys->memory.data_size * sizeof(int));
+}
+
+/*
+Make sys run the program loaded into program without copying it: the
+instruction text, decoded code and label table of program are shared read-only,
+while registers, data segment and threaded handlers stay private to sys.
+program must outlive sys, and sys must have an instruction segment at least as
+large as program's. sys cannot load programs afterwards.
+
+It returns 0 on success, or -1 if the instruction segment of sys is too small.
+*/
+int attach_program(System *sys, const System *program) {
+  if (sys->memory.instruction_size < program->memory.num_instructions) {
+    return -1;
+  }
+  discard_compiled_program(sys);
+  release_program_image(sys);
+  sys->memory.attached = 1;
+  sys->memory.num_instructions = program->memory.num_instructions;
+  sys->memory.instruction = program->memory.instruction;
+  sys->memory.code = program->memory.code;
+  sys->memory.labels = program->memory.labels;
+  sys->memory.label_table_size = program->memory.label_table_size;
+  sys->memory.num_labels = program->memory.num_labels;
+  return 0;
+}
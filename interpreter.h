@@ -1,14 +1,24 @@
 #ifndef __INTERPRETER_H
 #define __INTERPRETER_H
 
+#include <stddef.h>
+
+// Default size of the instruction and data segments
 #define MEMORY_SIZE 1024
 
-// Declaration of Memory type:
-typedef struct Memory {
-  int num_instructions;
-  char *instruction[MEMORY_SIZE];  // array of instructions
-  int data[MEMORY_SIZE];           // array of data
-} Memory;
+// Size of the buffers an opcode, operand or label of a line is split into,
+// terminator included; longer tokens are load errors
+#define TOKEN_SIZE 20
+
+/* Labels as values are a GCC extension; other compilers get a switch loop in
+ * the threaded engines. Build with -DUSE_COMPUTED_GOTO=0 to force it. */
+#ifndef USE_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+#endif
 
 /*** General Register Structures ***/
 typedef int Registers;
@@ -17,12 +27,6 @@ typedef int Registers;
 enum RegisterName { EAX, EDX, ECX, ESP, EBP, EIP, NOT_REG };
 typedef enum RegisterName RegisterName;
 
-typedef struct System {
-  Registers registers[6];  // 0: EAX, 1: EDX, 2: ECX, 3: ESP, 4: EBP, 5: EIP
-  Memory memory;
-  int comparison_flag;  // comparison flag to hold the result of comparisons
-} System;
-
 typedef enum DataType { REG, MEM, CONST, UNKNOWN } DataType;
 
 /*
@@ -43,6 +47,241 @@ typedef struct MemoryType {
   int value;
 } MemoryType;
 
+/*
+Operand forms of MOVL, CMPL and the arithmetic instructions that get a handler
+of their own, as X(opcode, instruction, source type, destination type). Every
+valid combination is listed; the others (MEM to MEM, CONST or UNKNOWN
+destinations) keep the generic handler and its INSTRUCTION_ERROR. INCL and
+DECL are decoded with a constant source of 1.
+*/
+#define ARITHMETIC_OPCODES(X, NAME)                   \
+  X(OP_##NAME##_REG_REG, OP_##NAME, REG, REG)         \
+  X(OP_##NAME##_REG_MEM, OP_##NAME, REG, MEM)         \
+  X(OP_##NAME##_CONST_REG, OP_##NAME, CONST, REG)     \
+  X(OP_##NAME##_CONST_MEM, OP_##NAME, CONST, MEM)     \
+  X(OP_##NAME##_MEM_REG, OP_##NAME, MEM, REG)
+
+#define SPECIALIZED_OPCODES(X)                \
+  X(OP_MOVL_REG_REG, OP_MOVL, REG, REG)       \
+  X(OP_MOVL_REG_MEM, OP_MOVL, REG, MEM)       \
+  X(OP_MOVL_CONST_REG, OP_MOVL, CONST, REG)   \
+  X(OP_MOVL_CONST_MEM, OP_MOVL, CONST, MEM)   \
+  X(OP_MOVL_MEM_REG, OP_MOVL, MEM, REG)       \
+  ARITHMETIC_OPCODES(X, ADDL)                 \
+  ARITHMETIC_OPCODES(X, SUBL)                 \
+  ARITHMETIC_OPCODES(X, IMULL)                \
+  ARITHMETIC_OPCODES(X, ANDL)                 \
+  ARITHMETIC_OPCODES(X, ORL)                  \
+  ARITHMETIC_OPCODES(X, XORL)                 \
+  ARITHMETIC_OPCODES(X, SHLL)                 \
+  ARITHMETIC_OPCODES(X, SARL)                 \
+  X(OP_INCL_REG, OP_INCL, CONST, REG)         \
+  X(OP_INCL_MEM, OP_INCL, CONST, MEM)         \
+  X(OP_DECL_REG, OP_DECL, CONST, REG)         \
+  X(OP_DECL_MEM, OP_DECL, CONST, MEM)         \
+  X(OP_CMPL_REG_REG, OP_CMPL, REG, REG)       \
+  X(OP_CMPL_REG_MEM, OP_CMPL, REG, MEM)       \
+  X(OP_CMPL_REG_CONST, OP_CMPL, REG, CONST)   \
+  X(OP_CMPL_CONST_REG, OP_CMPL, CONST, REG)   \
+  X(OP_CMPL_CONST_MEM, OP_CMPL, CONST, MEM)   \
+  X(OP_CMPL_CONST_CONST, OP_CMPL, CONST, CONST) \
+  X(OP_CMPL_MEM_REG, OP_CMPL, MEM, REG)       \
+  X(OP_CMPL_MEM_CONST, OP_CMPL, MEM, CONST)
+
+#define DECLARE_OPCODE(name, op, src, dst) name,
+
+/* Opcodes produced by the decode pass. OP_NOP covers labels and every line
+ * that is not a known instruction. */
+typedef enum Opcode {
+  OP_NOP,
+  OP_MOVL,
+  OP_ADDL,
+  OP_SUBL,
+  OP_IMULL,
+  OP_ANDL,
+  OP_ORL,
+  OP_XORL,
+  OP_SHLL,
+  OP_SARL,
+  OP_INCL,
+  OP_DECL,
+  OP_PUSHL,
+  OP_POPL,
+  OP_CMPL,
+  OP_MOVSL,
+  OP_STOSL,
+  OP_CMPSL,
+  OP_CALL,
+  OP_RET,
+  OP_JMP,
+  OP_JE,
+  OP_JNE,
+  OP_JL,
+  OP_JG,
+  OP_JLE,
+  OP_JGE,
+  OP_JA,
+  OP_JB,
+  OP_END,
+  /* Specialized and superinstruction opcodes only ever appear in
+   * Instruction.fused. The specialized ones are chosen by the decoder, the
+   * superinstructions by fuse_instructions (fusion.h). */
+  SPECIALIZED_OPCODES(DECLARE_OPCODE)
+  OP_ADDL_ADDL,      // two ADDL of %reg or $const into %reg
+  OP_CMPL_JCC,       // CMPL %reg or $const with %reg, then a jump
+  OP_ADDL_CMPL_JCC,  // ADDL as in OP_ADDL_ADDL, then OP_CMPL_JCC
+  OP_TRAP,           // breakpoint patched in by the debugger (debugger.h)
+  OP_COUNT
+} Opcode;
+
+/*
+Result of the arithmetic instruction op, ADDL to DECL, on value, its
+destination, and source. Like on x86 the arithmetic wraps around, IMULL keeps
+the low 32 bits of the product and shifts only use the low 5 bits of the
+count. INCL and DECL get a source of 1.
+*/
+static inline int apply_alu_op(Opcode op, int value, int source) {
+  unsigned a = (unsigned)value, b = (unsigned)source;
+  switch (op) {
+    case OP_ADDL:
+    case OP_INCL:
+      return (int)(a + b);
+    case OP_SUBL:
+    case OP_DECL:
+      return (int)(a - b);
+    case OP_IMULL:
+      return (int)(a * b);
+    case OP_ANDL:
+      return value & source;
+    case OP_ORL:
+      return value | source;
+    case OP_XORL:
+      return value ^ source;
+    case OP_SHLL:
+      return (int)(a << (b & 31));
+    case OP_SARL:
+      return value >> (b & 31);
+    default:
+      return value;
+  }
+}
+
+/*
+Flags are evaluated lazily. CMPL only stores its result, destination - source
+wrapped to 32 bits, in comparison_flag and its source in comparison_source;
+the destination is their sum. A conditional jump computes the outcome it needs
+from them, so no instruction pays for flags and the signed and unsigned
+conditions are exact, like x86 flags, even when the subtraction overflows.
+CMPSL stores its last pair of words the same way.
+
+Outcomes as a bit mask: exactly one of LESS, EQUAL and GREATER is set, and one
+of BELOW, EQUAL and ABOVE. A jump is taken when its mask of outcomes
+intersects the outcome of the last CMPL.
+*/
+enum ComparisonOutcome {
+  COMPARE_LESS = 1,      // destination < source as signed integers
+  COMPARE_EQUAL = 2,
+  COMPARE_GREATER = 4,   // destination > source as signed integers
+  COMPARE_BELOW = 8,     // destination < source as unsigned integers
+  COMPARE_ABOVE = 16     // destination > source as unsigned integers
+};
+
+static inline int get_comparison_outcome(int destination, int source) {
+  unsigned a = (unsigned)destination, b = (unsigned)source;
+  return (destination < source) | (a == b) << 1 |
+         (destination > source) << 2 | (a < b) << 3 | (a > b) << 4;
+}
+
+/*
+A decoded instruction. Operands are resolved with get_memory_type once at load
+time so the execution loop never has to look at the instruction text again.
+
+For jumps and calls, target is the address of the label (as returned by
+get_addr_from_label), or -1 if the label cannot be found.
+
+fused is the opcode the decoded and threaded engines dispatch on: op itself,
+the specialized opcode for its operand types, or a superinstruction that also
+runs the next one or two instructions. The
+following instructions keep their own records, so jumping into the middle of
+a fused sequence still runs the right code.
+*/
+typedef struct Instruction {
+  Opcode op;
+  MemoryType src;
+  MemoryType dst;
+  int target;
+  Opcode fused;
+} Instruction;
+
+/* Entry of the label hash table. name points at the label line in the
+ * instruction segment, and address is the address of the next instruction. */
+typedef struct Label {
+  const char *name;
+  int address;
+} Label;
+
+/*
+Declaration of Memory type:
+
+The segments are allocated once from a single arena by
+initialize_system_with_size. instruction_size is the number of instructions the
+instruction segment can hold and data_size the number of words in the data
+segment. data_limit is the highest valid data address, (data_size - 1) * 4.
+*/
+typedef struct Memory {
+  int num_instructions;
+  int instruction_size;
+  int data_size;
+  int data_limit;
+  char **instruction;      // array of instructions
+  Instruction *code;       // decoded form of instruction[]
+  const void **threaded;   // handler of each instruction, filled by the
+                           // threaded engine
+  int *data;               // array of data
+  Label *labels;           // open addressing table of all labels
+  int label_table_size;    // power of two, at least 2 * instruction_size
+  int num_labels;
+  void *arena;             // single allocation backing all the arrays above
+  char *text;              // normalized program text instruction[] points into
+  const void *image;       // shared program image code points into, mapped
+                           // by load_cached_program (cache.h), or NULL
+  size_t image_size;
+  int attached;            // 1 if instruction, code and labels belong to
+                           // another System (attach_program)
+} Memory;
+
+// Execution engines that execute_instructions can dispatch to.
+typedef enum Engine {
+  ENGINE_DECODED,   // dispatch on the decoded instruction records
+  ENGINE_STRING,    // re-parse the instruction text on every step
+  ENGINE_THREADED,  // direct-threaded dispatch over the decoded records
+  ENGINE_LANES,     // SIMD lanes engine (lanes.h), here with a single lane
+  ENGINE_JIT,       // native x86-64 code from the template JIT (jit.h)
+  ENGINE_BLOCKS,    // basic blocks with hoisted bounds checks (blocks.h)
+  ENGINE_UNKNOWN
+} Engine;
+
+struct Profile;
+struct Jit;
+struct BlockCache;
+struct Trace;
+struct Sampler;
+
+typedef struct System {
+  Registers registers[6];  // 0: EAX, 1: EDX, 2: ECX, 3: ESP, 4: EBP, 5: EIP
+  Memory memory;
+  int comparison_flag;    // result of the last CMPL or CMPSL,
+                          // destination - source
+  int comparison_source;  // source operand of the last CMPL or CMPSL
+  Engine engine;        // engine used by execute_instructions
+  struct Profile *profile;  // when set, runs are profiled (profile.h)
+  struct Jit *jit;          // native code of the program, built on first use
+  struct BlockCache *blocks;  // basic blocks of the program, formed on use
+  struct Trace *trace;        // when set, runs are traced (trace.h)
+  struct Sampler *sampler;    // when set, runs sample the guest call stack
+                              // (sampler.h)
+} System;
+
 typedef enum ExecResult {
   SUCCESS,
   INSTRUCTION_ERROR,
@@ -50,19 +289,93 @@ typedef enum ExecResult {
   PC_ERROR
 } ExecResult;
 
+// Why execute_with_limits returned
+typedef enum RunStatus {
+  RUN_FINISHED,          // END, or EIP left the program
+  RUN_BUDGET_EXHAUSTED,  // budget instructions have run
+  RUN_DEADLINE,          // the deadline has passed
+  RUN_PREEMPTED,         // *preempt was set
+  RUN_ERROR              // an instruction failed and stop_on_error is set
+} RunStatus;
+
+/* Limits of a run of execute_with_limits. Fields left at 0 or NULL do not
+ * limit the run. */
+typedef struct RunLimits {
+  long long budget;       // number of instructions to run
+  long long deadline;     // CLOCK_MONOTONIC time in nanoseconds
+  _Atomic int *preempt;   // set to nonzero, by any thread, to stop the run
+  int stop_on_error;      // stop at the first failing instruction
+} RunLimits;
+
+typedef struct RunResult {
+  RunStatus status;
+  ExecResult result;   // error of the first failing instruction, or SUCCESS
+  int eip;             // EIP when the run stopped, or for RUN_ERROR the
+                       // address of the failing instruction
+  long long executed;  // number of instructions run
+} RunResult;
+
 void initialize_system(System *sys);
+int initialize_system_with_size(System *sys, int instruction_size,
+                                int data_size);
+void free_system(System *sys);
+void discard_compiled_program(System *sys);
+void release_program_image(System *sys);
+int check_own_program(const System *sys);
 RegisterName get_register_by_name(const char *name);
 MemoryType get_memory_type(const char *name);
 
-void load_instructions_from_file(System *sys, const char *filename);
+int reformat(char *line);
+int load_instructions_from_buffer(System *sys, const char *src, size_t size);
+int load_instructions_from_file(System *sys, const char *filename);
+int build_label_table(System *sys);
+int add_label(System *sys, const char *name, int address);
+int get_addr_from_label(System *sys, const char *label);
+const char *get_label_by_addr(System *sys, int addr);
+Opcode get_opcode_by_name(const char *name);
+Opcode get_specialized_opcode(const Instruction *inst);
+const char *get_opcode_name(Opcode op);
+Instruction decode_instruction(System *sys, const char *line);
+int decode_instructions(System *sys);
+
+ExecResult execute_movl_op(System *sys, MemoryType source,
+                           MemoryType destination);
+ExecResult execute_addl_op(System *sys, MemoryType source,
+                           MemoryType destination);
+ExecResult execute_alu_op(System *sys, Opcode op, MemoryType source,
+                          MemoryType destination);
+ExecResult execute_push_op(System *sys, MemoryType source);
+ExecResult execute_pop_op(System *sys, MemoryType destination);
+ExecResult execute_cmpl_op(System *sys, MemoryType source1,
+                           MemoryType source2);
+ExecResult execute_rep_op(System *sys, Opcode op, MemoryType source,
+                          MemoryType destination);
+ExecResult execute_jmp_op(System *sys, Opcode condition, int memAdd);
+int is_jump_taken(const System *sys, Opcode condition);
+ExecResult execute_call_op(System *sys, int memAdd);
+
 ExecResult execute_movl(System *sys, char *src, char *dst);
 ExecResult execute_addl(System *sys, char *src, char *dst);
+ExecResult execute_alu(System *sys, char *op, char *src, char *dst);
 ExecResult execute_push(System *sys, char *src);
 ExecResult execute_pop(System *sys, char *dst);
 ExecResult execute_cmpl(System *sys, char *src, char *dst);
+ExecResult execute_rep(System *sys, char *op, char *src, char *dst);
 ExecResult execute_jmp(System *sys, char *condition, char *dst);
 ExecResult execute_call(System *sys, char *dst);
 ExecResult execute_ret(System *sys);
-void execute_instructions(System *sys);
+
+Engine get_engine_by_name(const char *name);
+const char *get_engine_name(Engine engine);
+const char *get_result_name(ExecResult result);
+ExecResult step_instruction(System *sys, int *halted);
+ExecResult execute_string_instructions(System *sys);
+ExecResult execute_decoded_instructions(System *sys);
+ExecResult execute_threaded_instructions(System *sys);
+ExecResult execute_instructions(System *sys);
+RunResult execute_with_limits(System *sys, const RunLimits *limits);
+const char *get_run_status_name(RunStatus status);
+void reset_system(System *sys);
+int attach_program(System *sys, const System *program);
 
 #endif
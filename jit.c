@@ -0,0 +1,745 @@
+#include "jit.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+Template JIT for x86-64.
+
+Every decoded instruction is turned into a fixed sequence of host instructions.
+While native code runs, the guest registers live in host registers:
+
+  EAX r8d   EDX r9d   ECX r10d   ESP r11d   EBP r12d
+  comparison_flag r13d   comparison_source edi
+  memory.data r14   System * r15
+
+EIP is only written back when the native code exits, as a constant known at
+compile time or the address popped by RET. eax, ecx and edx are scratch.
+
+Native code never reports an error. Whenever an instruction could fail (a
+memory operand or ESP out of bounds, a bad jump target, an EIP operand, an
+invalid operand combination) the generated code exits before changing
+anything, and execute_jit_instructions runs that one instruction with
+step_instruction. So results, errors included, are the same as with the
+interpreter.
+
+On other hosts, or in builds with -DNO_JIT, compile_jit fails and the decoded
+engine is used instead.
+*/
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+
+// Reasons for leaving native code, returned by Jit.run
+enum { JIT_EXIT_END, JIT_EXIT_DEOPT, JIT_EXIT_JUMP };
+
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7,
+  R8 = 8, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+#define FLAG R13
+#define SOURCE RDI
+#define DATA R14
+#define STATE R15
+
+// Condition codes of Jcc
+enum {
+  CC_B = 2, CC_AE = 3, CC_E = 4, CC_NE = 5, CC_A = 7,
+  CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+};
+
+// Group 1 opcode extensions used with emit_alu_imm
+enum {
+  ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7
+};
+
+// Group 2 opcode extensions of the shifts
+enum { SHIFT_SHL = 4, SHIFT_SAR = 7 };
+
+// Targets of rel32 jumps, resolved once all the code has been emitted
+typedef enum FixupKind {
+  FIXUP_ENTRY,    // native code of instruction value
+  FIXUP_DEOPT,    // exit to interpret the instruction at address value
+  FIXUP_EXIT,     // exit with EIP set to value
+  FIXUP_DYNAMIC,  // exit with EIP taken from eax
+  FIXUP_COMMON    // common exit path
+} FixupKind;
+
+typedef struct Fixup {
+  size_t at;
+  FixupKind kind;
+  int value;
+} Fixup;
+
+typedef struct Emitter {
+  unsigned char *code;
+  size_t size, capacity;
+  Fixup *fixups;
+  int num_fixups, fixup_capacity;
+  size_t *table_patches;  // positions of the imm64 address of entries
+  int num_table_patches;
+  int failed;
+  const System *sys;
+} Emitter;
+
+static void emit_byte(Emitter *e, int value) {
+  if (e->size == e->capacity) {
+    size_t capacity = e->capacity ? 2 * e->capacity : 4096;
+    unsigned char *code = realloc(e->code, capacity);
+    if (code == NULL) {
+      e->failed = 1;
+      return;
+    }
+    e->code = code;
+    e->capacity = capacity;
+  }
+  e->code[e->size++] = (unsigned char)value;
+}
+
+static void emit_imm32(Emitter *e, int value) {
+  for (int i = 0; i < 4; i++) emit_byte(e, ((unsigned)value >> (8 * i)) & 0xFF);
+}
+
+static void emit_rex(Emitter *e, int w, int reg, int index, int base) {
+  int rex = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+  if (rex != 0x40) emit_byte(e, rex);
+}
+
+/* opcode with two 32-bit registers: reg in ModRM.reg, rm in ModRM.rm */
+static void emit_rr(Emitter *e, int opcode, int reg, int rm) {
+  emit_rex(e, 0, reg, 0, rm);
+  emit_byte(e, opcode);
+  emit_byte(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* opcode with a register and the data word at [r14 + index] */
+static void emit_rdata(Emitter *e, int opcode, int reg, int index) {
+  emit_rex(e, 0, reg, index, DATA);
+  emit_byte(e, opcode);
+  emit_byte(e, 0x04 | (reg & 7) << 3);
+  emit_byte(e, (index & 7) << 3 | (DATA & 7));
+}
+
+/* opcode with a register and [base + disp32] */
+static void emit_rdisp(Emitter *e, int w, int opcode, int reg, int base,
+                       int disp) {
+  emit_rex(e, w, reg, 0, base);
+  emit_byte(e, opcode);
+  emit_byte(e, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == 4) emit_byte(e, 0x24);
+  emit_imm32(e, disp);
+}
+
+/* mov reg, imm32 */
+static void emit_mov_imm(Emitter *e, int reg, int value) {
+  emit_rex(e, 0, 0, 0, reg);
+  emit_byte(e, 0xB8 | (reg & 7));
+  emit_imm32(e, value);
+}
+
+/* Group 1 operation ext (add, or, and, sub, xor or cmp) of a register and an
+ * imm32 */
+static void emit_alu_imm(Emitter *e, int ext, int reg, int value) {
+  emit_rex(e, 0, 0, 0, reg);
+  emit_byte(e, 0x81);
+  emit_byte(e, 0xC0 | ext << 3 | (reg & 7));
+  emit_imm32(e, value);
+}
+
+/* mov (0xC7, ext 0) or a group 1 operation (0x81) of an imm32 to the data word
+ * at [r14 + index] */
+static void emit_data_imm(Emitter *e, int opcode, int ext, int index,
+                          int value) {
+  emit_rex(e, 0, 0, index, DATA);
+  emit_byte(e, opcode);
+  emit_byte(e, 0x04 | ext << 3);
+  emit_byte(e, (index & 7) << 3 | (DATA & 7));
+  emit_imm32(e, value);
+}
+
+/* imul reg, rm with two 32-bit registers */
+static void emit_imul(Emitter *e, int reg, int rm) {
+  emit_rex(e, 0, reg, 0, rm);
+  emit_byte(e, 0x0F);
+  emit_byte(e, 0xAF);
+  emit_byte(e, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* Jump (cc < 0) or conditional jump to a target resolved later */
+static void emit_jump(Emitter *e, int cc, FixupKind kind, int value) {
+  if (cc < 0) {
+    emit_byte(e, 0xE9);
+  } else {
+    emit_byte(e, 0x0F);
+    emit_byte(e, 0x80 | cc);
+  }
+  if (e->num_fixups == e->fixup_capacity) {
+    int capacity = e->fixup_capacity ? 2 * e->fixup_capacity : 256;
+    Fixup *fixups = realloc(e->fixups, capacity * sizeof(Fixup));
+    if (fixups == NULL) {
+      e->failed = 1;
+      return;
+    }
+    e->fixups = fixups;
+    e->fixup_capacity = capacity;
+  }
+  e->fixups[e->num_fixups++] = (Fixup){e->size, kind, value};
+  emit_imm32(e, 0);
+}
+
+/* Host register of a guest register other than EIP */
+static int host_register(RegisterName reg) { return R8 + reg; }
+
+/* 1 if the native code can use the operand: EIP is never an operand */
+static int is_native_operand(MemoryType operand) {
+  return operand.type == CONST ||
+         ((operand.type == REG || operand.type == MEM) && operand.reg < EIP);
+}
+
+/* eax = byte offset in memory.data of a memory operand, leaving to the
+ * interpreter if it is outside the data segment */
+static void emit_address(Emitter *e, MemoryType operand, int address) {
+  emit_rdisp(e, 0, 0x8D, RAX, host_register(operand.reg), operand.value);
+  emit_alu_imm(e, ALU_CMP, RAX, e->sys->memory.data_limit);
+  emit_jump(e, CC_A, FIXUP_DEOPT, address);
+  emit_alu_imm(e, ALU_AND, RAX, -4);
+}
+
+/* Leave to the interpreter unless ESP + offset is between 0 and limit: a push
+ * needs ESP - 4 in the data segment, a pop needs ESP and ESP + 4 in it */
+static void emit_stack_check(Emitter *e, int offset, int limit, int address) {
+  emit_rdisp(e, 0, 0x8D, RAX, host_register(ESP), offset);
+  emit_alu_imm(e, ALU_CMP, RAX, limit);
+  emit_jump(e, CC_A, FIXUP_DEOPT, address);
+}
+
+/* ecx = byte offset in memory.data of the word at ESP */
+static void emit_stack_slot(Emitter *e) {
+  emit_rr(e, 0x89, host_register(ESP), RCX);
+  emit_alu_imm(e, ALU_AND, RCX, -4);
+}
+
+/* Jump (cc < 0) or conditional jump to a guest address */
+static void emit_branch(Emitter *e, int cc, int target) {
+  if (target % 4 == 0 && target / 4 < e->sys->memory.num_instructions) {
+    emit_jump(e, cc, FIXUP_ENTRY, target / 4);
+  } else {
+    emit_jump(e, cc, FIXUP_EXIT, target);
+  }
+}
+
+/* Store EIP and the exit reason and leave native code */
+static void emit_exit(Emitter *e, int eip, int reason) {
+  emit_rex(e, 0, 0, 0, STATE);
+  emit_byte(e, 0xC7);
+  emit_byte(e, 0x80 | (STATE & 7));
+  emit_imm32(e, offsetof(System, registers[EIP]));
+  emit_imm32(e, eip);
+  emit_mov_imm(e, RAX, reason);
+  emit_jump(e, -1, FIXUP_COMMON, 0);
+}
+
+/* Host forms of the guest instructions that have the operand forms of ADD:
+ * the opcodes of op r/m32, r32 and op r32, r/m32 and the group 1 extension of
+ * op r/m32, imm32. MOVL uses 0xC7 and mov reg, imm32 instead of group 1. */
+typedef struct HostOperation {
+  unsigned char to_rm, from_rm, ext;
+} HostOperation;
+
+static const HostOperation host_operations[OP_COUNT] = {
+    [OP_MOVL] = {0x89, 0x8B, 0},       [OP_ADDL] = {0x01, 0x03, ALU_ADD},
+    [OP_INCL] = {0x01, 0x03, ALU_ADD}, [OP_SUBL] = {0x29, 0x2B, ALU_SUB},
+    [OP_DECL] = {0x29, 0x2B, ALU_SUB}, [OP_ANDL] = {0x21, 0x23, ALU_AND},
+    [OP_ORL] = {0x09, 0x0B, ALU_OR},   [OP_XORL] = {0x31, 0x33, ALU_XOR}};
+
+/* CMPL: comparison_source = source1, comparison_flag = source2 - source1,
+ * with both checks first */
+static void emit_compare(Emitter *e, MemoryType src, MemoryType dst,
+                         int address) {
+  if (src.type == MEM) emit_address(e, src, address);
+  if (dst.type == MEM) {
+    emit_address(e, dst, address);
+    emit_rdata(e, 0x8B, FLAG, RAX);
+  } else if (dst.type == REG) {
+    emit_rr(e, 0x89, host_register(dst.reg), FLAG);
+  } else {
+    emit_mov_imm(e, FLAG, dst.value);
+  }
+  if (src.type == MEM) {
+    emit_rdata(e, 0x8B, SOURCE, RAX);
+  } else if (src.type == REG) {
+    emit_rr(e, 0x89, host_register(src.reg), SOURCE);
+  } else {
+    emit_mov_imm(e, SOURCE, src.value);
+  }
+  emit_rr(e, 0x29, SOURCE, FLAG);
+}
+
+/* IMULL, which has no form with a memory destination on the host: a memory
+ * destination goes through edx */
+static void emit_multiply(Emitter *e, MemoryType src, MemoryType dst,
+                          int address) {
+  int to = RDX;
+  if (dst.type == REG) {
+    to = host_register(dst.reg);
+  } else {
+    emit_address(e, dst, address);
+    emit_rdata(e, 0x8B, RDX, RAX);
+  }
+  if (src.type == MEM) {
+    emit_address(e, src, address);
+    emit_rdata(e, 0x8B, RCX, RAX);
+    emit_imul(e, to, RCX);
+  } else if (src.type == REG) {
+    emit_imul(e, to, host_register(src.reg));
+  } else {
+    emit_rr(e, 0x69, to, to);
+    emit_imm32(e, src.value);
+  }
+  if (dst.type == MEM) emit_rdata(e, 0x89, RDX, RAX);
+}
+
+/* SHLL or SARL: a constant count is an imm8 and any other goes through cl; the
+ * host masks the count to 5 bits like the guest */
+static void emit_shift(Emitter *e, int ext, MemoryType src, MemoryType dst,
+                       int address) {
+  int opcode = src.type == CONST ? 0xC1 : 0xD3;
+  if (src.type == MEM) {
+    emit_address(e, src, address);
+    emit_rdata(e, 0x8B, RCX, RAX);
+  } else if (src.type == REG) {
+    emit_rr(e, 0x89, host_register(src.reg), RCX);
+  }
+  if (dst.type == REG) {
+    int to = host_register(dst.reg);
+    emit_rex(e, 0, 0, 0, to);
+    emit_byte(e, opcode);
+    emit_byte(e, 0xC0 | ext << 3 | (to & 7));
+  } else {
+    emit_address(e, dst, address);
+    emit_rdata(e, opcode, ext, RAX);
+  }
+  if (src.type == CONST) emit_byte(e, src.value & 31);
+}
+
+/*
+MOVL, CMPL or an arithmetic instruction. Returns 0, or -1 if the operands are
+not a valid combination, in which case nothing is emitted and the interpreter
+reports the INSTRUCTION_ERROR.
+*/
+static int emit_operation(Emitter *e, const Instruction *inst, int address) {
+  MemoryType src = inst->src, dst = inst->dst;
+
+  if (!is_native_operand(src) || !is_native_operand(dst) ||
+      (src.type == MEM && dst.type == MEM) ||
+      (inst->op != OP_CMPL && dst.type == CONST)) {
+    return -1;
+  }
+
+  switch (inst->op) {
+    case OP_CMPL:
+      emit_compare(e, src, dst, address);
+      return 0;
+    case OP_IMULL:
+      emit_multiply(e, src, dst, address);
+      return 0;
+    case OP_SHLL:
+    case OP_SARL:
+      emit_shift(e, inst->op == OP_SHLL ? SHIFT_SHL : SHIFT_SAR, src, dst,
+                 address);
+      return 0;
+    default:
+      break;
+  }
+
+  HostOperation host = host_operations[inst->op];
+  int is_move = inst->op == OP_MOVL;
+  if (dst.type == REG) {
+    int to = host_register(dst.reg);
+    if (src.type == MEM) {
+      emit_address(e, src, address);
+      emit_rdata(e, host.from_rm, to, RAX);
+    } else if (src.type == REG) {
+      emit_rr(e, host.to_rm, host_register(src.reg), to);
+    } else if (is_move) {
+      emit_mov_imm(e, to, src.value);
+    } else {
+      emit_alu_imm(e, host.ext, to, src.value);
+    }
+  } else {
+    emit_address(e, dst, address);
+    if (src.type == REG) {
+      emit_rdata(e, host.to_rm, host_register(src.reg), RAX);
+    } else {
+      emit_data_imm(e, is_move ? 0xC7 : 0x81, host.ext, RAX, src.value);
+    }
+  }
+  return 0;
+}
+
+/* Condition code of a conditional jump, for host flags set by comparing the
+ * destination of the last CMPL with its source */
+static int condition_code(Opcode op) {
+  switch (op) {
+    case OP_JE:
+      return CC_E;
+    case OP_JNE:
+      return CC_NE;
+    case OP_JL:
+      return CC_L;
+    case OP_JG:
+      return CC_G;
+    case OP_JLE:
+      return CC_LE;
+    case OP_JGE:
+      return CC_GE;
+    case OP_JA:
+      return CC_A;
+    default:
+      return CC_B;
+  }
+}
+
+/* Emit the native code of one instruction. Returns 0, or -1 if the
+ * instruction has to be run by the interpreter */
+static int emit_instruction(Emitter *e, const Instruction *inst, int address) {
+  const Memory *mem = &e->sys->memory;
+  int valid_target =
+      inst->target >= 0 && inst->target <= (mem->instruction_size - 1) * 4;
+
+  switch (inst->op) {
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_SUBL:
+    case OP_IMULL:
+    case OP_ANDL:
+    case OP_ORL:
+    case OP_XORL:
+    case OP_SHLL:
+    case OP_SARL:
+    case OP_INCL:
+    case OP_DECL:
+      return emit_operation(e, inst, address);
+
+    case OP_CMPL:
+      if (emit_operation(e, inst, address) != 0) return -1;
+      // The sub leaves the host flags of the comparison, so a conditional
+      // jump right after the CMPL branches on them without recomputing
+      if (address / 4 + 1 < mem->num_instructions && inst[1].op >= OP_JE &&
+          inst[1].op <= OP_JB && inst[1].target >= 0 &&
+          inst[1].target <= (mem->instruction_size - 1) * 4) {
+        emit_branch(e, condition_code(inst[1].op), inst[1].target);
+        emit_jump(e, -1, FIXUP_ENTRY, address / 4 + 2);
+      }
+      return 0;
+
+    case OP_PUSHL:
+      if (!is_native_operand(inst->src)) return -1;
+      emit_stack_check(e, -4, mem->data_limit, address);
+      if (inst->src.type == MEM) {
+        emit_address(e, inst->src, address);
+        emit_rdata(e, 0x8B, RDX, RAX);
+      } else if (inst->src.type == REG) {
+        emit_rr(e, 0x89, host_register(inst->src.reg), RDX);
+      }
+      emit_alu_imm(e, ALU_SUB, host_register(ESP), 4);
+      emit_stack_slot(e);
+      if (inst->src.type == CONST) {
+        emit_data_imm(e, 0xC7, 0, RCX, inst->src.value);
+      } else {
+        emit_rdata(e, 0x89, RDX, RCX);
+      }
+      return 0;
+
+    case OP_POPL:
+      if (!is_native_operand(inst->dst) || inst->dst.type == CONST) return -1;
+      emit_stack_check(e, 0, mem->data_limit - 4, address);
+      // The destination address is taken before ESP moves
+      if (inst->dst.type == MEM) emit_address(e, inst->dst, address);
+      emit_stack_slot(e);
+      emit_rdata(e, 0x8B, RDX, RCX);
+      if (inst->dst.type == MEM) {
+        emit_rdata(e, 0x89, RDX, RAX);
+      } else {
+        emit_rr(e, 0x89, RDX, host_register(inst->dst.reg));
+      }
+      emit_alu_imm(e, ALU_ADD, host_register(ESP), 4);
+      return 0;
+
+    case OP_CALL:
+      if (!valid_target) return -1;
+      emit_stack_check(e, -4, mem->data_limit, address);
+      emit_alu_imm(e, ALU_SUB, host_register(ESP), 4);
+      emit_stack_slot(e);
+      emit_data_imm(e, 0xC7, 0, RCX, address + 4);
+      emit_branch(e, -1, inst->target);
+      return 0;
+
+    case OP_RET:
+      emit_stack_check(e, 0, mem->data_limit - 4, address);
+      emit_stack_slot(e);
+      emit_rdata(e, 0x8B, RAX, RCX);
+      // A return address outside the program is a PC_ERROR
+      emit_alu_imm(e, ALU_CMP, RAX, mem->num_instructions * 4);
+      emit_jump(e, CC_AE, FIXUP_DEOPT, address);
+      emit_alu_imm(e, ALU_ADD, host_register(ESP), 4);
+      emit_byte(e, 0xA8);  // test al, 3
+      emit_byte(e, 3);
+      emit_jump(e, CC_NE, FIXUP_DYNAMIC, 0);
+      // mov rdx, entries; jmp [rdx + rax * 2]
+      emit_byte(e, 0x48);
+      emit_byte(e, 0xBA);
+      e->table_patches[e->num_table_patches++] = e->size;
+      emit_imm32(e, 0);
+      emit_imm32(e, 0);
+      emit_byte(e, 0xFF);
+      emit_byte(e, 0x24);
+      emit_byte(e, 0x42);
+      return 0;
+
+    case OP_JMP:
+      if (!valid_target) return -1;
+      emit_branch(e, -1, inst->target);
+      return 0;
+
+    case OP_JE:
+    case OP_JNE:
+      if (!valid_target) return -1;
+      emit_rr(e, 0x85, FLAG, FLAG);
+      emit_branch(e, condition_code(inst->op), inst->target);
+      return 0;
+
+    case OP_JL:
+    case OP_JG:
+    case OP_JLE:
+    case OP_JGE:
+    case OP_JA:
+    case OP_JB:
+      if (!valid_target) return -1;
+      // Compare the destination of the last CMPL, flag + source, again
+      emit_rr(e, 0x89, FLAG, RAX);
+      emit_rr(e, 0x01, SOURCE, RAX);
+      emit_rr(e, 0x39, SOURCE, RAX);
+      emit_branch(e, condition_code(inst->op), inst->target);
+      return 0;
+
+    case OP_END:
+      emit_exit(e, address, JIT_EXIT_END);
+      return 0;
+
+    case OP_MOVSL:
+    case OP_STOSL:
+    case OP_CMPSL:
+      // The words are done by the host kernels of the interpreter, so the
+      // exit and re-entry are paid once per instruction, not per word
+      return -1;
+
+    default:
+      return 0;
+  }
+}
+
+static void patch_rel32(Emitter *e, size_t at, size_t target) {
+  int rel = (int)(target - (at + 4));
+  memcpy(e->code + at, &rel, 4);
+}
+
+/*
+Compile the decoded program of sys to native code.
+
+It returns the compiled program, or NULL if memory cannot be allocated or
+mapped executable, in which case the caller should interpret the program.
+*/
+Jit *compile_jit(const System *sys) {
+  const Memory *mem = &sys->memory;
+  int n = mem->num_instructions;
+  size_t *offsets = malloc(((size_t)n + 1) * sizeof(size_t));
+  Emitter e = {0};
+  Jit *jit = calloc(1, sizeof(Jit));
+  e.sys = sys;
+  e.table_patches = malloc(((size_t)n + 1) * sizeof(size_t));
+  if (offsets == NULL || jit == NULL || e.table_patches == NULL) goto fail;
+
+  // Prologue: save callee-saved registers and load the guest state
+  for (int r = R12; r <= R15; r++) {
+    emit_rex(&e, 0, 0, 0, r);
+    emit_byte(&e, 0x50 | (r & 7));
+  }
+  emit_byte(&e, 0x49);  // mov r15, rdi
+  emit_byte(&e, 0x89);
+  emit_byte(&e, 0xC0 | (RDI << 3) | (STATE & 7));
+  emit_rdisp(&e, 1, 0x8B, DATA, STATE, offsetof(System, memory.data));
+  for (int r = EAX; r < EIP; r++) {
+    emit_rdisp(&e, 0, 0x8B, host_register(r), STATE,
+               offsetof(System, registers) + r * sizeof(Registers));
+  }
+  emit_rdisp(&e, 0, 0x8B, FLAG, STATE, offsetof(System, comparison_flag));
+  emit_rdisp(&e, 0, 0x8B, SOURCE, STATE, offsetof(System, comparison_source));
+  emit_byte(&e, 0xFF);  // jmp rsi
+  emit_byte(&e, 0xE0 | RSI);
+
+  for (int i = 0; i < n; i++) {
+    offsets[i] = e.size;
+    if (emit_instruction(&e, &mem->code[i], i * 4) != 0) {
+      emit_jump(&e, -1, FIXUP_DEOPT, i * 4);
+    }
+  }
+  offsets[n] = e.size;
+  emit_jump(&e, -1, FIXUP_EXIT, n * 4);
+
+  // Common exit: write the guest state back and return eax
+  size_t common = e.size;
+  for (int r = EAX; r < EIP; r++) {
+    emit_rdisp(&e, 0, 0x89, host_register(r), STATE,
+               offsetof(System, registers) + r * sizeof(Registers));
+  }
+  emit_rdisp(&e, 0, 0x89, FLAG, STATE, offsetof(System, comparison_flag));
+  emit_rdisp(&e, 0, 0x89, SOURCE, STATE, offsetof(System, comparison_source));
+  for (int r = R15; r >= R12; r--) {
+    emit_rex(&e, 0, 0, 0, r);
+    emit_byte(&e, 0x58 | (r & 7));
+  }
+  emit_byte(&e, 0xC3);
+
+  size_t dynamic = e.size;
+  emit_rdisp(&e, 0, 0x89, RAX, STATE, offsetof(System, registers[EIP]));
+  emit_mov_imm(&e, RAX, JIT_EXIT_JUMP);
+  emit_jump(&e, -1, FIXUP_COMMON, 0);
+
+  // Exit stubs; resolving a fixup may add the stub's own jump to the list
+  for (int f = 0; f < e.num_fixups && !e.failed; f++) {
+    Fixup fixup = e.fixups[f];
+    size_t target;
+    switch (fixup.kind) {
+      case FIXUP_ENTRY:
+        target = offsets[fixup.value];
+        break;
+      case FIXUP_DEOPT:
+      case FIXUP_EXIT:
+        target = e.size;
+        emit_exit(&e, fixup.value,
+                  fixup.kind == FIXUP_DEOPT ? JIT_EXIT_DEOPT : JIT_EXIT_JUMP);
+        break;
+      case FIXUP_DYNAMIC:
+        target = dynamic;
+        break;
+      default:
+        target = common;
+        break;
+    }
+    if (!e.failed) patch_rel32(&e, fixup.at, target);
+  }
+  if (e.failed) goto fail;
+
+  jit->code = mmap(NULL, e.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  jit->entries = malloc(((size_t)n + 1) * sizeof(void *));
+  if (jit->code == MAP_FAILED || jit->entries == NULL) {
+    if (jit->code == MAP_FAILED) jit->code = NULL;
+    goto fail;
+  }
+  jit->code_size = e.size;
+  for (int i = 0; i <= n; i++) {
+    jit->entries[i] = jit->code + offsets[i];
+  }
+  for (int p = 0; p < e.num_table_patches; p++) {
+    memcpy(e.code + e.table_patches[p], &jit->entries, sizeof(void *));
+  }
+  memcpy(jit->code, e.code, e.size);
+  if (mprotect(jit->code, e.size, PROT_READ | PROT_EXEC) != 0) goto fail;
+
+  jit->run = (int (*)(System *, const void *))(void *)jit->code;
+  jit->program = mem->code;
+  jit->num_instructions = n;
+  jit->instruction_size = mem->instruction_size;
+  jit->data_limit = mem->data_limit;
+  free(e.code);
+  free(e.fixups);
+  free(e.table_patches);
+  free(offsets);
+  return jit;
+
+fail:
+  free(e.code);
+  free(e.fixups);
+  free(e.table_patches);
+  free(offsets);
+  free_jit(jit);
+  return NULL;
+}
+
+void free_jit(Jit *jit) {
+  if (jit == NULL) return;
+  if (jit->code != NULL) munmap(jit->code, jit->code_size);
+  free(jit->entries);
+  free(jit);
+}
+
+/* Return the compiled form of the program of sys, compiling it if the system
+ * has none yet or has changed since */
+static Jit *get_jit(System *sys) {
+  Jit *jit = sys->jit;
+  if (jit != NULL && jit->program == sys->memory.code &&
+      jit->num_instructions == sys->memory.num_instructions &&
+      jit->instruction_size == sys->memory.instruction_size &&
+      jit->data_limit == sys->memory.data_limit) {
+    return jit;
+  }
+  free_jit(jit);
+  sys->jit = compile_jit(sys);
+  return sys->jit;
+}
+
+#else
+
+Jit *compile_jit(const System *sys) {
+  (void)sys;
+  return NULL;
+}
+
+void free_jit(Jit *jit) { (void)jit; }
+
+static Jit *get_jit(System *sys) {
+  (void)sys;
+  return NULL;
+}
+
+#endif
+
+/*
+Run the program with the JIT. Native code runs until it reaches END, leaves
+the program, or meets an instruction it does not handle; that instruction is
+then run by step_instruction and native code is entered again at the next
+one. EIP values that are not a multiple of 4 are interpreted until they are.
+
+Results are the same as with execute_decoded_instructions. If the program
+cannot be compiled it is interpreted instead.
+*/
+ExecResult execute_jit_instructions(System *sys) {
+  Jit *jit = get_jit(sys);
+  ExecResult status = SUCCESS;
+  int halted = 0;
+
+  if (jit == NULL) return execute_decoded_instructions(sys);
+
+  for (;;) {
+    int eip = sys->registers[EIP];
+    int pc = eip / 4;
+    if (eip < 0 || pc >= sys->memory.num_instructions) break;
+
+#if defined(__x86_64__) && !defined(NO_JIT)
+    if (eip % 4 == 0) {
+      int reason = jit->run(sys, jit->entries[pc]);
+      if (reason == JIT_EXIT_END) break;
+      if (reason == JIT_EXIT_JUMP) continue;
+    }
+#endif
+
+    ExecResult result = step_instruction(sys, &halted);
+    if (halted) break;
+    if (status == SUCCESS) {
+      status = result;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,30 @@
+#ifndef __JIT_H
+#define __JIT_H
+
+#include <stddef.h>
+#include "interpreter.h"
+
+/*
+Native code compiled from the decoded program of a System by the template JIT.
+
+entries[i] is the native code of instruction i; the generated code also uses
+the table to return from a RET. The code is only valid for the program, size of
+the instruction segment and data limit it was compiled for, which are kept to
+notice when the system has changed.
+*/
+typedef struct Jit {
+  unsigned char *code;  // executable mapping
+  size_t code_size;
+  const void **entries;
+  int (*run)(System *sys, const void *entry);
+  const Instruction *program;
+  int num_instructions;
+  int instruction_size;
+  int data_limit;
+} Jit;
+
+Jit *compile_jit(const System *sys);
+void free_jit(Jit *jit);
+ExecResult execute_jit_instructions(System *sys);
+
+#endif
@@ -0,0 +1,324 @@
+#include "lanes.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint32_t LaneUVector
+    __attribute__((vector_size(LANE_COUNT * sizeof(uint32_t))));
+
+// Lanes of new where mask is set, lanes of old elsewhere
+#define SELECT(mask, new, old) (((mask) & (new)) | (~(mask) & (old)))
+
+// Wrapping arithmetic, like the scalar engines on every supported target
+#define LANE_ADD(a, b) ((LaneVector)((LaneUVector)(a) + (LaneUVector)(b)))
+#define LANE_SUB(a, b) ((LaneVector)((LaneUVector)(a) - (LaneUVector)(b)))
+#define LANE_MUL(a, b) ((LaneVector)((LaneUVector)(a) * (LaneUVector)(b)))
+
+// EIP of the instruction after the current one, in every lane
+#define NEXT_EIP(group) LANE_ADD((group)->registers[EIP], (LaneVector){0} + 4)
+
+// Value of a register or constant operand in every lane
+#define OPERAND(group, operand)                          \
+  ((operand).type == REG ? (group)->registers[(operand).reg] \
+                         : (LaneVector){0} + (operand).value)
+
+/*
+Set up a lane group running the program loaded into program. The decoded
+program is shared with program, which must outlive the group.
+
+It returns 0 on success, or -1 if the data segments cannot be allocated.
+*/
+int initialize_lane_group(LaneGroup *group, const System *program) {
+  group->view = *program;
+  group->view.memory.arena = NULL;
+  group->view.memory.text = NULL;
+  group->view.memory.image = NULL;
+  group->view.jit = NULL;
+  group->view.blocks = NULL;
+  group->view.trace = NULL;
+  group->view.sampler = NULL;
+  group->data = calloc((size_t)LANE_COUNT * program->memory.data_size,
+                       sizeof(int));
+  if (group->data == NULL) return -1;
+  reset_lane_group(group, LANE_COUNT);
+  return 0;
+}
+
+/* Reset every lane to the initial state of a System and run the first
+ * num_lanes lanes on the next execute_lanes */
+void reset_lane_group(LaneGroup *group, int num_lanes) {
+  int stack = group->view.memory.data_size - 256;
+  for (int r = 0; r < 6; r++) {
+    group->registers[r] = (LaneVector){0};
+  }
+  group->registers[ESP] += stack;
+  group->registers[EBP] += stack;
+  group->comparison_flag = (LaneVector){0};
+  group->comparison_source = (LaneVector){0};
+  memset(group->data, 0,
+         (size_t)LANE_COUNT * group->view.memory.data_size * sizeof(int));
+  group->num_lanes = num_lanes;
+  group->steps = 0;
+}
+
+void free_lane_group(LaneGroup *group) {
+  free(group->data);
+  group->data = NULL;
+}
+
+/* Run the instruction at EIP for one lane through the scalar view. Returns 1
+ * if the lane has stopped. */
+static int step_lane(LaneGroup *group, int lane) {
+  System *view = &group->view;
+  int halted;
+
+  for (int r = 0; r < 6; r++) {
+    view->registers[r] = group->registers[r][lane];
+  }
+  view->comparison_flag = group->comparison_flag[lane];
+  view->comparison_source = group->comparison_source[lane];
+  view->memory.data = group->data + (size_t)lane * view->memory.data_size;
+
+  ExecResult result = step_instruction(view, &halted);
+
+  for (int r = 0; r < 6; r++) {
+    group->registers[r][lane] = view->registers[r];
+  }
+  group->comparison_flag[lane] = view->comparison_flag;
+  group->comparison_source[lane] = view->comparison_source;
+  if (group->results[lane] == SUCCESS) {
+    group->results[lane] = result;
+  }
+  return halted;
+}
+
+static inline __attribute__((always_inline)) void run_lanes(LaneGroup *group) {
+  const Memory *mem = &group->view.memory;
+  const Instruction *code = mem->code;
+  int jump_limit = (mem->instruction_size - 1) * 4;
+  LaneVector alive = {0};
+  unsigned long long steps = 0;
+
+  for (int l = 0; l < LANE_COUNT; l++) {
+    alive[l] = l < group->num_lanes ? -1 : 0;
+    group->results[l] = SUCCESS;
+  }
+
+  for (;;) {
+    // Run the lanes with the lowest EIP, so lanes that took different
+    // branches meet again at the first instruction they have in common
+    int eip = INT_MAX, any = 0;
+    for (int l = 0; l < LANE_COUNT; l++) {
+      if (alive[l] && group->registers[EIP][l] <= eip) {
+        eip = group->registers[EIP][l];
+        any = 1;
+      }
+    }
+    if (!any) break;
+
+    LaneVector mask = alive & (group->registers[EIP] == eip);
+    int pc = eip / 4;
+    if (eip < 0 || pc >= mem->num_instructions) {
+      alive &= ~mask;
+      continue;
+    }
+
+    const Instruction *inst = &code[pc];
+    MemoryType src = inst->src, dst = inst->dst;
+    LaneVector next_eip =
+        SELECT(mask, NEXT_EIP(group), group->registers[EIP]);
+    if (inst->op != OP_END) {
+      for (int l = 0; l < LANE_COUNT; l++) {
+        steps += mask[l] != 0;
+      }
+    }
+
+    switch (inst->op) {
+      case OP_MOVL:
+        if ((src.type == REG || src.type == CONST) && dst.type == REG) {
+          group->registers[dst.reg] =
+              SELECT(mask, OPERAND(group, src), group->registers[dst.reg]);
+          group->registers[EIP] = SELECT(mask, NEXT_EIP(group),
+                                         group->registers[EIP]);
+          continue;
+        }
+        break;
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_IMULL:
+      case OP_ANDL:
+      case OP_ORL:
+      case OP_XORL:
+      case OP_SHLL:
+      case OP_SARL:
+      case OP_INCL:
+      case OP_DECL:
+        if ((src.type == REG || src.type == CONST) && dst.type == REG) {
+          LaneVector value = group->registers[dst.reg];
+          LaneVector source = OPERAND(group, src), result;
+          switch (inst->op) {
+            case OP_ADDL:
+            case OP_INCL:
+              result = LANE_ADD(value, source);
+              break;
+            case OP_SUBL:
+            case OP_DECL:
+              result = LANE_SUB(value, source);
+              break;
+            case OP_IMULL:
+              result = LANE_MUL(value, source);
+              break;
+            case OP_ANDL:
+              result = value & source;
+              break;
+            case OP_ORL:
+              result = value | source;
+              break;
+            case OP_XORL:
+              result = value ^ source;
+              break;
+            case OP_SHLL:
+              result = (LaneVector)((LaneUVector)value << (source & 31));
+              break;
+            default:
+              result = value >> (source & 31);
+              break;
+          }
+          group->registers[dst.reg] =
+              SELECT(mask, result, group->registers[dst.reg]);
+          group->registers[EIP] = SELECT(mask, NEXT_EIP(group),
+                                         group->registers[EIP]);
+          continue;
+        }
+        break;
+      case OP_CMPL:
+        if ((src.type == REG || src.type == CONST) &&
+            (dst.type == REG || dst.type == CONST)) {
+          LaneVector source = OPERAND(group, src);
+          LaneVector diff = LANE_SUB(OPERAND(group, dst), source);
+          group->comparison_flag = SELECT(mask, diff, group->comparison_flag);
+          group->comparison_source =
+              SELECT(mask, source, group->comparison_source);
+          group->registers[EIP] = next_eip;
+          continue;
+        }
+        break;
+      case OP_JMP:
+      case OP_JE:
+      case OP_JNE:
+      case OP_JL:
+      case OP_JG:
+      case OP_JLE:
+      case OP_JGE:
+      case OP_JA:
+      case OP_JB:
+        if (inst->target >= 0 && inst->target <= jump_limit) {
+          // Operands of the last CMPL, worked out only when a jump needs them
+          LaneVector source = group->comparison_source, taken;
+          LaneVector destination = LANE_ADD(group->comparison_flag, source);
+          switch (inst->op) {
+            case OP_JE:
+              taken = destination == source;
+              break;
+            case OP_JNE:
+              taken = destination != source;
+              break;
+            case OP_JL:
+              taken = destination < source;
+              break;
+            case OP_JG:
+              taken = destination > source;
+              break;
+            case OP_JLE:
+              taken = destination <= source;
+              break;
+            case OP_JGE:
+              taken = destination >= source;
+              break;
+            case OP_JA:
+              taken = (LaneUVector)destination > (LaneUVector)source;
+              break;
+            case OP_JB:
+              taken = (LaneUVector)destination < (LaneUVector)source;
+              break;
+            default:
+              taken = (LaneVector){0} - 1;
+              break;
+          }
+          group->registers[EIP] =
+              SELECT(mask & taken, (LaneVector){0} + inst->target, next_eip);
+          continue;
+        }
+        break;
+      case OP_NOP:
+        group->registers[EIP] = next_eip;
+        continue;
+      case OP_END:
+        alive &= ~mask;
+        continue;
+      default:
+        break;
+    }
+
+    // Everything else runs lane by lane
+    for (int l = 0; l < LANE_COUNT; l++) {
+      if (mask[l] && step_lane(group, l)) {
+        alive[l] = 0;
+      }
+    }
+  }
+
+  group->steps = steps;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void run_lanes_avx2(LaneGroup *group) {
+  run_lanes(group);
+}
+#endif
+
+/*
+Run the first num_lanes lanes of the group until each of them stops, the same
+way execute_decoded_instructions would run them one by one. results holds the
+ExecResult of every lane afterwards. The AVX2 build of the loop is used when
+the CPU supports it.
+*/
+void execute_lanes(LaneGroup *group) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    run_lanes_avx2(group);
+    return;
+  }
+#endif
+  run_lanes(group);
+}
+
+/* Run a single System on lane 0 of a lane group, so the lanes engine can be
+ * selected through execute_instructions like the others */
+ExecResult execute_lanes_instructions(System *sys) {
+  LaneGroup group;
+  if (initialize_lane_group(&group, sys) != 0) {
+    return execute_decoded_instructions(sys);
+  }
+  reset_lane_group(&group, 1);
+  for (int r = 0; r < 6; r++) {
+    group.registers[r][0] = sys->registers[r];
+  }
+  group.comparison_flag[0] = sys->comparison_flag;
+  group.comparison_source[0] = sys->comparison_source;
+  memcpy(group.data, sys->memory.data,
+         (size_t)sys->memory.data_size * sizeof(int));
+
+  execute_lanes(&group);
+
+  for (int r = 0; r < 6; r++) {
+    sys->registers[r] = group.registers[r][0];
+  }
+  sys->comparison_flag = group.comparison_flag[0];
+  sys->comparison_source = group.comparison_source[0];
+  memcpy(sys->memory.data, group.data,
+         (size_t)sys->memory.data_size * sizeof(int));
+  ExecResult result = group.results[0];
+  free_lane_group(&group);
+  return result;
+}
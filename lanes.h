@@ -0,0 +1,44 @@
+#ifndef __LANES_H
+#define __LANES_H
+
+#include <stdint.h>
+#include "interpreter.h"
+
+// Number of register files executed together; 8 fills one AVX2 register
+#ifndef LANE_COUNT
+#define LANE_COUNT 8
+#endif
+
+typedef int32_t LaneVector
+    __attribute__((vector_size(LANE_COUNT * sizeof(int32_t))));
+
+/*
+A group of LANE_COUNT independent runs of one program, stored as structure of
+arrays: registers[EAX][lane] is EAX of one lane. Every lane has its own data
+segment of data_size words in data, and its own comparison flag and source.
+
+Lanes that are at the same EIP run that instruction together. MOVL, CMPL and
+the arithmetic instructions between registers and constants and the jumps are
+executed for all of those lanes at once with vector instructions; every other instruction is run
+lane by lane through view, a scalar System sharing the program, so each lane
+gets exactly the result the decoded engine would produce.
+*/
+typedef struct LaneGroup {
+  LaneVector registers[6];
+  LaneVector comparison_flag;
+  LaneVector comparison_source;
+  ExecResult results[LANE_COUNT];
+  int num_lanes;  // lanes [0, num_lanes) are run
+  int *data;      // LANE_COUNT data segments of view.memory.data_size words
+  System view;
+  unsigned long long steps;  // lanes x instructions executed by the last run,
+                             // not counting END
+} LaneGroup;
+
+int initialize_lane_group(LaneGroup *group, const System *program);
+void reset_lane_group(LaneGroup *group, int num_lanes);
+void free_lane_group(LaneGroup *group);
+void execute_lanes(LaneGroup *group);
+ExecResult execute_lanes_instructions(System *sys);
+
+#endif
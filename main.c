@@ -1,33 +1,341 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch.h"
+#include "bytecode.h"
+#include "cache.h"
+#include "debugger.h"
+#include "fusion.h"
 #include "interpreter.h"
+#include "profile.h"
+#include "sampler.h"
+#include "snapshot.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    printf("Usage: %s <instruction_file>\n", argv[0]);
+  const char *filename = NULL;
+  const char *trace_file = NULL;
+  const char *snapshot_file = NULL;
+  const char *snapshot_label = NULL;
+  const char *restore_file = NULL;
+  int trace_compress = 0;
+  int debug = 0;
+  const char *compile_to = NULL;
+  int run_bytecode = 0;
+  const char *cache_name = NULL;
+  long long cache_size_mb = 64;
+  int profile_top = 0;
+  const char *sample_file = NULL;
+  long long sample_every = 0;
+  long long sample_timer_us = 0;
+  RunLimits limits = {0, 0, NULL, 0};
+  long long timeout_ms = 0;
+  int fusion = 1;
+  int fusion_stats = 0;
+  const char *batch_inputs = NULL;
+  const char *batch_outputs = NULL;
+  int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  Engine engine = ENGINE_DECODED;
+  int instruction_size = MEMORY_SIZE;
+  int data_size = MEMORY_SIZE;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      engine = get_engine_by_name(argv[++i]);
+      if (engine == ENGINE_UNKNOWN) {
+        printf("Unknown engine: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--code-size") == 0 && i + 1 < argc) {
+      instruction_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--data-size") == 0 && i + 1 < argc) {
+      data_size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+      compile_to = argv[++i];
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_inputs = argv[++i];
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      batch_outputs = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+      limits.budget = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+      timeout_ms = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--stop-on-error") == 0) {
+      limits.stop_on_error = 1;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile_top = 20;
+    } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+      sample_file = argv[++i];
+    } else if (strcmp(argv[i], "--sample-every") == 0 && i + 1 < argc) {
+      sample_every = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--sample-timer") == 0 && i + 1 < argc) {
+      sample_timer_us = atoll(argv[++i]);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshot_file = argv[++i];
+    } else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) {
+      snapshot_label = argv[++i];
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_file = argv[++i];
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      debug = 1;
+    } else if (strcmp(argv[i], "--trace-compress") == 0) {
+      trace_compress = 1;
+    } else if (strcmp(argv[i], "--no-fusion") == 0) {
+      fusion = 0;
+    } else if (strcmp(argv[i], "--fusion-stats") == 0) {
+      fusion_stats = 1;
+    } else if (strcmp(argv[i], "--run-bytecode") == 0) {
+      run_bytecode = 1;
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache_name = argv[++i];
+    } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+      cache_size_mb = atoll(argv[++i]);
+    } else if (filename == NULL) {
+      filename = argv[i];
+    } else {
+      filename = NULL;
+      break;
+    }
+  }
+
+  if ((filename == NULL) == (restore_file == NULL) ||
+      (restore_file != NULL && (run_bytecode || batch_inputs != NULL)) ||
+      (snapshot_label != NULL && snapshot_file == NULL) ||
+      (compile_to != NULL && run_bytecode) ||
+      (batch_inputs != NULL) != (batch_outputs != NULL) ||
+      (trace_file != NULL && profile_top > 0) ||
+      ((limits.budget > 0 || timeout_ms > 0 || limits.stop_on_error) &&
+       (trace_file != NULL || profile_top > 0)) ||
+      (debug && (trace_file != NULL || profile_top > 0 || limits.budget > 0 ||
+                 timeout_ms > 0 || limits.stop_on_error ||
+                 batch_inputs != NULL || compile_to != NULL)) ||
+      // A cached program is shared read-only and cannot be patched
+      (cache_name != NULL && (run_bytecode || restore_file != NULL ||
+                              debug || !fusion || cache_size_mb <= 0)) ||
+      (sample_file != NULL &&
+       (trace_file != NULL || profile_top > 0 || limits.budget > 0 ||
+        timeout_ms > 0 || limits.stop_on_error || debug ||
+        batch_inputs != NULL || compile_to != NULL ||
+        (sample_every > 0 && sample_timer_us > 0))) ||
+      (sample_file == NULL && (sample_every > 0 || sample_timer_us > 0))) {
+    printf("Usage: %s [--engine decoded|threaded|lanes|jit|blocks|string] "
+           "[--code-size N] [--data-size N] [--profile]\n"
+           "       [--trace FILE [--trace-compress]] [--no-fusion] "
+           "[--fusion-stats]\n"
+           "       [--budget N] [--timeout MS] [--stop-on-error] "
+           "<instruction_file>\n"
+           "       %s [--code-size N] --compile <bytecode_file> "
+           "<instruction_file>\n"
+           "       %s [options] --run-bytecode <bytecode_file>\n"
+           "       %s [options] --batch <inputs> --output <outputs> "
+           "[--threads N] <program>\n"
+           "       %s [options] --snapshot <snapshot_file> "
+           "[--snapshot-at LABEL] <instruction_file>\n"
+           "       %s [options] --restore <snapshot_file>\n"
+           "       %s [options] --debug <instruction_file>\n"
+           "       %s [options] --cache NAME [--cache-size MB] "
+           "<instruction_file>\n"
+           "       %s [options] --sample <stacks_file> "
+           "[--sample-every N | --sample-timer US] <instruction_file>\n",
+           argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+           argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+  if ((run_bytecode || restore_file != NULL || cache_name != NULL) &&
+      engine == ENGINE_STRING) {
+    printf("The string engine needs the program text and cannot run "
+           "bytecode\n");
     return EXIT_FAILURE;
   }
 
   System sys;
-  initialize_system(&sys);
+  Snapshot snapshot;
+  if (restore_file != NULL) {
+    // The snapshot brings its own segment sizes, program and state
+    if (load_snapshot(&snapshot, &sys, restore_file) != 0) {
+      return EXIT_FAILURE;
+    }
+    free_snapshot(&snapshot);
+  } else if (initialize_system_with_size(&sys, instruction_size,
+                                         data_size) != 0) {
+    perror("Error creating system");
+    return EXIT_FAILURE;
+  }
+  sys.engine = engine;
 
   // Load instructions from the file specified in the program argument
-  load_instructions_from_file(&sys, argv[1]);
+  if (restore_file != NULL) {
+    // Already loaded with the snapshot
+  } else if (run_bytecode) {
+    if (load_bytecode_from_file(&sys, filename) != 0) {
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+  } else if (cache_name != NULL) {
+    ProgramCache *cache =
+        open_program_cache(cache_name, (size_t)cache_size_mb << 20);
+    if (cache == NULL) {
+      perror("Error opening program cache");
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+    int result = load_cached_program_from_file(cache, &sys, filename);
+    close_program_cache(cache);
+    if (result != 0) {
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+  } else if (load_instructions_from_file(&sys, filename) != 0) {
+    free_system(&sys);
+    return EXIT_FAILURE;
+  }
+  if (!fusion) {
+    unfuse_instructions(&sys);
+  }
+  if (fusion_stats) {
+    print_fusion_stats(stdout, &sys);
+  }
+
+  if (compile_to != NULL) {
+    int result = save_bytecode(&sys, compile_to);
+    free_system(&sys);
+    return result == 0 ? 0 : EXIT_FAILURE;
+  }
+
+  if (batch_inputs != NULL) {
+    BatchJob *jobs;
+    int num_jobs;
+    int result = -1;
+    if (read_batch_inputs(&sys, batch_inputs, &jobs, &num_jobs) == 0) {
+      result = run_batch(&sys, jobs, num_jobs, num_threads);
+      if (result == 0) {
+        result = write_batch_outputs(batch_outputs, jobs, num_jobs);
+      }
+      free(jobs);
+    }
+    free_system(&sys);
+    return result == 0 ? 0 : EXIT_FAILURE;
+  }
 
   // Initialize some registers for testing
-  sys.registers[EAX] = 5;
-  sys.registers[EDX] = 3;
-  sys.registers[ECX] = 2;
+  if (restore_file == NULL) {
+    sys.registers[EAX] = 5;
+    sys.registers[EDX] = 3;
+    sys.registers[ECX] = 2;
+  }
+
+  // Run the setup prefix and save its state; the run then goes on from there
+  if (snapshot_file != NULL) {
+    int reached = 1;
+    if (snapshot_label != NULL) {
+      int address = get_addr_from_label(&sys, snapshot_label);
+      if (address < 0) {
+        printf("Unknown label: %s\n", snapshot_label);
+        free_system(&sys);
+        return EXIT_FAILURE;
+      }
+      execute_to_address(&sys, address, &reached);
+    } else {
+      execute_instructions(&sys);
+    }
+    if (!reached) {
+      printf("The program stopped before reaching %s\n", snapshot_label);
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+    if (save_snapshot(&sys, snapshot_file) != 0) {
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (debug) {
+    int result = run_debugger(&sys, stdin, stdout);
+    if (result != 0) perror("Error creating debugger");
+    free_system(&sys);
+    return result == 0 ? 0 : EXIT_FAILURE;
+  }
 
-  // Execute instructions
-  execute_instructions(&sys);
+  Profile profile;
+  if (profile_top > 0) {
+    if (initialize_profile(&profile, &sys) != 0) {
+      perror("Error creating profile");
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+    sys.profile = &profile;
+  }
+  Sampler sampler;
+  if (sample_file != NULL) {
+    // A prime period keeps samples from locking onto the period of a loop
+    if (sample_every == 0 && sample_timer_us == 0) sample_every = 10007;
+    if (initialize_sampler(&sampler, &sys, sample_every,
+                           sample_timer_us * 1000) != 0) {
+      perror("Error creating sampler");
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+    sys.sampler = &sampler;
+  }
+  if (trace_file != NULL) {
+    sys.trace = open_trace(trace_file, trace_compress);
+    if (sys.trace == NULL) {
+      perror("Error creating trace");
+      free_system(&sys);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Execute instructions, within the limits if any were given
+  if (limits.budget > 0 || timeout_ms > 0 || limits.stop_on_error) {
+    if (timeout_ms > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      limits.deadline =
+          now.tv_sec * 1000000000ll + now.tv_nsec + timeout_ms * 1000000;
+    }
+    RunResult run = execute_with_limits(&sys, &limits);
+    printf("Run: %s at EIP %d after %lld instructions (%s)\n",
+           get_run_status_name(run.status), run.eip, run.executed,
+           get_result_name(run.result));
+  } else {
+    execute_instructions(&sys);
+  }
+
+  if (sys.trace != NULL && close_trace(sys.trace) != 0) {
+    perror("Error writing trace");
+  }
+  sys.trace = NULL;
 
   // Print the result
   printf("Register EAX: %d\n", sys.registers[EAX]);
   printf("Register EDX: %d\n", sys.registers[EDX]);
   printf("Register ECX: %d\n", sys.registers[ECX]);
 
-  
+  if (profile_top > 0) {
+    print_profile(stdout, &sys, &profile, profile_top);
+    free_profile(&profile);
+  }
+  if (sample_file != NULL) {
+    FILE *file = fopen(sample_file, "w");
+    int failed = file == NULL;
+    if (file != NULL) {
+      write_folded_stacks(file, &sys, &sampler);
+      failed = ferror(file);
+      failed |= fclose(file) != 0;
+    }
+    if (failed) perror("Error writing samples");
+    sys.sampler = NULL;
+    free_sampler(&sampler);
+  }
+
+  free_system(&sys);
 
   return 0;
 }
@@ -0,0 +1,190 @@
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Cheapest timestamp the host offers */
+static inline unsigned long long read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/*
+Set up an empty profile for the program loaded into sys.
+
+It returns 0 on success, or -1 if the counters cannot be allocated.
+*/
+int initialize_profile(Profile *profile, const System *sys) {
+  int n = sys->memory.num_instructions > 0 ? sys->memory.num_instructions : 1;
+  memset(profile, 0, sizeof(*profile));
+  profile->num_instructions = sys->memory.num_instructions;
+  profile->counts = calloc(5 * (size_t)n, sizeof(unsigned long long));
+  if (profile->counts == NULL) return -1;
+  profile->cycles = profile->counts + n;
+  profile->taken = profile->cycles + n;
+  profile->not_taken = profile->taken + n;
+  profile->calls = profile->not_taken + n;
+  return 0;
+}
+
+void free_profile(Profile *profile) {
+  free(profile->counts);
+  profile->counts = NULL;
+}
+
+/*
+Run the program like execute_decoded_instructions, timing every instruction
+and counting it in sys->profile. This loop is only used while a profile is
+attached, so the other engines pay nothing for it.
+*/
+ExecResult execute_profiled_instructions(System *sys) {
+  Profile *profile = sys->profile;
+  const Instruction *code = sys->memory.code;
+  ExecResult status = SUCCESS;
+  int halted = 0;
+
+  for (;;) {
+    int pc = sys->registers[EIP] / 4;
+    if (sys->registers[EIP] < 0 || pc >= sys->memory.num_instructions) break;
+    const Instruction *inst = &code[pc];
+    // Decided before the step, since a jump to the next instruction lands on
+    // its target either way
+    int taken = is_jump_taken(sys, inst->op);
+
+    unsigned long long start = read_cycles();
+    ExecResult result = step_instruction(sys, &halted);
+    unsigned long long elapsed = read_cycles() - start;
+    if (halted) break;
+
+    profile->counts[pc]++;
+    profile->cycles[pc] += elapsed;
+    profile->op_counts[inst->op]++;
+    profile->op_cycles[inst->op] += elapsed;
+
+    switch (inst->op) {
+      case OP_JE:
+      case OP_JNE:
+      case OP_JL:
+      case OP_JG:
+      case OP_JLE:
+      case OP_JGE:
+      case OP_JA:
+      case OP_JB:
+        if (taken) {
+          profile->taken[pc]++;
+        } else {
+          profile->not_taken[pc]++;
+        }
+        break;
+      case OP_CALL:
+        // A label on the last line is the address right after the program
+        if (result == SUCCESS && inst->target / 4 < profile->num_instructions) {
+          profile->calls[inst->target / 4]++;
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (status == SUCCESS) {
+      status = result;
+    }
+  }
+  return status;
+}
+
+static const unsigned long long *sort_values;
+
+/* Orders indexes by decreasing sort_values */
+static int compare_indexes(const void *a, const void *b) {
+  unsigned long long x = sort_values[*(const int *)a];
+  unsigned long long y = sort_values[*(const int *)b];
+  return (x < y) - (x > y);
+}
+
+/* Fill order with the indexes [0, n) sorted by decreasing values */
+static void sort_by(int *order, int n, const unsigned long long *values) {
+  for (int i = 0; i < n; i++) order[i] = i;
+  sort_values = values;
+  qsort(order, n, sizeof(int), compare_indexes);
+}
+
+static const char *describe(System *sys, int pc) {
+  const char *text = sys->memory.instruction[pc];
+  return text ? text : get_opcode_name(sys->memory.code[pc].op);
+}
+
+/*
+Print a hot spot report of the profile: time per opcode, the top instructions
+by time, the conditional jumps with their taken ratio, and how often each
+CALL target was called.
+*/
+void print_profile(FILE *out, System *sys, const Profile *profile, int top) {
+  int n = profile->num_instructions;
+  int *order = malloc(((n > OP_END ? n : OP_END) + 1) * sizeof(int));
+  unsigned long long total = 0, total_count = 0;
+
+  if (order == NULL) return;
+  for (int op = 0; op <= OP_END; op++) {
+    total += profile->op_cycles[op];
+    total_count += profile->op_counts[op];
+  }
+  if (total == 0) total = 1;
+
+  fprintf(out, "\n== Profile: %llu instructions, %llu cycles\n", total_count,
+          total);
+  fprintf(out, "\n%-8s %14s %16s %7s %10s\n", "opcode", "count", "cycles",
+          "time%", "cyc/inst");
+  sort_by(order, OP_END + 1, profile->op_cycles);
+  for (int i = 0; i <= OP_END; i++) {
+    int op = order[i];
+    if (profile->op_counts[op] == 0) continue;
+    fprintf(out, "%-8s %14llu %16llu %6.2f%% %10.1f\n", get_opcode_name(op),
+            profile->op_counts[op], profile->op_cycles[op],
+            100.0 * profile->op_cycles[op] / total,
+            (double)profile->op_cycles[op] / profile->op_counts[op]);
+  }
+
+  fprintf(out, "\n%-6s %-32s %14s %16s %7s\n", "addr", "instruction", "count",
+          "cycles", "time%");
+  sort_by(order, n, profile->cycles);
+  for (int i = 0; i < n && i < top; i++) {
+    int pc = order[i];
+    if (profile->counts[pc] == 0) break;
+    fprintf(out, "%-6d %-32s %14llu %16llu %6.2f%%\n", pc * 4,
+            describe(sys, pc), profile->counts[pc], profile->cycles[pc],
+            100.0 * profile->cycles[pc] / total);
+  }
+
+  fprintf(out, "\n%-6s %-32s %14s %14s %7s\n", "addr", "conditional jump",
+          "taken", "not taken", "taken%");
+  sort_by(order, n, profile->counts);
+  for (int i = 0; i < n; i++) {
+    int pc = order[i];
+    unsigned long long runs = profile->taken[pc] + profile->not_taken[pc];
+    if (runs == 0) continue;
+    fprintf(out, "%-6d %-32s %14llu %14llu %6.2f%%\n", pc * 4,
+            describe(sys, pc), profile->taken[pc], profile->not_taken[pc],
+            100.0 * profile->taken[pc] / runs);
+  }
+
+  fprintf(out, "\n%-6s %-32s %14s\n", "addr", "call target", "calls");
+  sort_by(order, n, profile->calls);
+  for (int i = 0; i < n; i++) {
+    int pc = order[i];
+    if (profile->calls[pc] == 0) break;
+    const char *label = get_label_by_addr(sys, pc * 4);
+    fprintf(out, "%-6d %-32s %14llu\n", pc * 4, label ? label : "?",
+            profile->calls[pc]);
+  }
+
+  free(order);
+}
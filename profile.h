@@ -0,0 +1,31 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdio.h>
+#include "interpreter.h"
+
+/*
+Execution profile of a guest program, collected by execute_profiled_instructions
+when sys->profile is set. Every array is indexed by instruction (EIP / 4).
+
+cycles are TSC ticks on x86 and nanoseconds elsewhere. taken and not_taken are
+only counted for conditional jumps, and calls counts how often each
+instruction was entered through CALL.
+*/
+typedef struct Profile {
+  int num_instructions;
+  unsigned long long *counts;
+  unsigned long long *cycles;
+  unsigned long long *taken;
+  unsigned long long *not_taken;
+  unsigned long long *calls;
+  unsigned long long op_counts[OP_END + 1];
+  unsigned long long op_cycles[OP_END + 1];
+} Profile;
+
+int initialize_profile(Profile *profile, const System *sys);
+void free_profile(Profile *profile);
+ExecResult execute_profiled_instructions(System *sys);
+void print_profile(FILE *out, System *sys, const Profile *profile, int top);
+
+#endif
@@ -0,0 +1,201 @@
+#include "sampler.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+Set up an empty sampler for the program loaded into sys, taking a sample every
+period instructions, or every interval_ns nanoseconds if period is 0. The root
+of the call tree is the function at the current EIP.
+
+It returns 0 on success, or -1 if neither rate is positive or the call tree
+cannot be allocated.
+*/
+int initialize_sampler(Sampler *sampler, const System *sys, long long period,
+                       long long interval_ns) {
+  memset(sampler, 0, sizeof(*sampler));
+  if (period <= 0 && interval_ns <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  sampler->period = period > 0 ? period : 0;
+  sampler->interval_ns = period > 0 ? 0 : interval_ns;
+  sampler->node_capacity = 64;
+  sampler->stack_capacity = 64;
+  sampler->nodes = malloc(sampler->node_capacity * sizeof(SampleNode));
+  sampler->stack = malloc(sampler->stack_capacity * sizeof(SampleFrame));
+  if (sampler->nodes == NULL || sampler->stack == NULL) {
+    free_sampler(sampler);
+    return -1;
+  }
+  sampler->nodes[0] = (SampleNode){sys->registers[EIP], -1, -1, -1, 0};
+  sampler->num_nodes = 1;
+  return 0;
+}
+
+void free_sampler(Sampler *sampler) {
+  free(sampler->nodes);
+  free(sampler->stack);
+  sampler->nodes = NULL;
+  sampler->stack = NULL;
+  sampler->num_nodes = 0;
+  sampler->depth = 0;
+}
+
+static int current_node(const Sampler *sampler) {
+  return sampler->depth > 0 ? sampler->stack[sampler->depth - 1].node : 0;
+}
+
+/* Return the node of a call of function from node parent, adding it to the
+ * tree on the first call, or parent itself if the tree cannot grow */
+static int get_callee(Sampler *sampler, int parent, int function) {
+  int child = sampler->nodes[parent].first_child;
+  for (; child >= 0; child = sampler->nodes[child].next_sibling) {
+    if (sampler->nodes[child].function == function) return child;
+  }
+
+  if (sampler->num_nodes == sampler->node_capacity) {
+    SampleNode *nodes = realloc(sampler->nodes, 2 * sampler->node_capacity *
+                                                    sizeof(SampleNode));
+    if (nodes == NULL) return parent;
+    sampler->nodes = nodes;
+    sampler->node_capacity *= 2;
+  }
+  child = sampler->num_nodes++;
+  sampler->nodes[child] = (SampleNode){function, parent, -1,
+                                       sampler->nodes[parent].first_child, 0};
+  sampler->nodes[parent].first_child = child;
+  return child;
+}
+
+/*
+Update the shadow call stack after a CALL of target, or after a RET if target
+is -1; ESP in sys is the one after the instruction. Frames whose return
+address slot is below ESP have returned, or have been overwritten by the new
+return address for a CALL, and are dropped first.
+*/
+void track_call(Sampler *sampler, const System *sys, int target) {
+  int esp = sys->registers[ESP];
+  while (sampler->depth > 0) {
+    int slot = sampler->stack[sampler->depth - 1].slot;
+    if (slot > esp || (slot == esp && target < 0)) break;
+    sampler->depth--;
+  }
+  if (target < 0) return;
+
+  if (sampler->depth == sampler->stack_capacity) {
+    SampleFrame *stack = realloc(sampler->stack, 2 * sampler->stack_capacity *
+                                                     sizeof(SampleFrame));
+    if (stack == NULL) return;
+    sampler->stack = stack;
+    sampler->stack_capacity *= 2;
+  }
+  int node = get_callee(sampler, current_node(sampler), target);
+  sampler->stack[sampler->depth++] = (SampleFrame){node, esp};
+}
+
+/* Timer thread: set tick every interval_ns until stop is set */
+static void *run_timer(void *arg) {
+  Sampler *sampler = arg;
+  struct timespec next;
+  clock_gettime(CLOCK_REALTIME, &next);
+
+  pthread_mutex_lock(&sampler->lock);
+  while (!sampler->stop) {
+    next.tv_nsec += sampler->interval_ns % 1000000000;
+    next.tv_sec += sampler->interval_ns / 1000000000 + next.tv_nsec / 1000000000;
+    next.tv_nsec %= 1000000000;
+    while (!sampler->stop &&
+           pthread_cond_timedwait(&sampler->wake, &sampler->lock, &next) == 0) {
+    }
+    if (!sampler->stop) atomic_store(&sampler->tick, 1);
+  }
+  pthread_mutex_unlock(&sampler->lock);
+  return NULL;
+}
+
+/*
+Run the program like execute_decoded_instructions, whatever the engine, in
+slices of execute_with_limits that end when a sample is due. The samples go to
+the node of the innermost frame of the shadow stack, which the slices keep
+across calls.
+*/
+ExecResult execute_sampled_instructions(System *sys) {
+  Sampler *sampler = sys->sampler;
+  RunLimits limits = {sampler->period, 0, NULL, 0};
+  ExecResult status = SUCCESS;
+
+  int timed = sampler->interval_ns > 0;
+  if (timed) {
+    limits.preempt = &sampler->tick;
+    sampler->stop = 0;
+    pthread_mutex_init(&sampler->lock, NULL);
+    pthread_cond_init(&sampler->wake, NULL);
+    if (pthread_create(&sampler->timer, NULL, run_timer, sampler) != 0) {
+      // Without a timer the run is not sampled, but still runs
+      limits.preempt = NULL;
+      timed = 0;
+    }
+  }
+
+  for (;;) {
+    RunResult run = execute_with_limits(sys, &limits);
+    if (status == SUCCESS) status = run.result;
+    if (run.status == RUN_FINISHED) break;
+    atomic_store(&sampler->tick, 0);
+    sampler->nodes[current_node(sampler)].samples++;
+    sampler->num_samples++;
+  }
+
+  if (timed) {
+    pthread_mutex_lock(&sampler->lock);
+    sampler->stop = 1;
+    pthread_cond_signal(&sampler->wake);
+    pthread_mutex_unlock(&sampler->lock);
+    pthread_join(sampler->timer, NULL);
+  }
+  if (sampler->interval_ns > 0) {
+    pthread_cond_destroy(&sampler->wake);
+    pthread_mutex_destroy(&sampler->lock);
+  }
+  return status;
+}
+
+/* Write the name of the function of node, the label of its address, to out */
+static void write_function(FILE *out, System *sys, const SampleNode *node) {
+  const char *label = get_label_by_addr(sys, node->function);
+  if (label != NULL) {
+    fputs(label, out);
+  } else if (node->parent < 0) {
+    fputs("start", out);
+  } else {
+    fprintf(out, "@%d", node->function);
+  }
+}
+
+/*
+Write the samples as folded stacks, one line per call path with samples: the
+functions from the outermost to the innermost, separated by ';', then the
+number of samples. This is the input of flamegraph.pl and most flame graph
+viewers. Functions are named by their label; the code run before any CALL is
+named by the label at its start, or "start".
+*/
+void write_folded_stacks(FILE *out, System *sys, const Sampler *sampler) {
+  int *path = malloc(sampler->num_nodes * sizeof(int));
+  if (path == NULL) return;
+
+  for (int i = 0; i < sampler->num_nodes; i++) {
+    if (sampler->nodes[i].samples == 0) continue;
+    int length = 0;
+    for (int node = i; node >= 0; node = sampler->nodes[node].parent) {
+      path[length++] = node;
+    }
+    for (int j = length - 1; j >= 0; j--) {
+      write_function(out, sys, &sampler->nodes[path[j]]);
+      fputc(j > 0 ? ';' : ' ', out);
+    }
+    fprintf(out, "%llu\n", sampler->nodes[i].samples);
+  }
+  free(path);
+}
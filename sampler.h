@@ -0,0 +1,65 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "interpreter.h"
+
+/*
+Sampling profiler of the guest call stack, used by execute_instructions when
+sys->sampler is set.
+
+The run goes through execute_with_limits, which keeps a shadow call stack on
+CALL and RET. Those already end a straight-line run there, so the instructions
+in between run at full speed. Every period instructions, or every interval_ns
+nanoseconds with a timer, the function on top of the shadow stack gets a
+sample. A timer only sets the preempt flag of the run, so its sample is taken
+at the next look at the flag, within some 65536 instructions. The shadow stack
+is a path in a calling context tree, so a sample is one increment and the tree
+is only walked when the stacks are written.
+
+Frames are keyed by the stack slot of their return address, so a frame is
+dropped once ESP moves above that slot. A RET to an address that was pushed
+by hand, or ESP reset past several frames, keeps the stack right.
+*/
+typedef struct SampleNode {
+  int function;     // address of the function, the CALL target
+  int parent;       // index of the calling node, -1 for the root
+  int first_child;  // index of the first callee node, or -1
+  int next_sibling; // index of the next callee of the parent, or -1
+  unsigned long long samples;
+} SampleNode;
+
+typedef struct SampleFrame {
+  int node;  // index of the node of the frame
+  int slot;  // ESP just after the CALL, where its return address is
+} SampleFrame;
+
+typedef struct Sampler {
+  long long period;       // instructions between samples, or 0
+  long long interval_ns;  // nanoseconds between samples, or 0
+  SampleNode *nodes;      // node 0 is the code run before any CALL
+  int num_nodes;
+  int node_capacity;
+  SampleFrame *stack;  // shadow call stack, innermost frame last
+  int depth;
+  int stack_capacity;
+  unsigned long long num_samples;
+
+  // Timer thread of interval_ns sampling; it sets tick for a sample
+  _Atomic int tick;
+  pthread_t timer;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stop;
+} Sampler;
+
+int initialize_sampler(Sampler *sampler, const System *sys, long long period,
+                       long long interval_ns);
+void free_sampler(Sampler *sampler);
+void track_call(Sampler *sampler, const System *sys, int target);
+ExecResult execute_sampled_instructions(System *sys);
+void write_folded_stacks(FILE *out, System *sys, const Sampler *sampler);
+
+#endif
@@ -0,0 +1,141 @@
+#include "scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Create a scheduler for up to capacity guests of program, which must stay
+loaded while the scheduler is used. Each slice runs about slice instructions;
+like any budget of execute_with_limits it ends at the next jump, CALL, RET or
+write to EIP.
+
+It returns 0 on success, or -1 if the guests cannot be allocated.
+*/
+int initialize_scheduler(Scheduler *sched, const System *program, int capacity,
+                         long long slice) {
+  memset(sched, 0, sizeof(*sched));
+  if (capacity < 1) capacity = 1;
+  sched->program = program;
+  sched->capacity = capacity;
+  sched->limits = (RunLimits){slice > 0 ? slice : 1, 0, NULL, 0};
+  sched->guests = calloc(capacity, sizeof(Guest));
+  sched->queue = malloc(capacity * sizeof(int));
+  sched->data = calloc((size_t)capacity * program->memory.data_size,
+                       sizeof(int));
+  if (sched->guests == NULL || sched->queue == NULL || sched->data == NULL) {
+    free_scheduler(sched);
+    return -1;
+  }
+  return 0;
+}
+
+void free_scheduler(Scheduler *sched) {
+  free(sched->guests);
+  free(sched->queue);
+  free(sched->data);
+  sched->guests = NULL;
+  sched->queue = NULL;
+  sched->data = NULL;
+  sched->num_guests = 0;
+}
+
+static void enqueue_guest(Scheduler *sched, int guest) {
+  int tail = sched->head + sched->count;
+  if (tail >= sched->capacity) tail -= sched->capacity;
+  sched->queue[tail] = guest;
+  sched->count++;
+  sched->guests[guest].queued = 1;
+}
+
+/*
+Add a ready guest that starts the program from the beginning with a cleared
+data segment. registers, if not NULL, gives its initial EAX, EDX, ECX, ESP and
+EBP; otherwise they start as after reset_system.
+
+It returns the index of the guest, or -1 if the scheduler is full.
+*/
+int add_guest(Scheduler *sched, const Registers *registers, void *data) {
+  if (sched->num_guests == sched->capacity) return -1;
+  int index = sched->num_guests++;
+  Guest *guest = &sched->guests[index];
+
+  // The guest shares the program as a view, like the lanes of a LaneGroup
+  guest->sys = *sched->program;
+  guest->sys.memory.arena = NULL;
+  guest->sys.memory.text = NULL;
+  guest->sys.memory.image = NULL;
+  guest->sys.memory.data =
+      sched->data + (size_t)index * sched->program->memory.data_size;
+  guest->sys.profile = NULL;
+  guest->sys.jit = NULL;
+  guest->sys.blocks = NULL;
+  guest->sys.trace = NULL;
+  guest->sys.sampler = NULL;
+  reset_system(&guest->sys);
+  if (registers != NULL) {
+    memcpy(guest->sys.registers, registers, EIP * sizeof(Registers));
+  }
+
+  guest->state = GUEST_READY;
+  guest->result = SUCCESS;
+  guest->executed = 0;
+  guest->data = data;
+  enqueue_guest(sched, index);
+  return index;
+}
+
+/* Park a ready guest: it keeps its state but is not run until wake_guest */
+void wait_guest(Scheduler *sched, int guest) {
+  if (sched->guests[guest].state != GUEST_READY) return;
+  sched->guests[guest].state = GUEST_WAITING;
+  sched->num_waiting++;
+}
+
+/* Make a waiting guest ready again; it runs after the guests already ready */
+void wake_guest(Scheduler *sched, int guest) {
+  Guest *g = &sched->guests[guest];
+  if (g->state != GUEST_WAITING) return;
+  g->state = GUEST_READY;
+  sched->num_waiting--;
+  if (!g->queued) enqueue_guest(sched, guest);
+}
+
+/*
+Event loop: run the ready guests in turn, one slice each, until every guest
+has finished or hook returns nonzero. Without a hook it also returns when
+only waiting guests are left. A guest waiting when it is taken from the queue
+is dropped from it and requeued by wake_guest.
+
+It returns the number of guests that have not finished.
+*/
+int run_scheduler(Scheduler *sched, SchedulerHook hook, void *data) {
+  for (;;) {
+    if (sched->count == 0) {
+      if (sched->num_waiting == 0 || hook == NULL) break;
+      if (hook(sched, -1, data) != 0) break;
+      continue;
+    }
+
+    int index = sched->queue[sched->head];
+    if (++sched->head == sched->capacity) sched->head = 0;
+    sched->count--;
+    Guest *guest = &sched->guests[index];
+    guest->queued = 0;
+    if (guest->state != GUEST_READY) continue;
+
+    RunResult run = execute_with_limits(&guest->sys, &sched->limits);
+    sched->switches++;
+    guest->executed += run.executed;
+    if (guest->result == SUCCESS) guest->result = run.result;
+    if (run.status != RUN_BUDGET_EXHAUSTED) {
+      guest->state = GUEST_FINISHED;
+      sched->num_finished++;
+    }
+
+    int stop = hook != NULL && hook(sched, index, data) != 0;
+    if (guest->state == GUEST_READY && !guest->queued) {
+      enqueue_guest(sched, index);
+    }
+    if (stop) break;
+  }
+  return sched->num_guests - sched->num_finished;
+}
@@ -0,0 +1,70 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+#include "interpreter.h"
+
+typedef enum GuestState {
+  GUEST_READY,    // runnable, in the run queue or running
+  GUEST_WAITING,  // parked by wait_guest until wake_guest
+  GUEST_FINISHED  // the program ended; result and executed are final
+} GuestState;
+
+/*
+One run of the program of a Scheduler. sys shares the decoded program and has
+its own registers and data segment, so a guest stopped at the end of a slice
+keeps its whole state and resumes exactly where it was.
+*/
+typedef struct Guest {
+  System sys;
+  GuestState state;
+  ExecResult result;   // error of the first failing instruction, or SUCCESS
+  long long executed;  // instructions run so far
+  int queued;          // 1 while the guest is in the run queue
+  void *data;          // for the host
+} Guest;
+
+typedef struct Scheduler Scheduler;
+
+/*
+Called by run_scheduler after each slice with the index of the guest that ran,
+and with -1 when no guest is ready but some are waiting. The host can park the
+guest with wait_guest, for example when it needs input, and wake guests whose
+input has arrived; with -1 it may block on its own event source. Returning
+nonzero makes run_scheduler return.
+*/
+typedef int (*SchedulerHook)(Scheduler *sched, int guest, void *data);
+
+/*
+Cooperative scheduler running many guests of one decoded program on the
+calling thread. Ready guests run in turn for a slice of about slice
+instructions through execute_with_limits, so a guest never holds the thread
+for longer than a slice and switching guests is a call returning and another
+starting. Use one scheduler per thread to spread guests over cores.
+
+All data segments come from one allocation of capacity segments of the size
+of the data segment of program.
+*/
+struct Scheduler {
+  const System *program;
+  Guest *guests;
+  int num_guests;
+  int capacity;
+  int *queue;  // ring of ready guests, capacity entries
+  int head;
+  int count;
+  int num_waiting;
+  int num_finished;
+  int *data;
+  RunLimits limits;
+  unsigned long long switches;  // slices run
+};
+
+int initialize_scheduler(Scheduler *sched, const System *program, int capacity,
+                         long long slice);
+void free_scheduler(Scheduler *sched);
+int add_guest(Scheduler *sched, const Registers *registers, void *data);
+void wait_guest(Scheduler *sched, int guest);
+void wake_guest(Scheduler *sched, int guest);
+int run_scheduler(Scheduler *sched, SchedulerHook hook, void *data);
+
+#endif
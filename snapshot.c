@@ -0,0 +1,208 @@
+#include "snapshot.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bytecode.h"
+
+// The data segment starts on a cache line of its own in the file
+#define SNAPSHOT_DATA_ALIGN 64
+
+/*
+Copy the registers, comparison flag and data segment of sys into snapshot.
+
+It returns 0 on success, or -1 if the copy cannot be allocated.
+*/
+int take_snapshot(Snapshot *snapshot, const System *sys) {
+  size_t size = (size_t)sys->memory.data_size * sizeof(int);
+  int *data = malloc(size);
+  if (data == NULL) return -1;
+  memcpy(data, sys->memory.data, size);
+
+  memcpy(snapshot->registers, sys->registers, sizeof(snapshot->registers));
+  snapshot->comparison_flag = sys->comparison_flag;
+  snapshot->comparison_source = sys->comparison_source;
+  snapshot->data_size = sys->memory.data_size;
+  snapshot->data = data;
+  snapshot->mapping = NULL;
+  snapshot->mapping_size = 0;
+  return 0;
+}
+
+/*
+Put sys back into the state recorded in snapshot: the registers and flag are
+copied and the data segment with a single memcpy. The program of sys is left
+as it is.
+
+It returns 0 on success, or -1 if the data segment of sys has another size.
+*/
+int restore_snapshot(System *sys, const Snapshot *snapshot) {
+  if (sys->memory.data_size != snapshot->data_size) return -1;
+  memcpy(sys->registers, snapshot->registers, sizeof(sys->registers));
+  sys->comparison_flag = snapshot->comparison_flag;
+  sys->comparison_source = snapshot->comparison_source;
+  memcpy(sys->memory.data, snapshot->data,
+         (size_t)snapshot->data_size * sizeof(int));
+  return 0;
+}
+
+void free_snapshot(Snapshot *snapshot) {
+  if (snapshot->mapping != NULL) {
+    munmap(snapshot->mapping, snapshot->mapping_size);
+  } else {
+    free((void *)snapshot->data);
+  }
+  snapshot->data = NULL;
+  snapshot->mapping = NULL;
+}
+
+/*
+Write the registers, comparison flag, data segment and decoded program of sys
+to filename in the format described in snapshot.h.
+
+It returns 0 on success, or -1 if the file cannot be written.
+*/
+int save_snapshot(const System *sys, const char *filename) {
+  SnapshotHeader header;
+  size_t data_bytes = (size_t)sys->memory.data_size * sizeof(int);
+  size_t data_offset = (sizeof(header) + SNAPSHOT_DATA_ALIGN - 1) /
+                       SNAPSHOT_DATA_ALIGN * SNAPSHOT_DATA_ALIGN;
+  static const char padding[SNAPSHOT_DATA_ALIGN];
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = BYTECODE_BYTE_ORDER;
+  header.instruction_size = sys->memory.instruction_size;
+  header.data_size = sys->memory.data_size;
+  for (int reg = EAX; reg <= EIP; reg++) {
+    header.registers[reg] = sys->registers[reg];
+  }
+  header.comparison_flag = sys->comparison_flag;
+  header.comparison_source = sys->comparison_source;
+  header.data_offset = data_offset;
+  header.bytecode_offset = data_offset + data_bytes;
+
+  FILE *file = fopen(filename, "wb");
+  if (!file) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(padding, 1, data_offset - sizeof(header), file);
+  fwrite(sys->memory.data, 1, data_bytes, file);
+  write_bytecode(sys, file);
+
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    perror("Error writing file");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+Create sys with the segment sizes recorded in filename, load the program into
+it and restore the state of the snapshot. snapshot keeps the file mapped for
+later restores and has to be released with free_snapshot; sys with
+free_system.
+
+It returns 0 on success, or -1 if the file cannot be read or is not a snapshot
+of this version. Nothing needs to be released on failure.
+*/
+int load_snapshot(Snapshot *snapshot, System *sys, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Error opening file");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  size_t file_size = st.st_size;
+  if (file_size < sizeof(SnapshotHeader)) {
+    fprintf(stderr, "Error: %s is not a snapshot file\n", filename);
+    close(fd);
+    return -1;
+  }
+  char *src = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (src == MAP_FAILED) {
+    perror("Error mapping file");
+    return -1;
+  }
+
+  const SnapshotHeader *header = (const SnapshotHeader *)src;
+  size_t data_bytes = (size_t)header->data_size * sizeof(int);
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+    fprintf(stderr, "Error: %s is not a snapshot file\n", filename);
+    goto fail;
+  }
+  if (header->version != SNAPSHOT_VERSION ||
+      header->byte_order != BYTECODE_BYTE_ORDER) {
+    fprintf(stderr, "Error: %s was written by an incompatible version\n",
+            filename);
+    goto fail;
+  }
+  if (header->data_offset < sizeof(*header) ||
+      header->data_offset % sizeof(int) != 0 ||
+      header->bytecode_offset != header->data_offset + data_bytes ||
+      header->bytecode_offset > file_size) {
+    fprintf(stderr, "Error: %s is truncated or corrupt\n", filename);
+    goto fail;
+  }
+  if (initialize_system_with_size(sys, header->instruction_size,
+                                  header->data_size) != 0) {
+    perror("Error creating system");
+    goto fail;
+  }
+  if (load_bytecode(sys, src + header->bytecode_offset,
+                    file_size - header->bytecode_offset, filename) != 0) {
+    free_system(sys);
+    goto fail;
+  }
+
+  for (int reg = EAX; reg <= EIP; reg++) {
+    snapshot->registers[reg] = header->registers[reg];
+  }
+  snapshot->comparison_flag = header->comparison_flag;
+  snapshot->comparison_source = header->comparison_source;
+  snapshot->data_size = header->data_size;
+  snapshot->data = (const int *)(src + header->data_offset);
+  snapshot->mapping = src;
+  snapshot->mapping_size = file_size;
+  restore_snapshot(sys, snapshot);
+  return 0;
+
+fail:
+  munmap(src, file_size);
+  return -1;
+}
+
+/*
+Run the program from EIP like execute_decoded_instructions until it stops or
+EIP reaches address, which is not executed. *reached is set to 1 if the run
+stopped at address. Use it to run the setup prefix of a program before a
+snapshot is taken.
+*/
+ExecResult execute_to_address(System *sys, int address, int *reached) {
+  ExecResult status = SUCCESS;
+  int halted = 0;
+
+  *reached = 0;
+  while (!halted) {
+    if (sys->registers[EIP] == address) {
+      *reached = 1;
+      break;
+    }
+    ExecResult result = step_instruction(sys, &halted);
+    if (!halted && status == SUCCESS) {
+      status = result;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,62 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "interpreter.h"
+
+#define SNAPSHOT_MAGIC "ASSN"
+#define SNAPSHOT_VERSION 2
+
+/*
+Layout of a snapshot file:
+
+  SnapshotHeader
+  int32[data_size]    the data segment, at data_offset
+  bytecode            the decoded program in the .asmbc format (bytecode.h),
+                      from bytecode_offset to the end of the file
+
+The version, byte order and instruction record size of the bytecode are
+checked by load_bytecode as for a .asmbc file.
+*/
+typedef struct SnapshotHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;  // BYTECODE_BYTE_ORDER as written by the producer
+  uint32_t instruction_size;
+  uint32_t data_size;
+  int32_t registers[6];
+  int32_t comparison_flag;
+  int32_t comparison_source;
+  uint32_t data_offset;
+  uint32_t bytecode_offset;
+} SnapshotHeader;
+
+/*
+Registers, comparison flag and data segment of a System at some point of a
+run. The program is not part of a snapshot taken in memory: it is restored
+into systems that run the same program, usually attached to the system the
+snapshot was taken from with attach_program.
+
+A snapshot loaded from a file keeps the file mapped privately and read-only,
+and data points into the mapping, so every restore is a single copy out of
+the page cache that all processes using the file share.
+*/
+typedef struct Snapshot {
+  Registers registers[6];
+  int comparison_flag;
+  int comparison_source;
+  int data_size;
+  const int *data;
+  void *mapping;  // file mapping data points into, or NULL if data is a copy
+  size_t mapping_size;
+} Snapshot;
+
+int take_snapshot(Snapshot *snapshot, const System *sys);
+int restore_snapshot(System *sys, const Snapshot *snapshot);
+void free_snapshot(Snapshot *snapshot);
+int save_snapshot(const System *sys, const char *filename);
+int load_snapshot(Snapshot *snapshot, System *sys, const char *filename);
+ExecResult execute_to_address(System *sys, int address, int *reached);
+
+#endif
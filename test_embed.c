@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "embed.h"
+
+/*
+Tests of the embedding API (embed.h), run by `make check`. Program text
+comes from callers of a long-running service here, so malformed programs must
+fail to load with an error on the handle and leave it usable.
+*/
+
+static int failures = 0;
+
+#define CHECK(condition)                                          \
+  do {                                                            \
+    if (!(condition)) {                                           \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,      \
+              __LINE__, #condition);                              \
+      failures++;                                                 \
+    }                                                             \
+  } while (0)
+
+/* Load text into interp and expect the load to fail with an error set */
+static void check_load_error(Interpreter *interp, const char *text) {
+  CHECK(load_interpreter_buffer(interp, text, strlen(text)) == -1);
+  CHECK(get_interpreter_error(interp)[0] != '\0');
+}
+
+/* Load and run text, expecting EAX to end as eax */
+static void check_run(Interpreter *interp, const char *text, int eax) {
+  Registers registers[6] = {0, 0, 0, 0, 0, 0};
+  registers[ESP] = registers[EBP] = MEMORY_SIZE - 256;
+  CHECK(load_interpreter_buffer(interp, text, strlen(text)) == 0);
+  RunResult run = run_interpreter(interp, registers, NULL);
+  CHECK(run.status == RUN_FINISHED && run.result == SUCCESS);
+  CHECK(registers[EAX] == eax);
+}
+
+static void test_overlong_tokens(Interpreter *interp) {
+  // Longer than the token buffers of the decoder and the string engine
+  check_load_error(interp,
+                   "MOVL $1234567890123456789012345678901234567890 %EAX\n"
+                   "END\n");
+  check_load_error(interp, "MOVL $1 1234567890123456789012(%EAX)\nEND\n");
+  check_load_error(interp, "MOVLMOVLMOVLMOVLMOVLMOVL $1 %EAX\nEND\n");
+  check_load_error(interp,
+                   "JMP .a_label_longer_than_a_token\n"
+                   ".a_label_longer_than_a_token\nEND\n");
+
+  // Tokens that just fit still load, and the handle is still usable
+  check_run(interp, "MOVL $000000000000000042 %EAX\nEND\n", 42);
+  check_run(interp,
+            "MOVL $5 -000000000004(%EBP)\n"
+            "MOVL -000000000004(%EBP) %EAX\nEND\n",
+            5);
+}
+
+int main(void) {
+  Engine engines[] = {ENGINE_DECODED, ENGINE_STRING};
+  for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+    Interpreter *interp = create_interpreter(MEMORY_SIZE, MEMORY_SIZE,
+                                             engines[i]);
+    if (interp == NULL) {
+      perror("Error creating interpreter");
+      return EXIT_FAILURE;
+    }
+    test_overlong_tokens(interp);
+    free_interpreter(interp);
+  }
+  if (failures != 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("All embedding tests passed\n");
+  return 0;
+}
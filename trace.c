@@ -0,0 +1,588 @@
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef TRACE_ZLIB
+#include <zlib.h>
+#endif
+
+// Number of steps the ring holds, a power of two
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE (1 << 16)
+#endif
+
+// How often the drain thread hands ring slots back to the interpreter
+#define TRACE_RELEASE_EVERY 1024
+
+#define STATE_RECORD 0xff
+#define FILL_RECORD 0xfe
+#define COPY_RECORD 0xfd
+
+/* A step record starts with opcode | result << 5, so opcodes must fit in five
+ * bits and can never be mistaken for the other records */
+_Static_assert(OP_END < 31, "opcodes do not fit the step record");
+#define FLAG_BIT 0x40
+#define WRITE_BIT 0x80
+
+// Longest encoded record: two bytes and ten varints of up to five bytes
+#define MAX_RECORD 52
+
+/* A step as recorded by the interpreter thread: the instruction and the state
+ * it left. address is -1 if no data word was written. For FILL_RECORD and
+ * COPY_RECORD, address is the first word of the range and value the word
+ * stored or the address copied from. */
+typedef struct TraceEvent {
+  unsigned char op;  // opcode, STATE_RECORD, FILL_RECORD or COPY_RECORD
+  unsigned char result;
+  int registers[6];
+  int flag;
+  int source;
+  int address;
+  int value;
+  int count;  // words of a range record
+} TraceEvent;
+
+/*
+The ring is single producer, single consumer: only the interpreter moves tail
+and only the drain thread moves head, each on its own cache line. Everything
+below thread is owned by the drain thread while it runs.
+*/
+struct Trace {
+  TraceEvent *ring;
+  _Alignas(64) _Atomic size_t tail;  // next slot the interpreter fills
+  size_t cached_head;                // head as last seen by the interpreter
+  _Alignas(64) _Atomic size_t head;  // next slot the drain thread reads
+  atomic_int closing;
+  pthread_t thread;
+
+  FILE *file;
+#ifdef TRACE_ZLIB
+  gzFile gz;
+#endif
+  int failed;  // set once a write fails; later output is dropped
+  size_t used;
+  int registers[6];  // state as of the last record written
+  int flag;
+  int source;
+  int address;
+  unsigned char buffer[1 << 16];
+};
+
+/* Write out the buffered bytes */
+static void flush_buffer(Trace *trace) {
+  if (trace->used > 0 && !trace->failed) {
+#ifdef TRACE_ZLIB
+    if (trace->gz != NULL) {
+      trace->failed = gzwrite(trace->gz, trace->buffer,
+                              (unsigned)trace->used) != (int)trace->used;
+    } else
+#endif
+      trace->failed =
+          fwrite(trace->buffer, 1, trace->used, trace->file) != trace->used;
+  }
+  trace->used = 0;
+}
+
+/* The wrapped difference a - b */
+static int difference(int a, int b) {
+  return (int)((unsigned int)a - (unsigned int)b);
+}
+
+/* Append value as a zigzag varint, so small values of either sign take one
+ * byte. The caller makes sure the buffer has room. */
+static void put_varint(Trace *trace, int value) {
+  unsigned int v = ((unsigned int)value << 1) ^ -(unsigned int)(value < 0);
+  while (v >= 0x80) {
+    trace->buffer[trace->used++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  trace->buffer[trace->used++] = (unsigned char)v;
+}
+
+/* Encode one event against the state left by the previous one */
+static void encode_event(Trace *trace, const TraceEvent *event) {
+  if (trace->used + MAX_RECORD > sizeof(trace->buffer)) {
+    flush_buffer(trace);
+  }
+
+  if (event->op == FILL_RECORD || event->op == COPY_RECORD) {
+    trace->buffer[trace->used++] = event->op;
+    put_varint(trace, difference(event->address, trace->address));
+    put_varint(trace, event->count);
+    put_varint(trace, event->op == FILL_RECORD
+                          ? event->value
+                          : difference(event->value, event->address));
+    trace->address = event->address;
+    return;
+  }
+
+  if (event->op == STATE_RECORD) {
+    trace->buffer[trace->used++] = STATE_RECORD;
+    for (int reg = EAX; reg <= EIP; reg++) {
+      put_varint(trace, event->registers[reg]);
+    }
+    put_varint(trace, event->flag);
+    put_varint(trace, event->source);
+  } else {
+    int next = difference(trace->registers[EIP], -4);
+    unsigned int mask = 0;
+    for (int reg = EAX; reg < EIP; reg++) {
+      if (event->registers[reg] != trace->registers[reg]) mask |= 1u << reg;
+    }
+    if (event->registers[EIP] != next) mask |= 1u << EIP;
+    if (event->flag != trace->flag || event->source != trace->source) {
+      mask |= FLAG_BIT;
+    }
+    if (event->address >= 0) mask |= WRITE_BIT;
+
+    trace->buffer[trace->used++] = event->op | event->result << 5;
+    trace->buffer[trace->used++] = (unsigned char)mask;
+    for (int reg = EAX; reg < EIP; reg++) {
+      if (mask & 1u << reg) {
+        put_varint(trace, difference(event->registers[reg],
+                                     trace->registers[reg]));
+      }
+    }
+    if (mask & 1u << EIP) {
+      put_varint(trace, difference(event->registers[EIP], next));
+    }
+    if (mask & FLAG_BIT) {
+      put_varint(trace, difference(event->flag, trace->flag));
+      put_varint(trace, difference(event->source, trace->source));
+    }
+    if (mask & WRITE_BIT) {
+      put_varint(trace, difference(event->address, trace->address));
+      put_varint(trace, event->value);
+      trace->address = event->address;
+    }
+  }
+  memcpy(trace->registers, event->registers, sizeof(trace->registers));
+  trace->flag = event->flag;
+  trace->source = event->source;
+}
+
+/* Body of the drain thread: encode events until the trace is closed and the
+ * ring is empty, sleeping briefly whenever there is nothing to do */
+static void *drain_trace(void *arg) {
+  Trace *trace = arg;
+  const struct timespec pause = {0, 100000};
+  size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+  for (;;) {
+    int closing = atomic_load_explicit(&trace->closing, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (head == tail) {
+      if (closing) break;
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    while (head != tail) {
+      encode_event(trace, &trace->ring[head & (TRACE_RING_SIZE - 1)]);
+      head++;
+      if (head % TRACE_RELEASE_EVERY == 0) {
+        atomic_store_explicit(&trace->head, head, memory_order_release);
+      }
+    }
+    atomic_store_explicit(&trace->head, head, memory_order_release);
+  }
+  flush_buffer(trace);
+  return NULL;
+}
+
+/* Close the output of the trace; it returns -1 if that or any write failed */
+static int close_output(Trace *trace) {
+  int failed = trace->failed;
+#ifdef TRACE_ZLIB
+  if (trace->gz != NULL) {
+    failed |= gzclose(trace->gz) != Z_OK;
+  } else
+#endif
+    if (trace->file != NULL) {
+      failed |= fclose(trace->file) != 0;
+    }
+  return failed ? -1 : 0;
+}
+
+/*
+Create filename and start the thread that writes the trace into it. With
+compress set the file is gzip-compressed, which needs a build with TRACE_ZLIB.
+
+It returns the trace, or NULL with errno set if the file, the ring or the
+thread cannot be created.
+*/
+Trace *open_trace(const char *filename, int compress) {
+#ifndef TRACE_ZLIB
+  if (compress) {
+    errno = ENOTSUP;
+    return NULL;
+  }
+#endif
+  // sizeof(Trace) is a multiple of its 64 byte alignment
+  Trace *trace = aligned_alloc(_Alignof(Trace), sizeof(Trace));
+  if (trace == NULL) return NULL;
+  memset(trace, 0, sizeof(Trace));
+  trace->ring = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+  if (trace->ring == NULL) {
+    free(trace);
+    return NULL;
+  }
+
+#ifdef TRACE_ZLIB
+  if (compress) {
+    trace->gz = gzopen(filename, "wb1");  // fastest level keeps up best
+  } else
+#endif
+    trace->file = fopen(filename, "wb");
+#ifdef TRACE_ZLIB
+  if (trace->gz == NULL && trace->file == NULL) {
+#else
+  if (trace->file == NULL) {
+#endif
+    free(trace->ring);
+    free(trace);
+    return NULL;
+  }
+
+  memcpy(trace->buffer, TRACE_MAGIC, strlen(TRACE_MAGIC));
+  trace->used = strlen(TRACE_MAGIC);
+  trace->buffer[trace->used++] = TRACE_VERSION;
+  atomic_init(&trace->head, 0);
+  atomic_init(&trace->tail, 0);
+  atomic_init(&trace->closing, 0);
+
+  int error = pthread_create(&trace->thread, NULL, drain_trace, trace);
+  if (error != 0) {
+    close_output(trace);
+    free(trace->ring);
+    free(trace);
+    errno = error;
+    return NULL;
+  }
+  return trace;
+}
+
+/*
+Wait for the drain thread to write out everything recorded so far, then close
+the file and free the trace.
+
+It returns 0 on success, or -1 if the trace could not be written completely.
+*/
+int close_trace(Trace *trace) {
+  if (trace == NULL) return 0;
+  atomic_store_explicit(&trace->closing, 1, memory_order_release);
+  pthread_join(trace->thread, NULL);
+  int result = close_output(trace);
+  free(trace->ring);
+  free(trace);
+  return result;
+}
+
+/* Next free slot of the ring, waiting for the drain thread if it is full */
+static inline TraceEvent *reserve_event(Trace *trace) {
+  size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+  while (tail - trace->cached_head == TRACE_RING_SIZE) {
+    trace->cached_head =
+        atomic_load_explicit(&trace->head, memory_order_acquire);
+    if (tail - trace->cached_head == TRACE_RING_SIZE) sched_yield();
+  }
+  return &trace->ring[tail & (TRACE_RING_SIZE - 1)];
+}
+
+/* Hand the slot returned by reserve_event to the drain thread */
+static inline void publish_event(Trace *trace) {
+  size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+  atomic_store_explicit(&trace->tail, tail + 1, memory_order_release);
+}
+
+/* Address of the data word inst writes if it succeeds, or -1. A CALL whose
+ * push fails still succeeds, so the address is checked here. */
+static int written_address(const System *sys, const Instruction *inst) {
+  unsigned address;
+  switch (inst->op) {
+    case OP_MOVL:
+    case OP_ADDL:
+    case OP_SUBL:
+    case OP_IMULL:
+    case OP_ANDL:
+    case OP_ORL:
+    case OP_XORL:
+    case OP_SHLL:
+    case OP_SARL:
+    case OP_INCL:
+    case OP_DECL:
+    case OP_POPL:
+      if (inst->dst.type != MEM || inst->dst.reg >= NOT_REG) return -1;
+      address = (unsigned)sys->registers[inst->dst.reg] + inst->dst.value;
+      break;
+    case OP_PUSHL:
+    case OP_CALL:
+      address = (unsigned)sys->registers[ESP] - 4;
+      break;
+    default:
+      return -1;
+  }
+  return address > (unsigned)sys->memory.data_limit ? -1 : (int)address;
+}
+
+/*
+Fill in the range record of a MOVSL or STOSL at inst, to be recorded if it
+succeeds, from the state before it runs. It returns 0 if inst writes no range.
+*/
+static int written_range(const System *sys, const Instruction *inst,
+                         TraceEvent *range) {
+  if (inst->op != OP_MOVSL && inst->op != OP_STOSL) return 0;
+  if (inst->dst.type != MEM || sys->registers[ECX] == 0) return 0;
+  range->op = inst->op == OP_MOVSL ? COPY_RECORD : FILL_RECORD;
+  range->count = sys->registers[ECX];
+  range->address =
+      (int)((unsigned)sys->registers[inst->dst.reg] + inst->dst.value);
+  if (inst->op == OP_MOVSL) {
+    if (inst->src.type != MEM) return 0;
+    range->value =
+        (int)((unsigned)sys->registers[inst->src.reg] + inst->src.value);
+  } else if (inst->src.type == REG) {
+    range->value = sys->registers[inst->src.reg];
+  } else {
+    range->value = inst->src.value;
+  }
+  return 1;
+}
+
+/*
+Run the program like execute_decoded_instructions, recording the state at the
+start of the run and every step into sys->trace. Encoding and writing the
+trace happen on the drain thread, so this loop only pays for a copy of the
+registers per step, and waits only when the ring is full.
+*/
+ExecResult execute_traced_instructions(System *sys) {
+  Trace *trace = sys->trace;
+  const Instruction *code = sys->memory.code;
+  const int *data = sys->memory.data;
+  const int *registers = sys->registers;
+  ExecResult status = SUCCESS;
+  int halted = 0;
+
+  TraceEvent *event = reserve_event(trace);
+  event->op = STATE_RECORD;
+  memcpy(event->registers, registers, sizeof(event->registers));
+  event->flag = sys->comparison_flag;
+  event->source = sys->comparison_source;
+  publish_event(trace);
+
+  for (;;) {
+    int pc = registers[EIP] / 4;
+    if (registers[EIP] < 0 || pc >= sys->memory.num_instructions) break;
+    const Instruction *inst = &code[pc];
+    int address = written_address(sys, inst);
+    TraceEvent range;
+    int has_range = written_range(sys, inst, &range);
+
+    ExecResult result = step_instruction(sys, &halted);
+    event = reserve_event(trace);
+    event->op = inst->op;
+    event->result = result;
+    memcpy(event->registers, registers, sizeof(event->registers));
+    event->flag = sys->comparison_flag;
+    event->source = sys->comparison_source;
+    event->address = result == SUCCESS ? address : -1;
+    if (event->address >= 0) event->value = data[address / 4];
+    publish_event(trace);
+    if (has_range && result == SUCCESS) {
+      *reserve_event(trace) = range;
+      publish_event(trace);
+    }
+    if (halted) break;
+
+    if (status == SUCCESS) {
+      status = result;
+    }
+  }
+  return status;
+}
+
+/* Buffered input of decode_trace */
+typedef struct TraceReader {
+  FILE *file;
+#ifdef TRACE_ZLIB
+  gzFile gz;
+#endif
+  unsigned char buffer[1 << 16];
+  size_t used;
+  size_t length;
+} TraceReader;
+
+/* Next byte of the trace, or -1 at the end of the file */
+static int get_byte(TraceReader *reader) {
+  if (reader->used == reader->length) {
+#ifdef TRACE_ZLIB
+    int length = gzread(reader->gz, reader->buffer, sizeof(reader->buffer));
+    reader->length = length > 0 ? (size_t)length : 0;
+#else
+    reader->length =
+        fread(reader->buffer, 1, sizeof(reader->buffer), reader->file);
+#endif
+    reader->used = 0;
+    if (reader->length == 0) return -1;
+  }
+  return reader->buffer[reader->used++];
+}
+
+/* Read a zigzag varint into *value; it returns -1 at the end of the file */
+static int get_varint(TraceReader *reader, int *value) {
+  unsigned int v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    int byte = get_byte(reader);
+    if (byte < 0) return -1;
+    v |= (unsigned int)(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *value = (int)((v >> 1) ^ -(v & 1));
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static const char *const register_names[] = {"EAX", "EDX", "ECX",
+                                             "ESP", "EBP", "EIP"};
+
+/* Decode the next record and print it; it returns 1 at the end of the trace,
+ * 0 after a record and -1 if the trace is corrupt or truncated */
+static int print_record(TraceReader *reader, FILE *out, int *registers,
+                        int *flag, int *source, int *address) {
+  int byte = get_byte(reader);
+  if (byte < 0) return 1;
+
+  if (byte == STATE_RECORD) {
+    fprintf(out, "state");
+    for (int reg = EAX; reg <= EIP; reg++) {
+      if (get_varint(reader, &registers[reg]) != 0) return -1;
+      fprintf(out, " %%%s=%d", register_names[reg], registers[reg]);
+    }
+    if (get_varint(reader, flag) != 0) return -1;
+    if (get_varint(reader, source) != 0) return -1;
+    fprintf(out, " flag=%d source=%d\n", *flag, *source);
+    return 0;
+  }
+
+  if (byte == FILL_RECORD || byte == COPY_RECORD) {
+    int delta, count, value;
+    if (get_varint(reader, &delta) != 0) return -1;
+    if (get_varint(reader, &count) != 0) return -1;
+    if (get_varint(reader, &value) != 0) return -1;
+    *address = difference(*address, -delta);
+    int last = difference(*address, -4 * (count - 1));
+    if (byte == FILL_RECORD) {
+      fprintf(out, "%12s [%d..%d]=%d\n", "", *address, last, value);
+    } else {
+      int from = difference(*address, -value);
+      fprintf(out, "%12s [%d..%d]=[%d..%d]\n", "", *address, last, from,
+              difference(from, -4 * (count - 1)));
+    }
+    return 0;
+  }
+
+  int op = byte & 0x1f, result = byte >> 5;
+  int mask = get_byte(reader);
+  int delta, value;
+  if (op > OP_END || mask < 0) return -1;
+
+  fprintf(out, "%6d %-5s", registers[EIP], get_opcode_name(op));
+  for (int reg = EAX; reg < EIP; reg++) {
+    if (!(mask & 1 << reg)) continue;
+    if (get_varint(reader, &delta) != 0) return -1;
+    registers[reg] = difference(registers[reg], -delta);
+    fprintf(out, " %%%s=%d", register_names[reg], registers[reg]);
+  }
+  int next = difference(registers[EIP], -4);
+  if (mask & 1 << EIP) {
+    if (get_varint(reader, &delta) != 0) return -1;
+    registers[EIP] = difference(next, -delta);
+    fprintf(out, " %%EIP=%d", registers[EIP]);
+  } else {
+    registers[EIP] = next;
+  }
+  if (mask & FLAG_BIT) {
+    if (get_varint(reader, &delta) != 0) return -1;
+    *flag = difference(*flag, -delta);
+    if (get_varint(reader, &delta) != 0) return -1;
+    *source = difference(*source, -delta);
+    fprintf(out, " flag=%d source=%d", *flag, *source);
+  }
+  if (mask & WRITE_BIT) {
+    if (get_varint(reader, &delta) != 0) return -1;
+    if (get_varint(reader, &value) != 0) return -1;
+    *address = difference(*address, -delta);
+    fprintf(out, " [%d]=%d", *address, value);
+  }
+  if (result != SUCCESS) {
+    fprintf(out, " %s", get_result_name(result));
+  }
+  fputc('\n', out);
+  return 0;
+}
+
+/*
+Print the trace in filename as text, one line per record: the address and
+opcode of every step followed by what it changed, and the full state at the
+start of every run. Builds with TRACE_ZLIB read compressed traces too.
+
+It returns 0 on success, or -1 if the file cannot be read or is not a valid
+trace.
+*/
+int decode_trace(const char *filename, FILE *out) {
+  TraceReader *reader = calloc(1, sizeof(TraceReader));
+  int registers[6] = {0}, flag = 0, source = 0, address = 0, result = 0;
+  size_t magic_length = strlen(TRACE_MAGIC);
+
+  if (reader == NULL) {
+    perror("Error decoding trace");
+    return -1;
+  }
+#ifdef TRACE_ZLIB
+  reader->gz = gzopen(filename, "rb");
+  if (reader->gz == NULL) {
+#else
+  reader->file = fopen(filename, "rb");
+  if (reader->file == NULL) {
+#endif
+    perror("Error opening trace");
+    free(reader);
+    return -1;
+  }
+
+  for (size_t i = 0; i <= magic_length && result == 0; i++) {
+    int byte = get_byte(reader);
+    if (i == 0 && byte == 0x1f) {
+      fprintf(stderr, "Error: %s is compressed; build with TRACE_ZLIB=1 to "
+              "read it\n", filename);
+      result = -1;
+    } else if (i < magic_length ? byte != TRACE_MAGIC[i]
+                                : byte != TRACE_VERSION) {
+      fprintf(stderr, "Error: %s is not a version %d trace\n", filename,
+              TRACE_VERSION);
+      result = -1;
+    }
+  }
+
+  if (result == 0) {
+    do {
+      result = print_record(reader, out, registers, &flag, &source,
+                            &address);
+    } while (result == 0);
+    if (result < 0) {
+      fprintf(stderr, "Error: %s is truncated or corrupt\n", filename);
+    }
+  }
+
+#ifdef TRACE_ZLIB
+  gzclose(reader->gz);
+#else
+  fclose(reader->file);
+#endif
+  free(reader);
+  return result < 0 ? -1 : 0;
+}
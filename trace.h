@@ -0,0 +1,46 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdio.h>
+#include "interpreter.h"
+
+/*
+Execution trace written by execute_traced_instructions when sys->trace is set.
+
+Every step is recorded into a ring buffer by the interpreter thread and a
+background thread drains the ring into the trace file, so the run itself only
+copies the registers after each step. The file starts with TRACE_MAGIC and a
+version byte, and holds:
+
+  state record  0xff, then EAX, EDX, ECX, ESP, EBP, EIP, the comparison
+                flag and the comparison source as zigzag varints, written at
+                the start of every run
+  step record   opcode | result << 5, a byte with bit i set when register i
+                changed (bit 5: EIP is not the next instruction, bit 6: the
+                comparison flag or source changed, bit 7: a data word was
+                written), then for every set bit in that order zigzag varints:
+                the change of the register, EIP minus the next address, the
+                changes of the flag and the source, and for a write the change
+                of the address since the last write followed by the value
+                written
+  fill record   0xfe, then the change of the address since the last write,
+                the number of words and the value stored, written after the
+                step record of a STOSL that stored anything
+  copy record   0xfd, then the change of the address since the last write,
+                the number of words and the address copied from minus the
+                address, written after the step record of such a MOVSL
+
+The EIP of a step is the EIP left by the previous one. Builds with
+-DTRACE_ZLIB (make TRACE_ZLIB=1) can write the whole file gzip-compressed.
+*/
+#define TRACE_MAGIC "ASMTRACE"
+#define TRACE_VERSION 4
+
+typedef struct Trace Trace;
+
+Trace *open_trace(const char *filename, int compress);
+int close_trace(Trace *trace);
+ExecResult execute_traced_instructions(System *sys);
+int decode_trace(const char *filename, FILE *out);
+
+#endif
@@ -0,0 +1,12 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "trace.h"
+
+/* Print a trace written with --trace as text */
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    printf("Usage: %s <trace_file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  return decode_trace(argv[1], stdout) == 0 ? 0 : EXIT_FAILURE;
+}